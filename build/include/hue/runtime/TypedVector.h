@@ -0,0 +1,954 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+//
+// An immutable and persistent vector of unboxed values. It's the same kind of
+// trie as Vector (see Vector.h) but leaves store native values (e.g. int64_t or
+// uint8_t) instead of void* and branches only store child nodes, so a vector of
+// bytes uses a byte per item instead of eight.
+//
+// Leaves have a fixed byte budget (LeafBytes) rather than a fixed number of
+// items, which means a leaf holds 32 Ints or Floats, 64 Chars or 256 Bytes.
+// Branches always have a branching factor of 32. A leaf is contiguous memory
+// with natively aligned items, so a ChunkIterator can be used to run plain loops
+// (which the compiler may vectorize) over a vector.
+//
+// Typed vectors are never relaxed (see Vector.h), so concat, drop and slice copy
+// the items that don't line up with whole leaves and take O(n) time. Leaves that
+// do line up are shared.
+//
+#ifndef _HUE_RUNTIME_TYPED_VECTOR_INCLUDED
+#define _HUE_RUNTIME_TYPED_VECTOR_INCLUDED
+
+#include <hue/runtime/object.h>
+#include <hue/Text.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <stdexcept>
+
+#ifdef DEBUG_TypedNode_refcount
+static size_t live_typed_node_count = 0;
+#define DEBUG_LIVECOUNT_TypedNode live_typed_node_count
+#define DEBUG_LIVECOUNT_TypedNode_INC HUE_DEBUG_COUNT_INC(DEBUG_LIVECOUNT_TypedNode);
+#define DEBUG_LIVECOUNT_TypedNode_DEC HUE_DEBUG_COUNT_DEC(DEBUG_LIVECOUNT_TypedNode);
+#else
+#define DEBUG_LIVECOUNT_TypedNode_INC
+#define DEBUG_LIVECOUNT_TypedNode_DEC
+#endif
+
+#ifdef DEBUG_TypedVector_refcount
+static size_t live_typed_vector_count = 0;
+#define DEBUG_LIVECOUNT_TypedVector live_typed_vector_count
+#define DEBUG_LIVECOUNT_TypedVector_INC HUE_DEBUG_COUNT_INC(DEBUG_LIVECOUNT_TypedVector);
+#define DEBUG_LIVECOUNT_TypedVector_DEC HUE_DEBUG_COUNT_DEC(DEBUG_LIVECOUNT_TypedVector);
+#else
+#define DEBUG_LIVECOUNT_TypedVector_INC
+#define DEBUG_LIVECOUNT_TypedVector_DEC
+#endif
+
+namespace hue {
+
+// log2 of N, which must be a power of two
+template <size_t N> struct _Log2 { enum { value = 1 + _Log2<N / 2>::value }; };
+template <> struct _Log2<1> { enum { value = 0 }; };
+
+
+template <typename T>
+class TypedVector { HUE_POOLED_OBJECT(TypedVector)
+public:
+  typedef T Item;
+
+  // Number of bytes of items a leaf holds
+  static const size_t LeafBytes = 256;
+  // Number of items a leaf holds
+  static const size_t LeafSize = LeafBytes / sizeof(T);
+  // Number of index bits used for the position in a leaf
+  static const uint32_t LeafBits = _Log2<LeafSize>::value;
+
+  // Maximum number of branch levels (LeafBits + 5*13 bits > 64 bits)
+  static const int MaxDepth = 13;
+
+private:
+  // A leaf holding up to LeafSize items
+  class Leaf { HUE_POOLED_OBJECT(Leaf)
+  public:
+    uint16_t length;
+    uint16_t capacity; // number of items allocated for data (>= length)
+
+    // Must be the last member
+    T data[0];
+
+    static Leaf* create(uint16_t length) {
+      Leaf* leaf = alloc(length);
+      leaf->length = length;
+      return leaf;
+    }
+
+    // Creates a copy of the first *length* items of *other* (or all of them if
+    // other is shorter) with room for *capacity* items
+    static Leaf* create(const Leaf& other, uint16_t length, uint16_t capacity) {
+      assert(length <= capacity);
+      Leaf* leaf = alloc(capacity);
+      memcpy(leaf->data, other.data, sizeof(T) * ((length < other.length) ? length : other.length));
+      leaf->length = length;
+      return leaf;
+    }
+
+    static Leaf* create(const Leaf& other, uint16_t length) {
+      return create(other, length, length);
+    }
+
+    // Creates an empty leaf with room for *capacity* items. Used by transients
+    // which fill leaves in place.
+    static Leaf* createWithCapacity(uint16_t capacity) {
+      Leaf* leaf = alloc(capacity);
+      leaf->length = 0;
+      return leaf;
+    }
+
+  private:
+    inline size_t allocSize() const { return sizeof(Leaf) + (sizeof(T) * capacity); }
+
+    inline static Leaf* alloc(uint16_t capacity) {
+      DEBUG_LIVECOUNT_TypedNode_INC
+      Leaf* leaf = __alloc(sizeof(Leaf) + (sizeof(T) * capacity));
+      leaf->capacity = capacity;
+      return leaf;
+    }
+
+    void dealloc() {
+      DEBUG_LIVECOUNT_TypedNode_DEC
+    }
+  };
+
+  // A branch holding up to 32 children, which are either all leaves or all
+  // branches
+  class Branch { HUE_POOLED_OBJECT(Branch)
+  public:
+    static const Branch _Empty;
+    static Branch* Empty;
+
+    uint8_t length;
+    uint8_t capacity; // number of children allocated for data (>= length)
+    bool leaves; // true if the children are leaves
+
+    // Must be the last member
+    void* data[0];
+
+    static Branch* create(uint8_t length, bool leaves) {
+      Branch* node = alloc(length, leaves);
+      node->length = length;
+      return node;
+    }
+
+    // Creates a copy of the first *length* children of *other* (or all of them
+    // if other is shorter) with room for *capacity* children
+    static Branch* create(const Branch& other, uint8_t length, uint8_t capacity) {
+      assert(length <= capacity);
+      Branch* node = alloc(capacity, other.leaves);
+      uint8_t n = (length < other.length) ? length : other.length;
+      memcpy(node->data, other.data, sizeof(void*) * n);
+      node->length = length;
+
+      // Increase refcount of the shallow-copied children
+      for (uint8_t i = 0; i < n; ++i) node->retainChild(i);
+
+      return node;
+    }
+
+    static Branch* create(const Branch& other, uint8_t length) {
+      return create(other, length, length);
+    }
+
+    static Branch* createWithCapacity(uint8_t capacity, bool leaves) {
+      Branch* node = alloc(capacity, leaves);
+      node->length = 0;
+      return node;
+    }
+
+    inline Branch* getBranch(uint8_t i) const {
+      assert(!leaves && i < length);
+      return (Branch*)data[i];
+    }
+
+    inline Leaf* getLeaf(uint8_t i) const {
+      assert(leaves && i < length);
+      return (Leaf*)data[i];
+    }
+
+    inline void setBranch(uint8_t i, Branch* node, RefRule refrule = RetainReference) {
+      assert(!leaves);
+      if (refrule == RetainReference) node->retain();
+      releaseChild(i);
+      data[i] = node;
+    }
+
+    inline void setLeaf(uint8_t i, Leaf* leaf, RefRule refrule = RetainReference) {
+      assert(leaves);
+      if (refrule == RetainReference) leaf->retain();
+      releaseChild(i);
+      data[i] = leaf;
+    }
+
+  private:
+    Branch() : refcount_(Unretainable), length(0), capacity(0), leaves(true) {}
+
+    inline size_t allocSize() const { return sizeof(Branch) + (sizeof(void*) * capacity); }
+
+    // Slots are zeroed so that set* can tell whether a slot holds a child
+    inline static Branch* alloc(uint8_t capacity, bool leaves) {
+      DEBUG_LIVECOUNT_TypedNode_INC
+      Branch* node = __alloc(sizeof(Branch) + (sizeof(void*) * capacity));
+      node->capacity = capacity;
+      node->leaves = leaves;
+      memset(node->data, 0, sizeof(void*) * capacity);
+      return node;
+    }
+
+    inline void retainChild(uint8_t i) {
+      if (leaves) ((Leaf*)data[i])->retain(); else ((Branch*)data[i])->retain();
+    }
+
+    inline void releaseChild(uint8_t i) {
+      if (data[i] == 0) return;
+      if (leaves) ((Leaf*)data[i])->release(); else ((Branch*)data[i])->release();
+    }
+
+    void dealloc() {
+      DEBUG_LIVECOUNT_TypedNode_DEC
+      for (uint8_t i = 0; i < length; ++i) releaseChild(i);
+    }
+  };
+
+public:
+  // The empty vector
+  static TypedVector* Empty;
+
+  // Number of items contained by the receiver
+  const size_t count() const { return count_; }
+
+  // Returns a vector with val added to the end
+  TypedVector* append(T val) const {
+    // room in tail?
+    if (tailLength() < LeafSize) {
+      Leaf* newTail = (tail_ == 0) ? Leaf::create(1) : Leaf::create(*tail_, tail_->length + 1);
+      newTail->data[newTail->length - 1] = val;
+      return create(count_ + 1, shift_, root_,RetainReference, newTail,TransferReference);
+    }
+
+    // Full tail -- push into tree
+    Branch* newroot;
+    uint32_t newshift = shift_;
+
+    if (isRootFull()) {
+      // Overflow root
+      newroot = Branch::create(2, false);
+      newroot->setBranch(0, root_);
+      newroot->setBranch(1, newPath(shift_, tail_), TransferReference);
+      newshift += 5;
+    } else {
+      newroot = pushTail(shift_, root_, tail_);
+    }
+
+    Leaf* newTail = Leaf::create(1);
+    newTail->data[0] = val;
+    return create(count_ + 1, newshift, newroot,TransferReference, newTail,TransferReference);
+  }
+
+  // Retrieve item at index i
+  inline T itemAt(size_t i) const throw(std::out_of_range) {
+    size_t index;
+    return leafFor(i, index).data[index];
+  }
+
+  // Returns a vector with the item at index i replaced by val. Only the path from
+  // the root to the leaf holding i is copied.
+  TypedVector* assoc(size_t i, T val) const throw(std::out_of_range) {
+    if (i >= count_)
+      throw std::out_of_range("index out of range");
+
+    // i is in tail?
+    if (i >= tailoff()) {
+      Leaf* newTail = Leaf::create(*tail_, tail_->length);
+      newTail->data[i - tailoff()] = val;
+      return create(count_, shift_, root_,RetainReference, newTail,TransferReference);
+    }
+
+    Branch* newroot = doAssoc(shift_, root_, i, val);
+    return create(count_, shift_, newroot,TransferReference, tail_,RetainReference);
+  }
+
+  // Returns a vector with the last item removed
+  TypedVector* pop() const throw(std::out_of_range) {
+    if (count_ == 0)
+      throw std::out_of_range("can't pop an empty vector");
+    if (count_ == 1)
+      return Empty;
+
+    // More than one item in tail?
+    if (tailLength() > 1) {
+      Leaf* newTail = Leaf::create(*tail_, tail_->length - 1);
+      return create(count_ - 1, shift_, root_,RetainReference, newTail,TransferReference);
+    }
+
+    // The last leaf of the trie becomes the new tail
+    const Branch* node = root_;
+    for (uint32_t level = shift_; level > LeafBits; level -= 5) {
+      node = node->getBranch(node->length - 1);
+    }
+    Leaf* newTail = node->getLeaf(node->length - 1)->retain();
+    Branch* newroot = popTail(shift_, root_);
+    uint32_t newshift = shift_;
+
+    if (newroot == 0) {
+      newroot = Branch::Empty;
+    } else if (shift_ > LeafBits && newroot->length == 1) {
+      // Collapse the root
+      Branch* child = newroot->getBranch(0)->retain();
+      newroot->release();
+      newroot = child;
+      newshift -= 5;
+    }
+
+    return create(count_ - 1, newshift, newroot,TransferReference, newTail,TransferReference);
+  }
+
+  // Returns a vector with the items of the receiver followed by the items of
+  // *other*. The receiver's trie is shared, and so are the leaves of other if
+  // the receiver's count is a multiple of LeafSize.
+  TypedVector* concat(const TypedVector* other) const {
+    if (other->count_ == 0) return const_cast<TypedVector*>(this)->retain();
+    if (count_ == 0) return const_cast<TypedVector*>(other)->retain();
+    Transient* t = asTransient();
+    t->appendRange(other, 0, other->count_);
+    TypedVector* v = t->persistent();
+    t->release();
+    return v;
+  }
+
+  // Returns a vector with the first n items of the receiver. All leaves but the
+  // one holding the last item are shared.
+  TypedVector* take(size_t n) const {
+    if (n >= count_) return const_cast<TypedVector*>(this)->retain();
+    if (n == 0) return Empty;
+
+    size_t tailoff = this->tailoff();
+    if (n > tailoff) {
+      Leaf* newTail = Leaf::create(*tail_, (uint16_t)(n - tailoff));
+      return create(n, shift_, root_,RetainReference, newTail,TransferReference);
+    }
+
+    return slice(0, n);
+  }
+
+  // Returns a vector without the first n items of the receiver
+  TypedVector* drop(size_t n) const {
+    if (n == 0) return const_cast<TypedVector*>(this)->retain();
+    if (n >= count_) return Empty;
+    return slice(n, count_);
+  }
+
+  // Returns a vector with the items in the range [from, to) of the receiver
+  TypedVector* slice(size_t from, size_t to) const throw(std::out_of_range) {
+    if (from > to || to > count_)
+      throw std::out_of_range("slice out of range");
+    if (from == 0 && to == count_) return const_cast<TypedVector*>(this)->retain();
+    if (from == to) return Empty;
+    Transient* t = Empty->asTransient();
+    t->appendRange(this, from, to);
+    TypedVector* v = t->persistent();
+    t->release();
+    return v;
+  }
+
+  // Iterates over the items of a vector one leaf ("chunk") at a time. See
+  // Vector::ChunkIterator.
+  //
+  //   IntVector::ChunkIterator it(v);
+  //   const Int* items; size_t length;
+  //   while (it.next(items, length)) {
+  //     for (size_t i = 0; i < length; ++i) sum += items[i];
+  //   }
+  //
+  // The iterator does not retain the vector, which must outlive the iterator.
+  class ChunkIterator {
+  public:
+    // Creates an iterator positioned before the first chunk, or after the last
+    // chunk if *atEnd* is true.
+    ChunkIterator(const TypedVector* v, bool atEnd = false)
+        : v_(v), depth_((v->shift_ - LeafBits) / 5 + 1), offset_(atEnd ? v->count_ : 0),
+          length_(0), state_(atEnd ? AfterEnd : BeforeStart) {
+      assert(depth_ <= MaxDepth);
+    }
+
+    // Moves to the next chunk. Returns false if there are no more chunks.
+    bool next(const T*& items, size_t& length) {
+      switch (state_) {
+        case BeforeStart:
+          if (v_->root_->length != 0) {
+            descend(0, false);
+            state_ = InTree;
+          } else if (v_->tail_ != 0) {
+            state_ = InTail;
+          } else {
+            return false;
+          }
+          break;
+        case InTree:
+          offset_ += length_;
+          if (!step(false)) {
+            if (v_->tail_ == 0) { state_ = AfterEnd; return false; }
+            state_ = InTail;
+          }
+          break;
+        case InTail:
+          offset_ += length_;
+          state_ = AfterEnd;
+          return false;
+        case AfterEnd:
+          return false;
+      }
+      items = leaf()->data;
+      length = length_ = leaf()->length;
+      return true;
+    }
+
+    // Moves to the previous chunk. Returns false if there are no more chunks.
+    bool prev(const T*& items, size_t& length) {
+      switch (state_) {
+        case AfterEnd:
+          if (v_->tail_ != 0) {
+            state_ = InTail;
+          } else if (v_->root_->length != 0) {
+            descend(0, true);
+            state_ = InTree;
+          } else {
+            return false;
+          }
+          break;
+        case InTail:
+          if (v_->root_->length == 0) { state_ = BeforeStart; offset_ = 0; return false; }
+          descend(0, true);
+          state_ = InTree;
+          break;
+        case InTree:
+          if (!step(true)) { state_ = BeforeStart; offset_ = 0; return false; }
+          break;
+        case BeforeStart:
+          return false;
+      }
+      items = leaf()->data;
+      length = length_ = leaf()->length;
+      offset_ -= length_;
+      return true;
+    }
+
+    // Index of the first item in the current chunk
+    inline size_t offset() const { return offset_; }
+
+  private:
+    friend class TypedVector;
+    enum State { BeforeStart, InTree, InTail, AfterEnd };
+
+    // The current chunk
+    inline const Leaf* leaf() const {
+      return (state_ == InTail) ? v_->tail_ : path_[depth_-1]->getLeaf(index_[depth_-1]);
+    }
+
+    // Fills the path from *level* down to the leaves, following the first (or
+    // last if *backwards*) child of each branch.
+    void descend(int level, bool backwards) {
+      if (level == depth_) return;
+      const Branch* node = (level == 0) ? v_->root_ : path_[level-1]->getBranch(index_[level-1]);
+      for (;;) {
+        path_[level] = node;
+        index_[level] = backwards ? node->length - 1 : 0;
+        if (++level == depth_) break;
+        node = node->getBranch(index_[level-1]);
+      }
+    }
+
+    // Moves the path to the next (or previous if *backwards*) leaf in the tree.
+    // Returns false if the path is already at the last (or first) leaf.
+    bool step(bool backwards) {
+      for (int level = depth_ - 1; level >= 0; --level) {
+        if (backwards ? index_[level] > 0 : index_[level] + 1 < path_[level]->length) {
+          index_[level] += backwards ? -1 : 1;
+          descend(level + 1, backwards);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    const TypedVector* v_;
+    int depth_;
+    size_t offset_;
+    size_t length_; // length of the current chunk
+    State state_;
+    const Branch* path_[MaxDepth];
+    uint8_t index_[MaxDepth];
+  };
+
+  // A mutable builder for a typed vector. See Vector::Transient.
+  class Transient { HUE_OBJECT(Transient)
+  public:
+    static Transient* create(const TypedVector* v) {
+      Transient* t = __alloc();
+      t->count_ = v->count_;
+      t->shift_ = v->shift_;
+      t->root_ = v->root_->retain();
+      t->tail_ = v->tail_ ? v->tail_->retain() : 0;
+      return t;
+    }
+
+    // Number of items contained by the receiver
+    const size_t count() const { return count_; }
+
+    // Adds val to the end of the receiver. Returns the receiver.
+    Transient* append(T val) {
+      Region::Alongside alongside(this);
+      prepareTail();
+      tail_->data[tail_->length++] = val;
+      ++count_;
+      return this;
+    }
+
+    // Adds the *count* items starting at *items* to the end of the receiver.
+    // Returns the receiver.
+    Transient* append(const T* items, size_t count) {
+      Region::Alongside alongside(this);
+      while (count != 0) {
+        prepareTail();
+        size_t n = LeafSize - tail_->length;
+        if (n > count) n = count;
+        memcpy(tail_->data + tail_->length, items, sizeof(T) * n);
+        tail_->length += n;
+        count_ += n;
+        items += n;
+        count -= n;
+      }
+      return this;
+    }
+
+    // Returns an immutable vector with the contents of the receiver
+    TypedVector* persistent() const {
+      if (tail_ == 0) return Empty;
+      return TypedVector::create(count_, shift_, root_, RetainReference, tail_, RetainReference);
+    }
+
+  protected:
+    friend class TypedVector;
+
+    void dealloc() {
+      root_->release();
+      if (tail_) tail_->release();
+    }
+
+    static inline bool isOwned(const Leaf* leaf) {
+      return leaf->isUnique() && leaf->capacity == LeafSize && Region::isCurrent(leaf);
+    }
+
+    static inline bool isOwned(const Branch* node) {
+      return node->isUnique() && node->capacity == 32 && Region::isCurrent(node);
+    }
+
+    // Makes sure tail_ is owned and has room for at least one item
+    void prepareTail() {
+      if (tail_ == 0) {
+        tail_ = Leaf::createWithCapacity(LeafSize);
+      } else if (tail_->length == LeafSize) {
+        // Full tail -- push into tree
+        pushTail();
+        tail_ = Leaf::createWithCapacity(LeafSize);
+      } else if (!isOwned(tail_)) {
+        Leaf* tail = Leaf::create(*tail_, tail_->length, LeafSize);
+        tail_->release();
+        tail_ = tail;
+      }
+    }
+
+    // Adds the items in the range [from, to) of v. Full leaves of v are shared
+    // when they line up with the receiver's leaves.
+    void appendRange(const TypedVector* v, size_t from, size_t to) {
+      Region::Alongside alongside(this);
+      ChunkIterator it(v);
+      const T* items;
+      size_t length;
+      while (from < to && it.next(items, length)) {
+        size_t start = it.offset();
+        size_t end = start + length;
+        if (end <= from) continue;
+        if (start >= from && end <= to && length == LeafSize && (count_ & (LeafSize - 1)) == 0) {
+          if (tail_ != 0) pushTail();
+          tail_ = const_cast<Leaf*>(it.leaf())->retain();
+          count_ += LeafSize;
+        } else {
+          size_t first = (from > start) ? from : start;
+          size_t last = (to < end) ? to : end;
+          append(items + (first - start), last - first);
+        }
+        from = end;
+      }
+    }
+
+    // Returns the child at index i of the owned branch *parent*, first replacing
+    // it with a copy if it isn't owned.
+    static Branch* ownedChild(Branch* parent, uint8_t i) {
+      Branch* child = parent->getBranch(i);
+      if (!isOwned(child)) {
+        child = Branch::create(*child, child->length, 32);
+        parent->setBranch(i, child, TransferReference);
+      }
+      return child;
+    }
+
+    // Moves the full tail into the tree. Transfers the reference of tail_.
+    void pushTail() {
+      if (isRootFull(count_, shift_)) {
+        // Overflow root
+        Branch* newroot = Branch::createWithCapacity(32, false);
+        newroot->length = 2;
+        newroot->setBranch(0, root_, TransferReference);
+        newroot->setBranch(1, newPath(shift_, tail_), TransferReference);
+        root_ = newroot;
+        shift_ += 5;
+      } else {
+        if (!isOwned(root_)) {
+          Branch* root = Branch::create(*root_, root_->length, 32);
+          root_->release();
+          root_ = root;
+        }
+        pushTail(shift_, root_);
+      }
+      tail_ = 0;
+    }
+
+    void pushTail(uint32_t level, Branch* parent) {
+      uint8_t subidx = ((count_ - 1) >> level) & 0x1f;
+      if (level == LeafBits) {
+        assert(subidx == parent->length);
+        parent->length = subidx + 1;
+        parent->setLeaf(subidx, tail_, TransferReference);
+      } else if (subidx < parent->length) {
+        pushTail(level - 5, ownedChild(parent, subidx));
+      } else {
+        assert(subidx == parent->length);
+        parent->length = subidx + 1;
+        parent->setBranch(subidx, newPath(level - 5, tail_), TransferReference);
+      }
+    }
+
+    // Create a new path of owned branches. Transfers the reference of leaf.
+    static Branch* newPath(uint32_t level, Leaf* leaf) {
+      Branch* node = Branch::createWithCapacity(32, level == LeafBits);
+      node->length = 1;
+      if (level == LeafBits) {
+        node->setLeaf(0, leaf, TransferReference);
+      } else {
+        node->setBranch(0, newPath(level - 5, leaf), TransferReference);
+      }
+      return node;
+    }
+
+  private:
+    size_t count_;
+    uint32_t shift_;
+    Branch* root_;
+    Leaf* tail_;
+  };
+
+  // Returns a transient which initially has the same contents as the receiver
+  Transient* asTransient() const { return Transient::create(this); }
+
+  // Returns a vector containing the *count* items starting at *items*
+  static TypedVector* fromArray(const T* items, size_t count) {
+    if (count == 0) return Empty;
+    Transient* t = Empty->asTransient();
+    t->append(items, count);
+    TypedVector* v = t->persistent();
+    t->release();
+    return v;
+  }
+
+  // Runs body(i) for each i in [0, count) on the calling thread. The tree walks
+  // below (mapChunks and reduceChunks) take a "fork" like this one, which is
+  // called with the children of a branch and the number of items below each
+  // child, and may run them concurrently (see VectorParallel.h).
+  struct SerialFork {
+    template <typename B> void operator()(size_t count, size_t, B& body) {
+      for (size_t i = 0; i < count; ++i) body(i);
+    }
+  };
+
+  // Returns a vector with the same shape as the receiver where each leaf is
+  // produced by calling f(items, result, length), which must write *length*
+  // items to *result*.
+  template <typename F>
+  TypedVector* mapChunks(F f) const {
+    SerialFork fork;
+    return mapChunks(f, fork);
+  }
+
+  template <typename F, typename Fork>
+  TypedVector* mapChunks(F& f, Fork& fork) const {
+    if (count_ == 0) return Empty;
+    _UnaryMap<F> uf = { f };
+    Branch* root = mapBranch(shift_, root_, (const Branch*)0, uf, fork);
+    Leaf* tail = mapLeaf(tail_, (const Leaf*)0, uf);
+    return create(count_, shift_, root,TransferReference, tail,TransferReference);
+  }
+
+  // Like mapChunks but calls f(items, otherItems, result, length) with the
+  // items of both the receiver and *other*, which must have the same count.
+  template <typename F>
+  TypedVector* mapChunks(const TypedVector* other, F f) const throw(std::invalid_argument) {
+    SerialFork fork;
+    return mapChunks(other, f, fork);
+  }
+
+  template <typename F, typename Fork>
+  TypedVector* mapChunks(const TypedVector* other, F& f, Fork& fork) const throw(std::invalid_argument) {
+    if (other->count_ != count_)
+      throw std::invalid_argument("vectors differ in count");
+    if (count_ == 0) return Empty;
+    // Typed vectors are never relaxed, so the shape of the trie only depends
+    // on the count
+    assert(other->shift_ == shift_);
+    Branch* root = mapBranch(shift_, root_, other->root_, f, fork);
+    Leaf* tail = mapLeaf(tail_, other->tail_, f);
+    return create(count_, shift_, root,TransferReference, tail,TransferReference);
+  }
+
+  // Folds the items of the receiver one leaf at a time. f(acc, items, length,
+  // offset) returns acc with the *length* items starting at index *offset*
+  // folded in. Each subtree is folded starting with *identity* and the results
+  // of adjacent subtrees are joined with combine(left, right), so combine must
+  // be associative.
+  template <typename R, typename F, typename C>
+  R reduceChunks(const R& identity, F f, C combine) const {
+    SerialFork fork;
+    return reduceChunks(identity, f, combine, fork);
+  }
+
+  template <typename R, typename F, typename C, typename Fork>
+  R reduceChunks(const R& identity, F& f, C& combine, Fork& fork) const {
+    if (count_ == 0) return identity;
+    R r = reduceBranch(shift_, root_, 0, identity, f, combine, fork);
+    return combine(r, f(identity, (const T*)tail_->data, (size_t)tail_->length, tailoff()));
+  }
+
+protected:
+
+  // Used for the empty vector ::Empty
+  TypedVector() : refcount_(Unretainable), count_(0), shift_(LeafBits), root_(Branch::Empty), tail_(0) {}
+
+  static TypedVector* create(size_t count, uint32_t shift,
+                             Branch* root, RefRule root_refrule,
+                             Leaf* tail, RefRule tail_refrule) {
+    DEBUG_LIVECOUNT_TypedVector_INC
+    TypedVector* v = __alloc(sizeof(TypedVector));
+    v->count_ = count;
+    v->shift_ = shift;
+    v->root_ = (root_refrule == TransferReference) ? root : root->retain();
+    v->tail_ = (tail_refrule == TransferReference) ? tail : tail->retain();
+    assert((v->shift_ - LeafBits) % 5 == 0);
+    return v;
+  }
+
+  inline size_t allocSize() const { return sizeof(TypedVector); }
+
+  void dealloc() {
+    DEBUG_LIVECOUNT_TypedVector_DEC
+    if (root_) root_->release();
+    if (tail_) tail_->release();
+  }
+
+  inline size_t tailLength() const {
+    return (tail_ == 0) ? 0 : tail_->length;
+  }
+
+  // Offset of tail (the start of tail relative to count)
+  inline size_t tailoff() const {
+    return count_ - tailLength();
+  }
+
+  // True if a trie with *count* items (including a full tail) at *shift* has no
+  // room for another leaf
+  static inline bool isRootFull(size_t count, uint32_t shift) {
+    return (count >> LeafBits) > ((size_t)1 << (shift + 5 - LeafBits));
+  }
+  inline bool isRootFull() const { return isRootFull(count_, shift_); }
+
+  // Finds the leaf for index i. *index* is set to the position of i in that leaf.
+  const Leaf& leafFor(size_t i, size_t& index) const throw(std::out_of_range) {
+    if (i >= count_)
+      throw std::out_of_range("index out of range");
+
+    // i is in tail?
+    size_t tailoff = this->tailoff();
+    if (i >= tailoff) {
+      index = i - tailoff;
+      return *tail_;
+    }
+
+    const Branch* node = root_;
+    for (uint32_t level = shift_; level > LeafBits; level -= 5) {
+      node = node->getBranch((i >> level) & 0x1f);
+    }
+
+    index = i & (LeafSize - 1);
+    return *node->getLeaf((i >> LeafBits) & 0x1f);
+  }
+
+  // Copies the path to the position of the full tail *leaf*. Returns a branch
+  // with a +1 refcount.
+  Branch* pushTail(uint32_t level, const Branch* parent, Leaf* leaf) const {
+    uint8_t subidx = ((count_ - 1) >> level) & 0x1f;
+    Branch* node = Branch::create(*parent, (parent->length > subidx) ? parent->length : subidx + 1);
+
+    if (level == LeafBits) {
+      node->setLeaf(subidx, leaf);
+    } else if (subidx < parent->length) {
+      node->setBranch(subidx, pushTail(level - 5, parent->getBranch(subidx), leaf), TransferReference);
+    } else {
+      node->setBranch(subidx, newPath(level - 5, leaf), TransferReference);
+    }
+
+    return node;
+  }
+
+  // Copy the path to index i, replacing the item with val. Returns a branch with
+  // a +1 refcount.
+  static Branch* doAssoc(uint32_t level, const Branch* node, size_t i, T val) {
+    Branch* newnode = Branch::create(*node, node->length);
+    uint8_t subidx = (i >> level) & 0x1f;
+    if (level == LeafBits) {
+      const Leaf* leaf = node->getLeaf(subidx);
+      Leaf* newleaf = Leaf::create(*leaf, leaf->length);
+      newleaf->data[i & (LeafSize - 1)] = val;
+      newnode->setLeaf(subidx, newleaf, TransferReference);
+    } else {
+      newnode->setBranch(subidx, doAssoc(level - 5, node->getBranch(subidx), i, val), TransferReference);
+    }
+    return newnode;
+  }
+
+  // Copy the path to the last leaf, leaving that leaf out. Returns a branch with
+  // a +1 refcount, or 0 if the branch would become empty.
+  static Branch* popTail(uint32_t level, const Branch* node) {
+    uint8_t last = node->length - 1;
+    if (level > LeafBits) {
+      Branch* newchild = popTail(level - 5, node->getBranch(last));
+      if (newchild != 0) {
+        Branch* newnode = Branch::create(*node, node->length);
+        newnode->setBranch(last, newchild, TransferReference);
+        return newnode;
+      }
+    }
+    return (last == 0) ? 0 : Branch::create(*node, last);
+  }
+
+  // Helpers for mapChunks. *other* is the corresponding node of the second
+  // vector, or 0. Return nodes with a +1 refcount.
+  template <typename F>
+  struct _UnaryMap {
+    F& f;
+    void operator()(const T* items, const T*, T* result, size_t length) { f(items, result, length); }
+  };
+
+  template <typename F>
+  static Leaf* mapLeaf(const Leaf* leaf, const Leaf* other, F& f) {
+    assert(other == 0 || other->length == leaf->length);
+    Leaf* result = Leaf::create(leaf->length);
+    f((const T*)leaf->data, other ? (const T*)other->data : 0, result->data, (size_t)leaf->length);
+    return result;
+  }
+
+  template <typename F, typename Fork>
+  static Branch* mapBranch(uint32_t level, const Branch* node, const Branch* other, F& f, Fork& fork) {
+    if (node->length == 0) return const_cast<Branch*>(node)->retain();
+    assert(other == 0 || (other->length == node->length && other->leaves == node->leaves));
+    void* children[32];
+    auto body = [&](size_t i) {
+      if (node->leaves) {
+        children[i] = mapLeaf(node->getLeaf(i), other ? other->getLeaf(i) : 0, f);
+      } else {
+        children[i] = mapBranch(level - 5, node->getBranch(i), other ? other->getBranch(i) : 0, f, fork);
+      }
+    };
+    fork(node->length, (size_t)1 << level, body);
+    Branch* result = Branch::create(node->length, node->leaves);
+    for (uint8_t i = 0; i < node->length; ++i) {
+      if (node->leaves) {
+        result->setLeaf(i, (Leaf*)children[i], TransferReference);
+      } else {
+        result->setBranch(i, (Branch*)children[i], TransferReference);
+      }
+    }
+    return result;
+  }
+
+  // Helper for reduceChunks. *offset* is the index of the first item below node.
+  template <typename R, typename F, typename C, typename Fork>
+  static R reduceBranch(uint32_t level, const Branch* node, size_t offset,
+                        const R& identity, F& f, C& combine, Fork& fork) {
+    if (node->length == 0) return identity;
+    R parts[32];
+    auto body = [&](size_t i) {
+      size_t childOffset = offset + (i << level);
+      if (node->leaves) {
+        const Leaf* leaf = node->getLeaf(i);
+        parts[i] = f(identity, (const T*)leaf->data, (size_t)leaf->length, childOffset);
+      } else {
+        parts[i] = reduceBranch(level - 5, node->getBranch(i), childOffset, identity, f, combine, fork);
+      }
+    };
+    fork(node->length, (size_t)1 << level, body);
+    R r = parts[0];
+    for (uint8_t i = 1; i < node->length; ++i) r = combine(r, parts[i]);
+    return r;
+  }
+
+  // Create a new path. Returns a branch with a +1 refcount.
+  static Branch* newPath(uint32_t level, Leaf* leaf) {
+    Branch* node = Branch::create(1, level == LeafBits);
+    if (level == LeafBits) {
+      node->setLeaf(0, leaf);
+    } else {
+      node->setBranch(0, newPath(level - 5, leaf), TransferReference);
+    }
+    return node;
+  }
+
+private:
+  size_t count_; // number of items in this vector
+  uint32_t shift_; // shift of the root's child index (LeafBits + 5 per level below)
+  Branch* root_;
+  Leaf* tail_;
+
+  static const TypedVector _Empty;
+};
+
+template <typename T>
+const typename TypedVector<T>::Branch TypedVector<T>::Branch::_Empty;
+template <typename T>
+typename TypedVector<T>::Branch* TypedVector<T>::Branch::Empty =
+  (typename TypedVector<T>::Branch*)&TypedVector<T>::Branch::_Empty;
+
+template <typename T>
+const TypedVector<T> TypedVector<T>::_Empty;
+template <typename T>
+TypedVector<T>* TypedVector<T>::Empty = (TypedVector<T>*)&TypedVector<T>::_Empty;
+
+
+typedef TypedVector<int64_t> IntVector;
+typedef TypedVector<double> FloatVector;
+typedef TypedVector<uint8_t> ByteVector;
+typedef TypedVector<UChar> CharVector;
+
+} // namespace hue
+#endif // _HUE_RUNTIME_TYPED_VECTOR_INCLUDED
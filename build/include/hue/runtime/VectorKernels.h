@@ -0,0 +1,523 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+//
+// Reductions and element-wise maps over vectors which run on one leaf at a
+// time. Each leaf is contiguous memory, so the inner loops use SSE2 or AVX2
+// instructions when the compiler targets them (e.g. with -mavx2) and fall back
+// to plain loops otherwise.
+//
+// Maps build a trie of the same shape as their input, allocating every node at
+// its final size. Maps which wouldn't change any item return the input vector.
+//
+// The span kernels in kernels::span work on plain arrays and are what the vector
+// kernels call for each leaf.
+//
+#ifndef _HUE_RUNTIME_VECTOR_KERNELS_INCLUDED
+#define _HUE_RUNTIME_VECTOR_KERNELS_INCLUDED
+
+#include <hue/runtime/Vector.h>
+#include <hue/runtime/TypedVector.h>
+
+#include <math.h>
+#include <string.h>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+namespace hue { namespace kernels {
+
+// Type of the sum of items of type T. Narrow unsigned items are summed as
+// 64-bit integers so that sums don't wrap.
+template <typename T> struct SumType { typedef T type; };
+template <> struct SumType<uint8_t> { typedef uint64_t type; };
+template <> struct SumType<UChar> { typedef uint64_t type; };
+
+
+namespace span {
+
+// ---------------------------------------------------------------------------
+// sum
+
+inline int64_t sum(const int64_t* items, size_t length) {
+  size_t i = 0;
+  int64_t s = 0;
+#if defined(__AVX2__)
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 4 <= length; i += 4) {
+    acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i*)(items + i)));
+  }
+  int64_t lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  s = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 2 <= length; i += 2) {
+    acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i*)(items + i)));
+  }
+  int64_t lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  s = lanes[0] + lanes[1];
+#endif
+  for (; i < length; ++i) s += items[i];
+  return s;
+}
+
+// Note: The order in which items are added differs from a plain loop, so the
+// result may differ in the last bits.
+inline double sum(const double* items, size_t length) {
+  size_t i = 0;
+  double s = 0.0;
+#if defined(__AVX__)
+  // Two accumulators hide the latency of the additions
+  __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+  for (; i + 8 <= length; i += 8) {
+    acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(items + i));
+    acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(items + i + 4));
+  }
+  double lanes[4];
+  _mm256_storeu_pd(lanes, _mm256_add_pd(acc0, acc1));
+  s = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(__SSE2__)
+  __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+  for (; i + 4 <= length; i += 4) {
+    acc0 = _mm_add_pd(acc0, _mm_loadu_pd(items + i));
+    acc1 = _mm_add_pd(acc1, _mm_loadu_pd(items + i + 2));
+  }
+  double lanes[2];
+  _mm_storeu_pd(lanes, _mm_add_pd(acc0, acc1));
+  s = lanes[0] + lanes[1];
+#endif
+  for (; i < length; ++i) s += items[i];
+  return s;
+}
+
+inline uint64_t sum(const uint8_t* items, size_t length) {
+  size_t i = 0;
+  uint64_t s = 0;
+#if defined(__AVX2__)
+  // psadbw against zero sums each group of 8 bytes into a 64-bit lane
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(items + i));
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(x, _mm256_setzero_si256()));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  s = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(items + i));
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(x, _mm_setzero_si128()));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  s = lanes[0] + lanes[1];
+#endif
+  for (; i < length; ++i) s += items[i];
+  return s;
+}
+
+inline uint64_t sum(const UChar* items, size_t length) {
+  size_t i = 0;
+  uint64_t s = 0;
+#if defined(__AVX2__)
+  __m256i acc = _mm256_setzero_si256();
+  for (; i + 4 <= length; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(items + i));
+    acc = _mm256_add_epi64(acc, _mm256_cvtepu32_epi64(x));
+  }
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i*)lanes, acc);
+  s = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+  // Widen each 32-bit item to 64 bits by interleaving with zeros
+  __m128i acc = _mm_setzero_si128();
+  for (; i + 4 <= length; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(items + i));
+    acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(x, _mm_setzero_si128()));
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(x, _mm_setzero_si128()));
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  s = lanes[0] + lanes[1];
+#endif
+  for (; i < length; ++i) s += items[i];
+  return s;
+}
+
+// ---------------------------------------------------------------------------
+// min and max
+//
+// extreme<true> returns the largest item and extreme<false> the smallest.
+// *length* must not be 0. The result is unspecified if items contains NaNs.
+
+template <bool Max>
+inline int64_t extreme(const int64_t* items, size_t length) {
+  size_t i = 0;
+  int64_t m = items[0];
+#if defined(__AVX2__)
+  if (length >= 4) {
+    __m256i acc = _mm256_loadu_si256((const __m256i*)items);
+    for (i = 4; i + 4 <= length; i += 4) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(items + i));
+      __m256i gt = Max ? _mm256_cmpgt_epi64(x, acc) : _mm256_cmpgt_epi64(acc, x);
+      acc = _mm256_blendv_epi8(acc, x, gt);
+    }
+    int64_t lanes[4];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    for (int j = 0; j < 4; ++j) if (Max ? lanes[j] > m : lanes[j] < m) m = lanes[j];
+  }
+#elif defined(__SSE4_2__)
+  if (length >= 2) {
+    __m128i acc = _mm_loadu_si128((const __m128i*)items);
+    for (i = 2; i + 2 <= length; i += 2) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(items + i));
+      __m128i gt = Max ? _mm_cmpgt_epi64(x, acc) : _mm_cmpgt_epi64(acc, x);
+      acc = _mm_blendv_epi8(acc, x, gt);
+    }
+    int64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    for (int j = 0; j < 2; ++j) if (Max ? lanes[j] > m : lanes[j] < m) m = lanes[j];
+  }
+#endif
+  for (; i < length; ++i) if (Max ? items[i] > m : items[i] < m) m = items[i];
+  return m;
+}
+
+template <bool Max>
+inline double extreme(const double* items, size_t length) {
+  size_t i = 0;
+  double m = items[0];
+#if defined(__AVX__)
+  if (length >= 4) {
+    __m256d acc = _mm256_loadu_pd(items);
+    for (i = 4; i + 4 <= length; i += 4) {
+      __m256d x = _mm256_loadu_pd(items + i);
+      acc = Max ? _mm256_max_pd(acc, x) : _mm256_min_pd(acc, x);
+    }
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    for (int j = 0; j < 4; ++j) if (Max ? lanes[j] > m : lanes[j] < m) m = lanes[j];
+  }
+#elif defined(__SSE2__)
+  if (length >= 2) {
+    __m128d acc = _mm_loadu_pd(items);
+    for (i = 2; i + 2 <= length; i += 2) {
+      __m128d x = _mm_loadu_pd(items + i);
+      acc = Max ? _mm_max_pd(acc, x) : _mm_min_pd(acc, x);
+    }
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    for (int j = 0; j < 2; ++j) if (Max ? lanes[j] > m : lanes[j] < m) m = lanes[j];
+  }
+#endif
+  for (; i < length; ++i) if (Max ? items[i] > m : items[i] < m) m = items[i];
+  return m;
+}
+
+template <bool Max>
+inline uint8_t extreme(const uint8_t* items, size_t length) {
+  size_t i = 0;
+  uint8_t m = items[0];
+#if defined(__AVX2__)
+  if (length >= 32) {
+    __m256i acc = _mm256_loadu_si256((const __m256i*)items);
+    for (i = 32; i + 32 <= length; i += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(items + i));
+      acc = Max ? _mm256_max_epu8(acc, x) : _mm256_min_epu8(acc, x);
+    }
+    uint8_t lanes[32];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    for (int j = 0; j < 32; ++j) if (Max ? lanes[j] > m : lanes[j] < m) m = lanes[j];
+  }
+#elif defined(__SSE2__)
+  if (length >= 16) {
+    __m128i acc = _mm_loadu_si128((const __m128i*)items);
+    for (i = 16; i + 16 <= length; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(items + i));
+      acc = Max ? _mm_max_epu8(acc, x) : _mm_min_epu8(acc, x);
+    }
+    uint8_t lanes[16];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    for (int j = 0; j < 16; ++j) if (Max ? lanes[j] > m : lanes[j] < m) m = lanes[j];
+  }
+#endif
+  for (; i < length; ++i) if (Max ? items[i] > m : items[i] < m) m = items[i];
+  return m;
+}
+
+template <bool Max>
+inline UChar extreme(const UChar* items, size_t length) {
+  size_t i = 0;
+  UChar m = items[0];
+#if defined(__AVX2__)
+  if (length >= 8) {
+    __m256i acc = _mm256_loadu_si256((const __m256i*)items);
+    for (i = 8; i + 8 <= length; i += 8) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(items + i));
+      acc = Max ? _mm256_max_epu32(acc, x) : _mm256_min_epu32(acc, x);
+    }
+    UChar lanes[8];
+    _mm256_storeu_si256((__m256i*)lanes, acc);
+    for (int j = 0; j < 8; ++j) if (Max ? lanes[j] > m : lanes[j] < m) m = lanes[j];
+  }
+#elif defined(__SSE4_1__)
+  if (length >= 4) {
+    __m128i acc = _mm_loadu_si128((const __m128i*)items);
+    for (i = 4; i + 4 <= length; i += 4) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(items + i));
+      acc = Max ? _mm_max_epu32(acc, x) : _mm_min_epu32(acc, x);
+    }
+    UChar lanes[4];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    for (int j = 0; j < 4; ++j) if (Max ? lanes[j] > m : lanes[j] < m) m = lanes[j];
+  }
+#endif
+  for (; i < length; ++i) if (Max ? items[i] > m : items[i] < m) m = items[i];
+  return m;
+}
+
+// ---------------------------------------------------------------------------
+// Element-wise maps. *result* may be the same array as *items*.
+
+// result[i] = items[i] + value
+template <typename T>
+inline void add(const T* items, T value, T* result, size_t length) {
+  for (size_t i = 0; i < length; ++i) result[i] = items[i] + value;
+}
+
+inline void add(const int64_t* items, int64_t value, int64_t* result, size_t length) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  __m256i v = _mm256_set1_epi64x(value);
+  for (; i + 4 <= length; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(items + i));
+    _mm256_storeu_si256((__m256i*)(result + i), _mm256_add_epi64(x, v));
+  }
+#elif defined(__SSE2__)
+  __m128i v = _mm_set1_epi64x(value);
+  for (; i + 2 <= length; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(items + i));
+    _mm_storeu_si128((__m128i*)(result + i), _mm_add_epi64(x, v));
+  }
+#endif
+  for (; i < length; ++i) result[i] = items[i] + value;
+}
+
+inline void add(const double* items, double value, double* result, size_t length) {
+  size_t i = 0;
+#if defined(__AVX__)
+  __m256d v = _mm256_set1_pd(value);
+  for (; i + 4 <= length; i += 4) {
+    _mm256_storeu_pd(result + i, _mm256_add_pd(_mm256_loadu_pd(items + i), v));
+  }
+#elif defined(__SSE2__)
+  __m128d v = _mm_set1_pd(value);
+  for (; i + 2 <= length; i += 2) {
+    _mm_storeu_pd(result + i, _mm_add_pd(_mm_loadu_pd(items + i), v));
+  }
+#endif
+  for (; i < length; ++i) result[i] = items[i] + value;
+}
+
+// result[i] = items[i] * value
+template <typename T>
+inline void mul(const T* items, T value, T* result, size_t length) {
+  for (size_t i = 0; i < length; ++i) result[i] = items[i] * value;
+}
+
+inline void mul(const double* items, double value, double* result, size_t length) {
+  size_t i = 0;
+#if defined(__AVX__)
+  __m256d v = _mm256_set1_pd(value);
+  for (; i + 4 <= length; i += 4) {
+    _mm256_storeu_pd(result + i, _mm256_mul_pd(_mm256_loadu_pd(items + i), v));
+  }
+#elif defined(__SSE2__)
+  __m128d v = _mm_set1_pd(value);
+  for (; i + 2 <= length; i += 2) {
+    _mm_storeu_pd(result + i, _mm_mul_pd(_mm_loadu_pd(items + i), v));
+  }
+#endif
+  for (; i < length; ++i) result[i] = items[i] * value;
+}
+
+// result[i] = a[i] + b[i]
+template <typename T>
+inline void add(const T* a, const T* b, T* result, size_t length) {
+  for (size_t i = 0; i < length; ++i) result[i] = a[i] + b[i];
+}
+
+inline void add(const int64_t* a, const int64_t* b, int64_t* result, size_t length) {
+  size_t i = 0;
+#if defined(__AVX2__)
+  for (; i + 4 <= length; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+    _mm256_storeu_si256((__m256i*)(result + i), _mm256_add_epi64(x, y));
+  }
+#elif defined(__SSE2__)
+  for (; i + 2 <= length; i += 2) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(a + i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(b + i));
+    _mm_storeu_si128((__m128i*)(result + i), _mm_add_epi64(x, y));
+  }
+#endif
+  for (; i < length; ++i) result[i] = a[i] + b[i];
+}
+
+inline void add(const double* a, const double* b, double* result, size_t length) {
+  size_t i = 0;
+#if defined(__AVX__)
+  for (; i + 4 <= length; i += 4) {
+    _mm256_storeu_pd(result + i, _mm256_add_pd(_mm256_loadu_pd(a + i), _mm256_loadu_pd(b + i)));
+  }
+#elif defined(__SSE2__)
+  for (; i + 2 <= length; i += 2) {
+    _mm_storeu_pd(result + i, _mm_add_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+  }
+#endif
+  for (; i < length; ++i) result[i] = a[i] + b[i];
+}
+
+// Number of items for which pred(item) is true. Written without branches so
+// that the compiler can vectorize it for simple predicates.
+template <typename T, typename P>
+inline size_t countIf(const T* items, size_t length, P& pred) {
+  size_t n = 0;
+  for (size_t i = 0; i < length; ++i) n += pred(items[i]) ? 1 : 0;
+  return n;
+}
+
+} // namespace span
+
+
+// ---------------------------------------------------------------------------
+// Vector kernels
+
+// Sum of all items
+template <typename T>
+typename SumType<T>::type sum(const TypedVector<T>* v) {
+  typename SumType<T>::type s = 0;
+  typename TypedVector<T>::ChunkIterator it(v);
+  const T* items;
+  size_t length;
+  while (it.next(items, length)) s += span::sum(items, length);
+  return s;
+}
+
+// Sum of all items of a boxed vector, treating each item as an integer
+inline uint64_t sum(const Vector* v) {
+  uint64_t s = 0;
+  Vector::ChunkIterator it(v);
+  void* const* items;
+  size_t length;
+  while (it.next(items, length)) s += (uint64_t)span::sum((const int64_t*)items, length);
+  return s;
+}
+
+// Smallest or largest item. Throws std::out_of_range if v is empty.
+template <bool Max, typename T>
+T extreme(const TypedVector<T>* v) throw(std::out_of_range) {
+  if (v->count() == 0)
+    throw std::out_of_range("empty vector has no min or max");
+  typename TypedVector<T>::ChunkIterator it(v);
+  const T* items;
+  size_t length;
+  it.next(items, length);
+  T m = span::extreme<Max>(items, length);
+  while (it.next(items, length)) {
+    T x = span::extreme<Max>(items, length);
+    if (Max ? x > m : x < m) m = x;
+  }
+  return m;
+}
+
+template <typename T>
+inline T min(const TypedVector<T>* v) throw(std::out_of_range) { return extreme<false>(v); }
+
+template <typename T>
+inline T max(const TypedVector<T>* v) throw(std::out_of_range) { return extreme<true>(v); }
+
+// Number of items for which pred(item) is true
+template <typename T, typename P>
+size_t countIf(const TypedVector<T>* v, P pred) {
+  size_t n = 0;
+  typename TypedVector<T>::ChunkIterator it(v);
+  const T* items;
+  size_t length;
+  while (it.next(items, length)) n += span::countIf(items, length, pred);
+  return n;
+}
+
+// True if a and b hold the same items. Items are compared by their bits, so a
+// NaN equals itself. Leaves shared by a and b are not compared.
+template <typename T>
+bool equals(const TypedVector<T>* a, const TypedVector<T>* b) {
+  if (a == b) return true;
+  if (a->count() != b->count()) return false;
+  typename TypedVector<T>::ChunkIterator ait(a), bit(b);
+  const T *aitems = 0, *bitems = 0;
+  size_t alength = 0, blength = 0;
+  while (true) {
+    if (alength == 0 && !ait.next(aitems, alength)) break;
+    if (blength == 0 && !bit.next(bitems, blength)) break;
+    size_t n = (alength < blength) ? alength : blength;
+    if (aitems != bitems && memcmp(aitems, bitems, sizeof(T) * n) != 0) return false;
+    aitems += n; alength -= n;
+    bitems += n; blength -= n;
+  }
+  return true;
+}
+
+// Function objects for mapChunks
+template <typename T> struct _AddValue {
+  T value;
+  void operator()(const T* items, T* result, size_t length) { span::add(items, value, result, length); }
+};
+template <typename T> struct _MulValue {
+  T value;
+  void operator()(const T* items, T* result, size_t length) { span::mul(items, value, result, length); }
+};
+template <typename T> struct _AddItems {
+  void operator()(const T* a, const T* b, T* result, size_t length) { span::add(a, b, result, length); }
+};
+
+// True if adding value leaves every item as it is, bit for bit. For floating
+// point that's only -0.0, since -0.0 + 0.0 is +0.0.
+template <typename T> inline bool _isAddIdentity(T value) {
+  return value == 0 && (std::is_integral<T>::value || signbit(value));
+}
+
+// Returns a vector with value added to each item
+template <typename T>
+TypedVector<T>* add(const TypedVector<T>* v, T value) {
+  if (_isAddIdentity(value)) return const_cast<TypedVector<T>*>(v)->retain();
+  _AddValue<T> f = { value };
+  return v->mapChunks(f);
+}
+
+// Returns a vector with each item multiplied by value
+template <typename T>
+TypedVector<T>* mul(const TypedVector<T>* v, T value) {
+  if (value == 1) return const_cast<TypedVector<T>*>(v)->retain();
+  _MulValue<T> f = { value };
+  return v->mapChunks(f);
+}
+
+// Returns a vector with each item multiplied by factor
+inline FloatVector* scale(const FloatVector* v, double factor) { return mul(v, factor); }
+
+// Returns a vector where each item is the sum of the items at the same index
+// of a and b. Throws std::invalid_argument if a and b differ in count.
+template <typename T>
+TypedVector<T>* add(const TypedVector<T>* a, const TypedVector<T>* b) throw(std::invalid_argument) {
+  return a->mapChunks(b, _AddItems<T>());
+}
+
+}} // namespace hue::kernels
+#endif // _HUE_RUNTIME_VECTOR_KERNELS_INCLUDED
@@ -0,0 +1,150 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+#ifndef _HUE_RUNTIME_INCLUDED
+#define _HUE_RUNTIME_INCLUDED
+
+#include <hue/Text.h>
+#include <hue/runtime/ObjectStats.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+namespace hue {
+
+// Types
+typedef double   Float;
+typedef int64_t  Int;
+// UChar is defined by Text.h
+typedef uint8_t  Byte;
+typedef bool     Bool;
+typedef struct DataS_ { Int length; Byte data[0]; }* DataS;
+typedef struct TextS_ { Int length; UChar data[0]; }* TextS;
+
+// Write a value to stdout. Mostly for testing and debugging.
+void stdout_write(const Bool v);     // _ZN3hue12stdout_writeEb
+void stdout_write(const Float v);    // _ZN3hue12stdout_writeEd
+void stdout_write(const Int v);      // _ZN3hue12stdout_writeEx
+void stdout_write(const UChar v);    // _ZN3hue12stdout_writeEj
+void stdout_write(const Byte v);     // _ZN3hue12stdout_writeEh
+void stdout_write(const DataS data); // _ZN3hue12stdout_writeEPNS_6DataS_E
+void stdout_write(const TextS data); // _ZN3hue12stdout_writeEPNS_6TextS_E
+
+class Vector;
+class VectorRef;
+struct Allocator;
+class Region;
+
+} // namespace hue
+
+// Memory (see Allocator.h)
+extern "C" {
+
+// Lets threads other than the calling one use objects (see
+// hue::AtomicRefcounts). Programs must call this before starting a thread of
+// their own.
+void hue_use_atomic_refcounts();
+
+// Makes the runtime get its memory from *allocator*. Must be called before
+// anything is allocated; returns 0 and does nothing otherwise.
+int hue_install_allocator(const hue::Allocator* allocator);
+
+// Starts a region which the calling thread allocates objects from until
+// hue_region_end, which frees all of them at once.
+hue::Region* hue_region_begin();
+void hue_region_end(hue::Region* region);
+
+// Deferred release (see hue::setDeferredRelease). hue_drain_releases destroys
+// queued objects for up to *budget_ns* nanoseconds (no limit if 0) and
+// returns 1 if none are left.
+void hue_set_deferred_release(int deferred);
+int hue_drain_releases(int64_t budget_ns);
+
+// Object statistics (see ObjectStats.h). hue_object_stats sets *totals* to
+// the counts of up to *capacity* types and returns the number of types.
+size_t hue_object_stats(hue::ObjectStats::Totals* totals, size_t capacity);
+void hue_dump_object_stats(FILE* f);
+
+} // extern "C"
+
+// Vectors (see Vector.h) for generated code. Items are 64-bit values, which
+// generated code converts to and from its own types. Functions which return a
+// vector return a reference which the caller must release.
+extern "C" {
+
+// Returns a vector holding the *count* items at *items*
+hue::Vector* hue_vector_create(void* const* items, int64_t count);
+
+// Returns a vector with *item* added to the end of v. v is left untouched.
+hue::Vector* hue_vector_append(hue::Vector* v, void* item);
+
+int64_t hue_vector_count(const hue::Vector* v);
+
+// Returns the item at index i. Aborts the program if i is out of range.
+void* hue_vector_item_at(const hue::Vector* v, int64_t i);
+
+// Sets *items* to the items starting at index i which are stored next to each
+// other and returns their number (see Vector::chunkAt). Returns 0 if i is out
+// of range.
+int64_t hue_vector_chunk_at(const hue::Vector* v, int64_t i, void* const** items);
+
+hue::Vector* hue_vector_retain(hue::Vector* v);
+void hue_vector_release(hue::Vector* v);
+
+// Vectors held by value (see VectorRef in Vector.h), which the caller can
+// keep in registers or on the stack and only box into a hue::Vector when
+// storing it in another object. Handles are passed by pointer, and functions
+// which make a new handle write it to *out*, which the caller must release.
+// Like any reference, a handle which is replaced by a new version must be
+// released, or be appended to with hue_vector_ref_append_and_release if it
+// isn't used again.
+
+void hue_vector_ref_create(void* const* items, int64_t count, hue::VectorRef* out);
+
+// Writes v with *item* added to the end to *out*. v is left untouched.
+void hue_vector_ref_append(const hue::VectorRef* v, void* item, hue::VectorRef* out);
+
+// Adds *item* to the end of v, taking over v's references: v's tail and trie
+// are modified in place when nothing else uses them (see
+// VectorRef::appendAndRelease).
+void hue_vector_ref_append_and_release(hue::VectorRef* v, void* item);
+
+// Returns the item at index i. Aborts the program if i is out of range.
+void* hue_vector_ref_item_at(const hue::VectorRef* v, int64_t i);
+
+// Returns a hue::Vector holding the items of v, or writes a handle to the
+// items of a hue::Vector to *out*
+hue::Vector* hue_vector_ref_box(const hue::VectorRef* v);
+void hue_vector_ref_unbox(const hue::Vector* v, hue::VectorRef* out);
+
+void hue_vector_ref_retain(const hue::VectorRef* v);
+void hue_vector_ref_release(hue::VectorRef* v);
+
+// Layout of a vector and its nodes, which generated code can read directly to
+// get the count and to look up items in the tail without a call. A vector of
+// constants can also be laid out statically, in read-only memory: the vector
+// and all nodes then have a refcount of hue::Unretainable and each node's
+// capacity equals its length. Such a vector is used like any other (see
+// test/test_vector_abi.cc).
+//
+//   Vector { uint64 refcount; int64 count; uint32 shift; uint8 tailLength;
+//            Node* root; Node* tail; }
+//   Node   { uint64 refcount; uint8 length, capacity, relaxed, branch;
+//            uint32 hash; void* items[]; }
+//   VectorRef { int64 count; uint32 shift; uint8 tailLength;
+//               Node* root; Node* tail; }
+//
+enum {
+  HUE_VECTOR_COUNT_OFFSET = 8,
+  HUE_VECTOR_TAIL_LENGTH_OFFSET = 20,
+  HUE_VECTOR_TAIL_OFFSET = 32,
+  HUE_VECTOR_NODE_ITEMS_OFFSET = 16,
+  HUE_VECTOR_REF_SIZE = 32,
+  HUE_VECTOR_REF_COUNT_OFFSET = 0,
+  HUE_VECTOR_REF_TAIL_LENGTH_OFFSET = 12,
+  HUE_VECTOR_REF_TAIL_OFFSET = 24,
+};
+
+} // extern "C"
+
+#endif // _HUE_RUNTIME_INCLUDED
@@ -0,0 +1,77 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+#include "Allocator.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+namespace hue {
+
+// Chunks start with a header, padded so that their data is aligned
+static const size_t ChunkHeaderSize = 32;
+
+static void* systemAlloc(void*, size_t size) {
+  return malloc(size);
+}
+
+static void* systemRealloc(void*, void* ptr, size_t, size_t size) {
+  return realloc(ptr, size);
+}
+
+static void systemDealloc(void*, void* ptr, size_t) {
+  free(ptr);
+}
+
+const Allocator Allocator::System = { systemAlloc, systemRealloc, systemDealloc, 0 };
+Allocator Allocator::current_ = Allocator::System;
+bool Allocator::used_ = false;
+
+bool Allocator::install(const Allocator& allocator) {
+  if (used_) return false;
+  current_ = allocator;
+  return true;
+}
+
+
+// ------------------------------------------------------
+// Region
+
+__thread Region* Region::current_ = 0;
+
+Region::Region()
+    : outer_(current_), chunks_(0), next_(0), end_(0), chunkBytes_(0), usedBytes_(0) {
+  current_ = this;
+}
+
+Region::~Region() {
+  assert(current_ == this); // regions must be destroyed in reverse order
+  current_ = outer_;
+  Chunk* c = chunks_;
+  while (c != 0) {
+    Chunk* next = c->next;
+    deallocateRaw(c, ChunkHeaderSize + c->size);
+    c = next;
+  }
+}
+
+size_t Region::allocatedBytes() const {
+  return usedBytes_ + (chunks_ ? (size_t)(next_ - chunks_->data) : 0);
+}
+
+void* Region::allocChunk(size_t size) {
+  static_assert(sizeof(Chunk) <= ChunkHeaderSize, "chunk header too large");
+  size_t chunkSize = chunks_ ? chunks_->size * 2 : MinChunkSize;
+  while (chunkSize < size) chunkSize *= 2;
+  Chunk* c = (Chunk*)allocateRaw(ChunkHeaderSize + chunkSize);
+  if (chunks_ != 0) usedBytes_ += next_ - chunks_->data;
+  c->next = chunks_;
+  c->size = chunkSize;
+  c->data = (uint8_t*)c + ChunkHeaderSize;
+  chunks_ = c;
+  chunkBytes_ += chunkSize;
+  next_ = c->data + size;
+  end_ = c->data + chunkSize;
+  return c->data;
+}
+
+} // namespace hue
@@ -0,0 +1,230 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+//
+// Where the runtime gets its memory from.
+//
+// All memory goes through an Allocator, a table of functions which a program
+// can replace when it starts -- before anything has been allocated -- to use
+// another malloc, to track allocations and so on, without rebuilding the
+// runtime. The default is malloc and free.
+//
+// Layered on top of the allocator:
+//
+// - Objects declared with HUE_POOLED_OBJECT are served from per-thread caches
+//   of size-classed blocks (see Pool.h), which take slabs from the allocator.
+//
+// - While a Region is alive, the objects allocated by its thread come from the
+//   region instead, and are all freed at once when the region goes away.
+//
+// The runtime's own records -- thread caches, owner records, release queues
+// and so on -- come from the allocator too, through newRaw and RawAllocator.
+// The exceptions are threads and WorkPool, which the program creates itself.
+//
+#ifndef _HUE_RUNTIME_ALLOCATOR_INCLUDED
+#define _HUE_RUNTIME_ALLOCATOR_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <new>
+
+namespace hue {
+
+struct Allocator {
+  // Returns at least *size* bytes aligned to 16 bytes, or 0
+  void* (*alloc)(void* context, size_t size);
+  // Resizes memory returned by alloc from *oldSize* to *size* bytes
+  void* (*realloc)(void* context, void* ptr, size_t oldSize, size_t size);
+  // Frees memory returned by alloc. *size* is the size it was allocated with.
+  void (*dealloc)(void* context, void* ptr, size_t size);
+  // Passed to the functions above
+  void* context;
+
+  // Makes *allocator* the one used by the runtime. Returns false, and changes
+  // nothing, if anything has already been allocated: memory must be freed by
+  // the allocator it came from.
+  static bool install(const Allocator& allocator);
+
+  // The allocator in use
+  static inline const Allocator& current() { return current_; }
+
+  // The default allocator, malloc and free
+  static const Allocator System;
+
+  static Allocator current_;
+  static bool used_;
+};
+
+// Every call into the allocator marks it as used, so that it can't be
+// replaced while it has memory out
+inline void markAllocatorUsed() {
+  if (!__atomic_load_n(&Allocator::used_, __ATOMIC_RELAXED)) {
+    __atomic_store_n(&Allocator::used_, true, __ATOMIC_RELAXED);
+  }
+}
+
+// Allocates memory from the allocator in use, ignoring any Region
+inline void* allocateRaw(size_t size) {
+  markAllocatorUsed();
+  return Allocator::current_.alloc(Allocator::current_.context, size);
+}
+
+// Resizes memory returned by allocateRaw. *ptr* may be 0 if *oldSize* is 0.
+inline void* reallocateRaw(void* ptr, size_t oldSize, size_t size) {
+  markAllocatorUsed();
+  return Allocator::current_.realloc(Allocator::current_.context, ptr, oldSize, size);
+}
+
+inline void deallocateRaw(void* ptr, size_t size) {
+  markAllocatorUsed();
+  Allocator::current_.dealloc(Allocator::current_.context, ptr, size);
+}
+
+// Constructs a T in memory from allocateRaw, and destroys and frees one
+template <typename T, typename... Args> inline T* newRaw(Args... args) {
+  return new (allocateRaw(sizeof(T))) T(args...);
+}
+
+template <typename T> inline void deleteRaw(T* p) {
+  p->~T();
+  deallocateRaw(p, sizeof(T));
+}
+
+// Lets standard containers get their memory from allocateRaw
+template <typename T> struct RawAllocator {
+  typedef T value_type;
+  RawAllocator() {}
+  template <typename U> RawAllocator(const RawAllocator<U>&) {}
+  T* allocate(size_t n) { return (T*)allocateRaw(sizeof(T) * n); }
+  void deallocate(T* p, size_t n) { deallocateRaw(p, sizeof(T) * n); }
+};
+template <typename T, typename U>
+inline bool operator==(const RawAllocator<T>&, const RawAllocator<U>&) { return true; }
+template <typename T, typename U>
+inline bool operator!=(const RawAllocator<T>&, const RawAllocator<U>&) { return false; }
+
+
+// A region hands out memory by moving a pointer through large chunks, and frees
+// all of it at once when it's destroyed, in time proportional to the number
+// of chunks rather than of objects. Chunks double in size as the region
+// grows.
+//
+// Creating a region makes it the current region of the calling thread until
+// it's destroyed. Objects which the thread allocates in the meantime come
+// from the region, and freeing them does nothing. Regions nest.
+//
+//   uint64_t total;
+//   {
+//     Region region;
+//     Vector* v = ...;  // built in the region
+//     total = sum(v);   // no need to release v
+//   }                   // v's memory is gone
+//
+// Objects allocated in a region must not be used after it's destroyed, nor by
+// other threads; copy out whatever needs to outlive it. Their dealloc methods
+// are not called, so references they hold to objects outside the region are
+// never released. Objects from outside the region can be used in it: they're
+// never modified to point into it; those which are modified in place grow
+// outside it (see isCurrent and Alongside).
+class Region {
+public:
+  static const size_t MinChunkSize = 64 * 1024;
+
+  Region();
+  ~Region();
+
+  // Returns *size* bytes aligned to 16 bytes
+  inline void* alloc(size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    if (size > (size_t)(end_ - next_)) return allocChunk(size);
+    void* p = next_;
+    next_ += size;
+    return p;
+  }
+
+  // True if ptr was allocated from the calling thread's current region or
+  // one it's nested in
+  static inline bool owns(const void* ptr) {
+    for (const Region* r = current_; r != 0; r = r->outer_) {
+      if (r->contains(ptr)) return true;
+    }
+    return false;
+  }
+
+  // True if ptr was allocated from the region
+  inline bool contains(const void* ptr) const {
+    for (const Chunk* c = chunks_; c != 0; c = c->next) {
+      if ((const uint8_t*)ptr >= c->data && (const uint8_t*)ptr < c->data + c->size) return true;
+    }
+    return false;
+  }
+
+  // Bytes allocated from the region, and bytes held in chunks
+  size_t allocatedBytes() const;
+  size_t chunkBytes() const { return chunkBytes_; }
+
+  // The calling thread's innermost region, if any
+  static inline Region* current() { return current_; }
+  static __thread Region* current_ __attribute__((tls_model("initial-exec")));
+
+  // True if ptr came from where memory is allocated now: the current region,
+  // or the allocator when there is none. Objects are only modified in place
+  // when this holds, so that an object never points into a region which goes
+  // away before it does.
+  static inline bool isCurrent(const void* ptr) {
+    return current_ == 0 || current_->contains(ptr);
+  }
+
+  // Until destroyed, makes the calling thread allocate where *ptr* came from:
+  // from the region holding it, or from the allocator if no region does. Lets
+  // an object which is modified in place, like a transient, grow inside a
+  // region it was created outside of. A null ptr changes nothing.
+  class Alongside {
+  public:
+    explicit Alongside(const void* ptr) : saved_(current_) {
+      if (ptr == 0 || saved_ == 0 || saved_->contains(ptr)) return;
+      Region* r = saved_->outer_;
+      while (r != 0 && !r->contains(ptr)) r = r->outer_;
+      current_ = r;
+    }
+    ~Alongside() { current_ = saved_; }
+
+  private:
+    Alongside(const Alongside&);
+    Alongside& operator=(const Alongside&);
+    Region* saved_;
+  };
+
+private:
+  struct Chunk {
+    Chunk* next;
+    size_t size;
+    uint8_t* data;
+  };
+
+  Region(const Region&);
+  Region& operator=(const Region&);
+  void* allocChunk(size_t size);
+
+  Region* outer_;
+  Chunk* chunks_; // newest first
+  uint8_t* next_;
+  uint8_t* end_;
+  size_t chunkBytes_;
+  size_t usedBytes_; // in chunks other than the newest
+};
+
+// Allocates memory for an object, from the current region if there is one
+inline void* allocate(size_t size) {
+  Region* region = Region::current_;
+  return (region != 0) ? region->alloc(size) : allocateRaw(size);
+}
+
+// Frees memory returned by allocate
+inline void deallocate(void* ptr, size_t size) {
+  if (Region::current_ != 0 && Region::owns(ptr)) return;
+  deallocateRaw(ptr, size);
+}
+
+} // namespace hue
+#endif // _HUE_RUNTIME_ALLOCATOR_INCLUDED
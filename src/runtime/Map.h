@@ -0,0 +1,470 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+//
+// An immutable and persistent hash map implemented as a hash array mapped trie
+// (HAMT) by Phil Bagwell, using the compact node layout of CHAMP by Michael
+// Steindorfer and Jurgen Vinju.
+//
+// Each level of the trie uses 5 bits of a key's hash to pick one of 32 slots in
+// a node. Only the slots in use are stored: two bitmaps tell which slots hold a
+// key-value entry and which hold a child node, and the position of a slot is
+// the number of bits set below it (a popcount). Entries come first, followed by
+// the children. Keys whose hashes are equal in every bit end up together in a
+// collision node below the last level, which is searched linearly.
+//
+// Removing a key leaves the trie in the same shape as if the key had never
+// been added: a node left with a single entry and no children is inlined into
+// its parent.
+//
+// Keys and values are copied as they are, like the items of a TypedVector, so
+// they must be types which can be copied with memcpy (e.g. integers or
+// pointers). Hash and Equal default to std::hash and std::equal_to.
+//
+#ifndef _HUE_RUNTIME_MAP_INCLUDED
+#define _HUE_RUNTIME_MAP_INCLUDED
+
+#include <hue/runtime/object.h>
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <functional>
+
+#ifdef DEBUG_MapNode_refcount
+static size_t live_map_node_count = 0;
+#define DEBUG_LIVECOUNT_MapNode live_map_node_count
+#define DEBUG_LIVECOUNT_MapNode_INC HUE_DEBUG_COUNT_INC(DEBUG_LIVECOUNT_MapNode);
+#define DEBUG_LIVECOUNT_MapNode_DEC HUE_DEBUG_COUNT_DEC(DEBUG_LIVECOUNT_MapNode);
+#else
+#define DEBUG_LIVECOUNT_MapNode_INC
+#define DEBUG_LIVECOUNT_MapNode_DEC
+#endif
+
+#ifdef DEBUG_Map_refcount
+static size_t live_map_count = 0;
+#define DEBUG_LIVECOUNT_Map live_map_count
+#define DEBUG_LIVECOUNT_Map_INC HUE_DEBUG_COUNT_INC(DEBUG_LIVECOUNT_Map);
+#define DEBUG_LIVECOUNT_Map_DEC HUE_DEBUG_COUNT_DEC(DEBUG_LIVECOUNT_Map);
+#else
+#define DEBUG_LIVECOUNT_Map_INC
+#define DEBUG_LIVECOUNT_Map_DEC
+#endif
+
+namespace hue {
+
+template <typename K, typename V, typename Hash = std::hash<K>, typename Equal = std::equal_to<K> >
+class Map { HUE_POOLED_OBJECT(Map)
+public:
+  typedef K Key;
+  typedef V Value;
+
+  struct Entry {
+    K key;
+    V value;
+  };
+
+private:
+  // Number of bits of a hash. Nodes at this shift and below are collision nodes.
+  static const uint32_t HashBits = sizeof(size_t) * 8;
+
+  class Node { HUE_POOLED_OBJECT(Node)
+  public:
+    static const Node _Empty;
+    static Node* Empty;
+
+    uint32_t dataMap; // bit i is set if slot i holds an entry (unused in collision nodes)
+    uint32_t nodeMap; // bit i is set if slot i holds a child
+    uint32_t dataCount; // number of entries
+
+    // Entries, followed by the children. Must be the last member.
+    Entry entries[0];
+
+    // Creates a node with room for the slots given by the bitmaps. The entries
+    // and children are filled in by the caller.
+    static Node* create(uint32_t dataMap, uint32_t nodeMap, uint32_t dataCount) {
+      DEBUG_LIVECOUNT_MapNode_INC
+      Node* node = __alloc(allocSize(dataCount, popcount(nodeMap)));
+      node->dataMap = dataMap;
+      node->nodeMap = nodeMap;
+      node->dataCount = dataCount;
+      return node;
+    }
+
+    inline uint32_t nodeCount() const { return popcount(nodeMap); }
+
+    inline Node** children() {
+      return (Node**)((uint8_t*)entries + childrenOffset(dataCount));
+    }
+    inline Node* const* children() const {
+      return (Node* const*)((const uint8_t*)entries + childrenOffset(dataCount));
+    }
+
+    // Position of the slot *bit* among the slots set in *map*
+    static inline uint32_t index(uint32_t map, uint32_t bit) {
+      return popcount(map & (bit - 1));
+    }
+
+    static inline uint32_t popcount(uint32_t map) { return __builtin_popcount(map); }
+
+    inline size_t allocSize() const { return allocSize(dataCount, nodeCount()); }
+
+  private:
+    Node() : refcount_(Unretainable), dataMap(0), nodeMap(0), dataCount(0) {}
+
+    static inline size_t childrenOffset(uint32_t dataCount) {
+      return (sizeof(Entry) * dataCount + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    }
+
+    static inline size_t allocSize(uint32_t dataCount, uint32_t nodeCount) {
+      return sizeof(Node) + childrenOffset(dataCount) + (sizeof(Node*) * nodeCount);
+    }
+
+    void dealloc() {
+      DEBUG_LIVECOUNT_MapNode_DEC
+      Node** c = children();
+      for (uint32_t i = 0, n = nodeCount(); i < n; ++i) {
+        if (c[i]) c[i]->release(); // null when moved out by splice
+      }
+    }
+  };
+
+public:
+  // The empty map
+  static Map* Empty;
+
+  // Number of entries in the receiver
+  const size_t count() const { return count_; }
+
+  // Returns a pointer to the value of key, or 0 if the receiver has no such key.
+  // The pointer is valid for as long as the receiver is.
+  const V* get(const K& key) const { return find(root_, key); }
+
+  inline bool contains(const K& key) const { return get(key) != 0; }
+
+  // Returns a map with key set to value
+  Map* assoc(const K& key, const V& value) const {
+    bool added = false;
+    Node* root = assoc(root_, false, 0, hashOf(key), key, value, added);
+    return create(count_ + (added ? 1 : 0), root, TransferReference);
+  }
+
+  // Returns a map without key. Returns the receiver (with a +1 refcount) if it
+  // doesn't have key.
+  Map* dissoc(const K& key) const {
+    bool removed = false;
+    Node* root = dissoc(root_, false, 0, hashOf(key), key, removed);
+    if (!removed) return const_cast<Map*>(this)->retain();
+    if (count_ == 1) {
+      root->release();
+      return Empty;
+    }
+    return create(count_ - 1, root, TransferReference);
+  }
+
+  // Calls f(key, value) for each entry, in no particular order
+  template <typename F> void forEach(F f) const { forEach(root_, f); }
+
+  // A transient is a mutable builder for a map. Like Vector::Transient, it
+  // copies a node the first time it modifies it and from then on modifies that
+  // node in place. A node is owned by the transient when it's only referenced
+  // from a path of owned nodes (i.e. its refcount is 1 and so is the refcount
+  // of all its parents).
+  //
+  // A transient must not be used by more than one thread at a time.
+  class Transient { HUE_OBJECT(Transient)
+  public:
+    static Transient* create(const Map* m) {
+      Transient* t = __alloc();
+      t->count_ = m->count_;
+      t->root_ = m->root_->retain();
+      return t;
+    }
+
+    // Number of entries in the receiver
+    const size_t count() const { return count_; }
+
+    // Returns a pointer to the value of key, or 0 if the receiver has no such
+    // key. The pointer is valid until the receiver is next modified.
+    const V* get(const K& key) const { return Map::find(root_, key); }
+
+    // Sets key to value. Returns the receiver.
+    Transient* assoc(const K& key, const V& value) {
+      Region::Alongside alongside(this);
+      bool added = false;
+      setRoot(Map::assoc(root_, true, 0, hashOf(key), key, value, added));
+      if (added) ++count_;
+      return this;
+    }
+
+    // Removes key. Returns the receiver.
+    Transient* dissoc(const K& key) {
+      Region::Alongside alongside(this);
+      bool removed = false;
+      setRoot(Map::dissoc(root_, true, 0, hashOf(key), key, removed));
+      if (removed && --count_ == 0) {
+        root_->release();
+        root_ = Node::Empty;
+      }
+      return this;
+    }
+
+    // Returns an immutable map with the contents of the receiver
+    Map* persistent() const {
+      if (count_ == 0) return Map::Empty;
+      return Map::create(count_, root_, RetainReference);
+    }
+
+  protected:
+    void dealloc() {
+      root_->release();
+    }
+
+    // Takes over a root returned by Map::assoc or Map::dissoc
+    inline void setRoot(Node* root) {
+      if (root == root_) return;
+      root_->release();
+      root_ = root;
+    }
+
+  private:
+    size_t count_;
+    Node* root_;
+  };
+
+  // Returns a transient which initially has the same contents as the receiver
+  Transient* asTransient() const { return Transient::create(this); }
+
+protected:
+  // Used for the empty map ::Empty
+  Map() : refcount_(Unretainable), count_(0), root_(Node::Empty) {}
+
+  static Map* create(size_t count, Node* root, RefRule root_refrule) {
+    DEBUG_LIVECOUNT_Map_INC
+    Map* m = __alloc(sizeof(Map));
+    m->count_ = count;
+    m->root_ = (root_refrule == TransferReference) ? root : root->retain();
+    return m;
+  }
+
+  inline size_t allocSize() const { return sizeof(Map); }
+
+  void dealloc() {
+    DEBUG_LIVECOUNT_Map_DEC
+    root_->release();
+  }
+
+  static inline size_t hashOf(const K& key) { return Hash()(key); }
+
+  // Slot of *hash* in a node at *shift*
+  static inline uint32_t bitFor(size_t hash, uint32_t shift) {
+    return 1u << ((hash >> shift) & 0x1f);
+  }
+
+  static const V* find(const Node* node, const K& key) {
+    size_t hash = hashOf(key);
+    for (uint32_t shift = 0; shift < HashBits; shift += 5) {
+      uint32_t bit = bitFor(hash, shift);
+      if (node->dataMap & bit) {
+        const Entry& e = node->entries[Node::index(node->dataMap, bit)];
+        return Equal()(e.key, key) ? &e.value : 0;
+      }
+      if ((node->nodeMap & bit) == 0) return 0;
+      node = node->children()[Node::index(node->nodeMap, bit)];
+    }
+    // Collision node
+    for (uint32_t i = 0; i < node->dataCount; ++i) {
+      if (Equal()(node->entries[i].key, key)) return &node->entries[i].value;
+    }
+    return 0;
+  }
+
+  // Creates a node for shift and below holding two entries with different keys
+  static Node* merge(uint32_t shift, const Entry& e1, size_t hash1, const Entry& e2, size_t hash2) {
+    if (shift >= HashBits) {
+      Node* node = Node::create(0, 0, 2);
+      node->entries[0] = e1;
+      node->entries[1] = e2;
+      return node;
+    }
+    uint32_t bit1 = bitFor(hash1, shift);
+    uint32_t bit2 = bitFor(hash2, shift);
+    if (bit1 == bit2) {
+      Node* node = Node::create(0, bit1, 0);
+      node->children()[0] = merge(shift + 5, e1, hash1, e2, hash2);
+      return node;
+    }
+    Node* node = Node::create(bit1 | bit2, 0, 2);
+    node->entries[bit1 < bit2 ? 0 : 1] = e1;
+    node->entries[bit1 < bit2 ? 1 : 0] = e2;
+    return node;
+  }
+
+  // Creates a copy of node with the entries in the range [from, to) replaced by
+  // *newEntries* and the children in the range [childFrom, childTo) replaced
+  // by *newChildren*. References to the new children are taken over. The
+  // children which are kept are retained, or moved out of node if *steal* is
+  // true (node is then only good for releasing).
+  static Node* splice(Node* node, bool steal, uint32_t dataMap, uint32_t nodeMap,
+                      uint32_t from, uint32_t to, const Entry* newEntries, uint32_t newEntryCount,
+                      uint32_t childFrom, uint32_t childTo, Node* const* newChildren, uint32_t newChildCount) {
+    uint32_t dataCount = node->dataCount - (to - from) + newEntryCount;
+    Node* newnode = Node::create(dataMap, nodeMap, dataCount);
+    Entry* entries = newnode->entries;
+    memcpy(entries, node->entries, sizeof(Entry) * from);
+    if (newEntryCount) memcpy(entries + from, newEntries, sizeof(Entry) * newEntryCount);
+    memcpy(entries + from + newEntryCount, node->entries + to, sizeof(Entry) * (node->dataCount - to));
+
+    Node** children = node->children();
+    Node** newnodeChildren = newnode->children();
+    uint32_t nodeCount = node->nodeCount();
+    memcpy(newnodeChildren, children, sizeof(Node*) * childFrom);
+    if (newChildCount) memcpy(newnodeChildren + childFrom, newChildren, sizeof(Node*) * newChildCount);
+    memcpy(newnodeChildren + childFrom + newChildCount, children + childTo,
+           sizeof(Node*) * (nodeCount - childTo));
+    if (steal) {
+      memset(children, 0, sizeof(Node*) * childFrom);
+      memset(children + childTo, 0, sizeof(Node*) * (nodeCount - childTo));
+    } else {
+      for (uint32_t i = 0; i < childFrom; ++i) children[i]->retain();
+      for (uint32_t i = childTo; i < nodeCount; ++i) children[i]->retain();
+    }
+    return newnode;
+  }
+
+  // Returns node with key set to value. If *edit* is true and node is owned by a
+  // transient, node is modified in place and returned. Otherwise a new node
+  // with a +1 refcount is returned. *added* is set to true if key is new.
+  static Node* assoc(Node* node, bool edit, uint32_t shift, size_t hash,
+                     const K& key, const V& value, bool& added) {
+    bool owned = edit && node->isUnique() && Region::isCurrent(node);
+    Entry entry = { key, value };
+
+    if (shift >= HashBits) {
+      // Collision node
+      uint32_t i = 0;
+      while (i < node->dataCount && !Equal()(node->entries[i].key, key)) ++i;
+      if (i < node->dataCount && owned) {
+        node->entries[i].value = value;
+        return node;
+      }
+      if (i == node->dataCount) added = true;
+      return splice(node, owned, 0, 0, i, (i < node->dataCount) ? i + 1 : i, &entry, 1, 0, 0, 0, 0);
+    }
+
+    uint32_t bit = bitFor(hash, shift);
+    if (node->dataMap & bit) {
+      uint32_t i = Node::index(node->dataMap, bit);
+      const Entry& existing = node->entries[i];
+      if (Equal()(existing.key, key)) {
+        if (owned) {
+          node->entries[i].value = value;
+          return node;
+        }
+        return splice(node, owned, node->dataMap, node->nodeMap, i, i + 1, &entry, 1, 0, 0, 0, 0);
+      }
+      // Both entries move into a new child
+      added = true;
+      Node* child = merge(shift + 5, existing, hashOf(existing.key), entry, hash);
+      uint32_t ci = Node::index(node->nodeMap, bit);
+      return splice(node, owned, node->dataMap & ~bit, node->nodeMap | bit,
+                    i, i + 1, 0, 0, ci, ci, &child, 1);
+    }
+
+    if (node->nodeMap & bit) {
+      uint32_t i = Node::index(node->nodeMap, bit);
+      Node* child = node->children()[i];
+      Node* newchild = assoc(child, owned, shift + 5, hash, key, value, added);
+      if (newchild == child) return node;
+      if (owned) {
+        node->children()[i] = newchild;
+        child->release();
+        return node;
+      }
+      return splice(node, owned, node->dataMap, node->nodeMap, 0, 0, 0, 0, i, i + 1, &newchild, 1);
+    }
+
+    added = true;
+    uint32_t i = Node::index(node->dataMap, bit);
+    return splice(node, owned, node->dataMap | bit, node->nodeMap, i, i, &entry, 1, 0, 0, 0, 0);
+  }
+
+  // Returns node without key. Returns node itself if it doesn't have key or if
+  // *edit* is true and node was modified in place. Otherwise a new node with a
+  // +1 refcount is returned. *removed* is set to true if key was found.
+  static Node* dissoc(Node* node, bool edit, uint32_t shift, size_t hash,
+                      const K& key, bool& removed) {
+    bool owned = edit && node->isUnique() && Region::isCurrent(node);
+
+    if (shift >= HashBits) {
+      // Collision node
+      for (uint32_t i = 0; i < node->dataCount; ++i) {
+        if (Equal()(node->entries[i].key, key)) {
+          removed = true;
+          return splice(node, owned, 0, 0, i, i + 1, 0, 0, 0, 0, 0, 0);
+        }
+      }
+      return node;
+    }
+
+    uint32_t bit = bitFor(hash, shift);
+    if (node->dataMap & bit) {
+      uint32_t i = Node::index(node->dataMap, bit);
+      if (!Equal()(node->entries[i].key, key)) return node;
+      removed = true;
+      return splice(node, owned, node->dataMap & ~bit, node->nodeMap, i, i + 1, 0, 0, 0, 0, 0, 0);
+    }
+
+    if (node->nodeMap & bit) {
+      uint32_t i = Node::index(node->nodeMap, bit);
+      Node* child = node->children()[i];
+      Node* newchild = dissoc(child, owned, shift + 5, hash, key, removed);
+      if (!removed) return node;
+
+      if (newchild->dataCount == 1 && newchild->nodeMap == 0) {
+        // Inline the only entry left in the child
+        Entry entry = newchild->entries[0];
+        if (newchild != child) newchild->release();
+        uint32_t di = Node::index(node->dataMap, bit);
+        return splice(node, owned, node->dataMap | bit, node->nodeMap & ~bit,
+                      di, di, &entry, 1, i, i + 1, 0, 0);
+      }
+      if (newchild == child) return node;
+      if (owned) {
+        node->children()[i] = newchild;
+        child->release();
+        return node;
+      }
+      return splice(node, owned, node->dataMap, node->nodeMap, 0, 0, 0, 0, i, i + 1, &newchild, 1);
+    }
+
+    return node;
+  }
+
+  template <typename F> static void forEach(const Node* node, F& f) {
+    for (uint32_t i = 0; i < node->dataCount; ++i) f(node->entries[i].key, node->entries[i].value);
+    Node* const* children = node->children();
+    for (uint32_t i = 0, n = node->nodeCount(); i < n; ++i) forEach(children[i], f);
+  }
+
+private:
+  size_t count_; // number of entries in this map
+  Node* root_;
+
+  static const Map _Empty;
+};
+
+template <typename K, typename V, typename H, typename E>
+const typename Map<K, V, H, E>::Node Map<K, V, H, E>::Node::_Empty;
+template <typename K, typename V, typename H, typename E>
+typename Map<K, V, H, E>::Node* Map<K, V, H, E>::Node::Empty =
+  (typename Map<K, V, H, E>::Node*)&Map<K, V, H, E>::Node::_Empty;
+
+template <typename K, typename V, typename H, typename E>
+const Map<K, V, H, E> Map<K, V, H, E>::_Empty;
+template <typename K, typename V, typename H, typename E>
+Map<K, V, H, E>* Map<K, V, H, E>::Empty = (Map<K, V, H, E>*)&Map<K, V, H, E>::_Empty;
+
+} // namespace hue
+#endif // _HUE_RUNTIME_MAP_INCLUDED
@@ -0,0 +1,182 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+#include "ObjectStats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mutex>
+#include <string>
+
+namespace hue {
+
+typedef ObjectStats::Counters Counters;
+typedef ObjectStats::ThreadStats ThreadStats;
+
+namespace {
+
+// Id of the types which don't fit
+static const uint32_t OtherType = ObjectStats::MaxTypes - 1;
+
+// Type names and thread tables. Ids start at 1. Everything here is zero- or
+// constant-initialized, since objects may be counted during static
+// initialization.
+static std::mutex registryMutex;
+static uint32_t typeCount = 0;
+static const char* typeNames[ObjectStats::MaxTypes];
+static ThreadStats* registry = 0;
+static Counters retired[ObjectStats::MaxTypes];
+
+static pthread_key_t statsKey;
+static pthread_once_t statsKeyOnce = PTHREAD_ONCE_INIT;
+
+static void addCounters(Counters& dest, const Counters& src) {
+  dest.allocCount.add(src.allocCount.get());
+  dest.deallocCount.add(src.deallocCount.get());
+  dest.allocBytes.add(src.allocBytes.get());
+  dest.deallocBytes.add(src.deallocBytes.get());
+  dest.retainCount.add(src.retainCount.get());
+  dest.releaseCount.add(src.releaseCount.get());
+}
+
+// Totals of some Counters
+struct Sum {
+  uint64_t allocCount, deallocCount, allocBytes, deallocBytes, retainCount, releaseCount;
+  Sum() : allocCount(0), deallocCount(0), allocBytes(0), deallocBytes(0),
+          retainCount(0), releaseCount(0) {}
+  void add(const Counters& c) {
+    allocCount += c.allocCount.get();
+    deallocCount += c.deallocCount.get();
+    allocBytes += c.allocBytes.get();
+    deallocBytes += c.deallocBytes.get();
+    retainCount += c.retainCount.get();
+    releaseCount += c.releaseCount.get();
+  }
+};
+
+// Turns the __PRETTY_FUNCTION__ of T::__typeName, like
+// "static const char* hue::Vector::Node::__typeName()", into "hue::Vector::Node".
+// Template arguments which follow, like " [with T = double]", are kept.
+static std::string typeName(const char* prettyFunction) {
+  std::string s(prettyFunction);
+  size_t start = s.find("char");
+  start = (start == std::string::npos) ? 0 : start + 4;
+  while (start < s.size() && (s[start] == ' ' || s[start] == '*')) ++start;
+  size_t end = s.find("::__typeName()", start);
+  if (end == std::string::npos) return s;
+  return s.substr(start, end - start) + s.substr(end + strlen("::__typeName()"));
+}
+
+// Called when a thread exits. Keeps its counts.
+static void threadExit(void* arg) {
+  ThreadStats* stats = (ThreadStats*)arg;
+  {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (uint32_t i = 0; i < ObjectStats::MaxTypes; ++i) addCounters(retired[i], stats->types[i]);
+    if (stats->prev) stats->prev->next = stats->next; else registry = stats->next;
+    if (stats->next) stats->next->prev = stats->prev;
+  }
+  if (ObjectStats::current_ == stats) ObjectStats::current_ = 0;
+  deleteRaw(stats);
+}
+
+static void makeStatsKey() {
+  pthread_key_create(&statsKey, threadExit);
+}
+
+static FILE* dumpFile = 0;
+
+static void dumpAtExit() {
+  ObjectStats::dump(dumpFile);
+  if (dumpFile != stderr) fclose(dumpFile);
+}
+
+// Arranges for the counts to be written at exit if HUE_OBJECT_STATS is set
+static struct DumpAtExit {
+  DumpAtExit() {
+    const char* path = getenv("HUE_OBJECT_STATS");
+    if (path == 0 || *path == 0) return;
+    dumpFile = (strcmp(path, "1") == 0) ? stderr : fopen(path, "w");
+    if (dumpFile != 0) atexit(dumpAtExit);
+  }
+} dumpAtExit_;
+
+} // namespace
+
+
+__thread ThreadStats* ObjectStats::current_ = 0;
+
+ThreadStats* ObjectStats::newThreadStats() {
+  ThreadStats* stats = newRaw<ThreadStats>();
+  {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    stats->next = registry;
+    if (registry) registry->prev = stats;
+    registry = stats;
+  }
+  pthread_once(&statsKeyOnce, makeStatsKey);
+  pthread_setspecific(statsKey, stats);
+  current_ = stats;
+  return stats;
+}
+
+uint32_t ObjectStats::registerType(Type& type) {
+  std::lock_guard<std::mutex> lock(registryMutex);
+  if (type.id != 0) return type.id; // registered by another thread meanwhile
+  uint32_t id;
+  if (typeCount + 1 < OtherType) {
+    id = ++typeCount;
+    std::string name = typeName(type.name());
+    char* copy = (char*)allocateRaw(name.size() + 1); // kept until exit
+    memcpy(copy, name.c_str(), name.size() + 1);
+    typeNames[id] = copy;
+  } else {
+    id = OtherType;
+    typeNames[id] = "(other)";
+  }
+  __atomic_store_n(&type.id, id, __ATOMIC_RELEASE);
+  return id;
+}
+
+size_t ObjectStats::collect(Totals* totals, size_t capacity) {
+  std::lock_guard<std::mutex> lock(registryMutex);
+  size_t count = 0;
+  for (uint32_t id = 1; id < MaxTypes; ++id) {
+    if (typeNames[id] == 0) continue;
+    if (count < capacity) {
+      Sum sum;
+      sum.add(retired[id]);
+      for (ThreadStats* stats = registry; stats != 0; stats = stats->next) sum.add(stats->types[id]);
+      Totals& t = totals[count];
+      t.name = typeNames[id];
+      t.allocCount = sum.allocCount;
+      t.deallocCount = sum.deallocCount;
+      t.liveCount = sum.allocCount - sum.deallocCount;
+      t.allocBytes = sum.allocBytes;
+      t.liveBytes = sum.allocBytes - sum.deallocBytes;
+      t.retainCount = sum.retainCount;
+      t.releaseCount = sum.releaseCount;
+    }
+    ++count;
+  }
+  return count;
+}
+
+void ObjectStats::dump(FILE* f) {
+  Totals totals[MaxTypes];
+  size_t count = collect(totals, MaxTypes);
+  fprintf(f, "%12s %12s %12s %14s %14s %14s %14s  %s\n", "allocs", "frees", "live",
+          "live bytes", "alloc bytes", "retains", "releases", "type");
+  for (size_t i = 0; i < count; ++i) {
+    const Totals& t = totals[i];
+    fprintf(f, "%12llu %12llu %12llu %14llu %14llu %14llu %14llu  %s\n",
+            (unsigned long long)t.allocCount, (unsigned long long)t.deallocCount,
+            (unsigned long long)t.liveCount, (unsigned long long)t.liveBytes,
+            (unsigned long long)t.allocBytes, (unsigned long long)t.retainCount,
+            (unsigned long long)t.releaseCount, t.name);
+  }
+  fflush(f);
+}
+
+} // namespace hue
@@ -0,0 +1,96 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+//
+// Counts of allocations, frees, retains and releases of each type of reference
+// counted object (see object.h). They are always kept, so they can tell where
+// memory goes in a program as it normally runs.
+//
+// Each thread counts into a table of its own with plain loads and stores, like
+// the pool's counters (see Pool.h), and collect adds up the tables of all
+// threads, including those which have exited.
+//
+// If the environment variable HUE_OBJECT_STATS is set when the program starts,
+// the counts are written at exit: to stderr if it's "1", otherwise to the file
+// it names.
+//
+#ifndef _HUE_RUNTIME_OBJECT_STATS_INCLUDED
+#define _HUE_RUNTIME_OBJECT_STATS_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <hue/runtime/Pool.h>
+
+namespace hue {
+
+class ObjectStats {
+public:
+  // Types are numbered as they are first counted. Types past the last are
+  // counted together under the name "(other)".
+  static const uint32_t MaxTypes = 128;
+
+  struct Totals {
+    const char* name;      // qualified name of the type, like "hue::Vector::Node"
+    uint64_t allocCount;   // objects allocated
+    uint64_t deallocCount; // objects freed
+    uint64_t liveCount;    // objects allocated but not freed
+    uint64_t allocBytes;   // bytes allocated
+    uint64_t liveBytes;    // bytes allocated but not freed
+    uint64_t retainCount;  // calls to retain
+    uint64_t releaseCount; // calls to release
+  };
+
+  // Sets totals to the counts of up to *capacity* types which have been
+  // counted, and returns the number of such types. Like Pool::stats, this
+  // might miss the most recent operations of other threads.
+  static size_t collect(Totals* totals, size_t capacity);
+
+  // Writes the counts of all types to f as a table
+  static void dump(FILE* f);
+
+  // Internal. The counting is inline so that it's compiled along with the
+  // objects; everything else is in ObjectStats.cc.
+  struct Type {
+    const char* (*name)(); // returns __PRETTY_FUNCTION__ of a member of the type
+    uint32_t id;           // 0 until the type is first counted
+  };
+
+  struct Counters {
+    Pool::Counter allocCount;
+    Pool::Counter deallocCount;
+    Pool::Counter allocBytes;
+    Pool::Counter deallocBytes;
+    Pool::Counter retainCount;
+    Pool::Counter releaseCount;
+  };
+
+  struct ThreadStats {
+    Counters types[MaxTypes];
+    ThreadStats* prev;
+    ThreadStats* next;
+  };
+
+  static __thread ThreadStats* current_ __attribute__((tls_model("initial-exec")));
+  static ThreadStats* newThreadStats();
+  static uint32_t registerType(Type& type);
+
+  // The calling thread's counters for *type*
+  static inline Counters& counters(Type& type) {
+    uint32_t id = __atomic_load_n(&type.id, __ATOMIC_RELAXED);
+    if (id == 0) id = registerType(type);
+    ThreadStats* stats = current_;
+    if (stats == 0) stats = newThreadStats();
+    return stats->types[id];
+  }
+};
+
+// The Type of each class declared with HUE_OBJECT. It's constant-initialized,
+// so objects can be counted during static initialization.
+template <typename T> struct ObjectType {
+  static ObjectStats::Type type;
+};
+template <typename T> ObjectStats::Type ObjectType<T>::type = { &T::__typeName, 0 };
+
+} // namespace hue
+#endif // _HUE_RUNTIME_OBJECT_STATS_INCLUDED
@@ -0,0 +1,175 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+#include "Pool.h"
+#include "object.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+
+namespace hue {
+
+typedef Pool::Block Block;
+typedef Pool::Counters Counters;
+typedef Pool::ThreadCache ThreadCache;
+
+namespace {
+
+// Size of the chunks of memory which blocks are carved out of
+static const size_t SlabSize = 64 * 1024;
+
+struct SharedClass {
+  std::mutex mutex;
+  Block* free;
+  std::atomic<uint64_t> slabBytes;
+};
+
+static SharedClass shared[Pool::ClassCount];
+
+// All live thread caches, and the counters of threads which have exited
+static std::mutex registryMutex;
+static ThreadCache* registry = 0;
+static Counters retired[Pool::ClassCount + 1];
+
+static pthread_key_t cacheKey;
+static pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+
+static inline size_t blockSize(size_t sizeClass) {
+  return (sizeClass + 1) * Pool::Granularity;
+}
+
+static void addCounters(Counters& dest, const Counters& src) {
+  dest.allocCount.add(src.allocCount.get());
+  dest.deallocCount.add(src.deallocCount.get());
+  dest.refillCount.add(src.refillCount.get());
+  dest.flushCount.add(src.flushCount.get());
+}
+
+// Called when a thread exits. Gives the thread's blocks to the shared lists.
+static void threadExit(void* arg) {
+  ThreadCache* cache = (ThreadCache*)arg;
+  for (size_t c = 0; c < Pool::ClassCount; ++c) {
+    if (cache->count[c] != 0) Pool::flush(cache, c, cache->count[c]);
+  }
+  {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    for (size_t c = 0; c <= Pool::ClassCount; ++c) addCounters(retired[c], cache->counters[c]);
+    if (cache->prev) cache->prev->next = cache->next; else registry = cache->next;
+    if (cache->next) cache->next->prev = cache->prev;
+  }
+  if (Pool::currentCache_ == cache) Pool::currentCache_ = 0;
+  deleteRaw(cache);
+}
+
+static void makeCacheKey() {
+  pthread_key_create(&cacheKey, threadExit);
+}
+
+} // namespace
+
+
+__thread ThreadCache* Pool::currentCache_ = 0;
+
+ThreadCache* Pool::newThreadCache() {
+  ThreadCache* cache = newRaw<ThreadCache>();
+  {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    cache->next = registry;
+    if (registry) registry->prev = cache;
+    registry = cache;
+  }
+  pthread_once(&cacheKeyOnce, makeCacheKey);
+  pthread_setspecific(cacheKey, cache);
+  currentCache_ = cache;
+  return cache;
+}
+
+void* Pool::allocLarge(ThreadCache* cache, size_t size) {
+  cache->counters[ClassCount].allocCount.add();
+  return allocateRaw(size);
+}
+
+void Pool::deallocLarge(ThreadCache* cache, void* ptr, size_t size) {
+  cache->counters[ClassCount].deallocCount.add();
+  deallocateRaw(ptr, size);
+}
+
+// Moves *count* blocks from the front of the cache's list to the shared list
+void Pool::flush(ThreadCache* cache, size_t c, uint32_t count) {
+  Block* first = cache->free[c];
+  Block* last = first;
+  for (uint32_t i = 1; i < count; ++i) last = last->next;
+  cache->free[c] = last->next;
+  cache->count[c] -= count;
+  cache->counters[c].flushCount.add();
+
+  std::lock_guard<std::mutex> lock(shared[c].mutex);
+  last->next = shared[c].free;
+  shared[c].free = first;
+}
+
+// Fills an empty cache list with up to BatchSize blocks, taking them from the
+// shared list or a new slab
+void Pool::refill(ThreadCache* cache, size_t c) {
+  assert(cache->free[c] == 0);
+  cache->counters[c].refillCount.add();
+  SharedClass& sc = shared[c];
+  std::lock_guard<std::mutex> lock(sc.mutex);
+
+  if (sc.free == 0) {
+    // Carve a new slab into blocks and put them on the shared list
+    uint8_t* slab = (uint8_t*)allocateRaw(SlabSize);
+    size_t size = blockSize(c);
+    size_t n = SlabSize / size;
+    for (size_t i = n; i-- != 0; ) {
+      Block* b = (Block*)(slab + i * size);
+      b->next = sc.free;
+      sc.free = b;
+    }
+    sc.slabBytes += SlabSize;
+  }
+
+  Block* first = sc.free;
+  Block* last = first;
+  uint32_t count = 1;
+  while (count < BatchSize && last->next != 0) {
+    last = last->next;
+    ++count;
+  }
+  sc.free = last->next;
+  last->next = 0;
+  cache->free[c] = first;
+  cache->count[c] = count;
+}
+
+Pool::Stats Pool::stats(Stats* classes) {
+  Stats total;
+  memset(&total, 0, sizeof(Stats));
+  std::lock_guard<std::mutex> lock(registryMutex);
+  for (size_t c = 0; c <= ClassCount; ++c) {
+    Stats s;
+    s.allocCount = retired[c].allocCount.get();
+    s.deallocCount = retired[c].deallocCount.get();
+    s.refillCount = retired[c].refillCount.get();
+    s.flushCount = retired[c].flushCount.get();
+    for (ThreadCache* cache = registry; cache != 0; cache = cache->next) {
+      s.allocCount += cache->counters[c].allocCount.get();
+      s.deallocCount += cache->counters[c].deallocCount.get();
+      s.refillCount += cache->counters[c].refillCount.get();
+      s.flushCount += cache->counters[c].flushCount.get();
+    }
+    s.slabBytes = (c < ClassCount) ? (uint64_t)shared[c].slabBytes : 0;
+    if (classes) classes[c] = s;
+    total.allocCount += s.allocCount;
+    total.deallocCount += s.deallocCount;
+    total.refillCount += s.refillCount;
+    total.flushCount += s.flushCount;
+    total.slabBytes += s.slabBytes;
+  }
+  return total;
+}
+
+} // namespace hue
@@ -0,0 +1,143 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+//
+// A size-class pool allocator for small, short-lived objects like vector nodes.
+//
+// Sizes are rounded up to a multiple of Granularity and each such size class
+// has a free list of blocks which are carved out of larger slabs. Each thread
+// keeps a cache of free blocks per size class, so most allocations and frees
+// don't take any locks. Caches exchange blocks with the shared free lists in
+// batches. Slabs, and sizes larger than MaxSize, come from the allocator in
+// use (see Allocator.h).
+//
+// Memory held by the pool is never returned to the system, but blocks freed by
+// one thread can be reused by any other thread.
+//
+// Objects declared with HUE_POOLED_OBJECT (see object.h) are allocated from
+// the pool. While the calling thread has a Region, alloc and dealloc use the
+// region instead.
+//
+#ifndef _HUE_RUNTIME_POOL_INCLUDED
+#define _HUE_RUNTIME_POOL_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include <hue/runtime/Allocator.h>
+
+namespace hue {
+
+class Pool {
+public:
+  // Sizes are rounded up to a multiple of this
+  static const size_t Granularity = 16;
+  // Largest size served by the pool
+  static const size_t MaxSize = 1024;
+  // Number of size classes
+  static const size_t ClassCount = MaxSize / Granularity;
+  // Number of blocks moved between a thread cache and the shared free list at
+  // a time. A cache holds at most twice this many blocks per size class.
+  static const uint32_t BatchSize = 32;
+
+  // Returns at least *size* bytes, aligned to Granularity if size <= MaxSize
+  static inline void* alloc(size_t size);
+
+  // Returns memory to the pool. *size* must be the size passed to alloc.
+  static inline void dealloc(void* ptr, size_t size);
+
+  // Size class of an allocation of *size* bytes (size must be <= MaxSize)
+  static inline size_t sizeClass(size_t size) {
+    return (size == 0) ? 0 : (size - 1) / Granularity;
+  }
+
+  struct Stats {
+    uint64_t allocCount;   // number of calls to alloc
+    uint64_t deallocCount; // number of calls to dealloc
+    uint64_t refillCount;  // number of times a thread cache took blocks from the shared list
+    uint64_t flushCount;   // number of times a thread cache gave blocks to the shared list
+    uint64_t slabBytes;    // bytes allocated from the system for slabs (0 for MaxSize+)
+  };
+
+  // Returns counters for the whole pool. If *classes* is not null, it must point
+  // to ClassCount+1 Stats which are set to the counters of each size class,
+  // followed by the counters of allocations larger than MaxSize.
+  //
+  // The counters are kept per thread and added up by this call, which is
+  // cheap but might miss the most recent operations of other threads.
+  static Stats stats(Stats* classes = 0);
+
+  // Internal. The fast paths of alloc and dealloc are inline so that they are
+  // compiled along with the objects using them; everything else is in Pool.cc.
+  struct Block { Block* next; };
+
+  // A counter which is only written by one thread but can be read by any. It's
+  // a plain load and store rather than an atomic add, which is what makes
+  // keeping counters on the fast path cheap.
+  struct Counter {
+    std::atomic<uint64_t> value;
+    inline void add(uint64_t n = 1) {
+      value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    inline uint64_t get() const { return value.load(std::memory_order_relaxed); }
+  };
+
+  struct Counters {
+    Counter allocCount;
+    Counter deallocCount;
+    Counter refillCount;
+    Counter flushCount;
+  };
+
+  // Free blocks and counters of one thread. Index ClassCount of counters is
+  // used for allocations larger than MaxSize.
+  struct ThreadCache {
+    Block* free[ClassCount];
+    uint32_t count[ClassCount];
+    Counters counters[ClassCount + 1];
+    ThreadCache* prev;
+    ThreadCache* next;
+  };
+
+  static __thread ThreadCache* currentCache_;
+  static ThreadCache* newThreadCache();
+  static void* allocLarge(ThreadCache* cache, size_t size);
+  static void deallocLarge(ThreadCache* cache, void* ptr, size_t size);
+  static void refill(ThreadCache* cache, size_t c);
+  static void flush(ThreadCache* cache, size_t c, uint32_t count);
+
+  static inline ThreadCache* threadCache() {
+    ThreadCache* cache = currentCache_;
+    return (cache != 0) ? cache : newThreadCache();
+  }
+};
+
+
+void* Pool::alloc(size_t size) {
+  if (Region::current_ != 0) return Region::current_->alloc(size);
+  ThreadCache* cache = threadCache();
+  if (size > MaxSize) return allocLarge(cache, size);
+  size_t c = sizeClass(size);
+  cache->counters[c].allocCount.add();
+  if (cache->free[c] == 0) refill(cache, c);
+  Block* b = cache->free[c];
+  cache->free[c] = b->next;
+  --cache->count[c];
+  return b;
+}
+
+void Pool::dealloc(void* ptr, size_t size) {
+  if (Region::current_ != 0 && Region::owns(ptr)) return;
+  ThreadCache* cache = threadCache();
+  if (size > MaxSize) return deallocLarge(cache, ptr, size);
+  size_t c = sizeClass(size);
+  cache->counters[c].deallocCount.add();
+  Block* b = (Block*)ptr;
+  b->next = cache->free[c];
+  cache->free[c] = b;
+  if (++cache->count[c] > 2 * BatchSize) flush(cache, c, BatchSize);
+}
+
+} // namespace hue
+#endif // _HUE_RUNTIME_POOL_INCLUDED
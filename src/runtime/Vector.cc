@@ -2,6 +2,16 @@
 // code is governed by a MIT-style license that can be found in the LICENSE file.
 #include "Vector.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
 namespace hue {
 
 const Vector Vector::_Empty;
@@ -18,7 +28,7 @@ std::string Vector::Node::repr() const {
   std::ostringstream ss;
   ss << "<Node@" << this << " [";
   for (uint8_t i=0; i < length; ++i) {
-    if (objectBitset[i] == true) {
+    if (branch) {
       ss << getNode(i)->repr();
     } else {
       ss << ((size_t*)&data)[i];
@@ -29,4 +39,488 @@ std::string Vector::Node::repr() const {
   return ss.str();
 }
 
+
+// ------------------------------------------------------
+// Vector::memoryUsage
+
+struct Vector::UsageWalk {
+  MemoryUsage& usage;
+  bool cheap;
+  std::unordered_set<const Node*> otherNodes;
+
+  UsageWalk(MemoryUsage& usage, bool cheap) : usage(usage), cheap(cheap) {}
+
+  // Adds the nodes of a trie to otherNodes. Leaves are added without reading them.
+  void collect(uint32_t level, const Node* node) {
+    if (!otherNodes.insert(node).second) return; // already seen, and thus its subtree too
+    for (uint8_t i = 0; i < node->length; ++i) {
+      if (level == 5) {
+        otherNodes.insert(node->getNode(i));
+      } else {
+        collect(level - 5, node->getNode(i));
+      }
+    }
+  }
+
+  inline bool isShared(const Node* node) const {
+    return otherNodes.find(node) != otherNodes.end();
+  }
+
+  void add(size_t length, size_t bytes, bool shared) {
+    usage.bytes += bytes;
+    ++usage.fill[length];
+    if (shared) {
+      usage.sharedBytes += bytes;
+      ++usage.sharedCount;
+    }
+  }
+
+  // Adds a leaf of *length* items. *shared* is true if a parent is shared.
+  void addLeaf(const Node* leaf, size_t length, bool shared) {
+    ++usage.leafCount;
+    if (cheap) {
+      add(length, Node::allocSize((uint8_t)length, false), shared || isShared(leaf));
+    } else {
+      add(leaf->length, leaf->allocSize(), shared || isShared(leaf));
+    }
+  }
+
+  void addBranch(uint32_t level, const Node* node, bool shared) {
+    shared = shared || isShared(node);
+    ++usage.branchCount;
+    if (node->relaxed) ++usage.relaxedCount;
+    add(node->length, node->allocSize(), shared);
+    for (uint8_t i = 0; i < node->length; ++i) {
+      if (level > 5) {
+        addBranch(level - 5, node->getNode(i), shared);
+      } else if (node->relaxed) {
+        addLeaf(node->getNode(i), node->sizes()[i] - (i ? node->sizes()[i - 1] : 0), shared);
+      } else {
+        addLeaf(node->getNode(i), 32, shared);
+      }
+    }
+  }
+};
+
+Vector::MemoryUsage Vector::memoryUsage(const Vector* other, bool cheap) const {
+  MemoryUsage usage;
+  memset(&usage, 0, sizeof(MemoryUsage));
+  if (count_ == 0) return usage;
+
+  UsageWalk walk(usage, cheap);
+  if (other != 0 && other->count_ != 0) {
+    if (other->root_->length != 0) walk.collect(other->shift_, other->root_);
+    walk.otherNodes.insert(other->tail_);
+  }
+
+  usage.bytes += sizeof(Vector);
+  if (other == this) usage.sharedBytes += sizeof(Vector);
+
+  if (root_->length != 0) {
+    usage.depth = shift_ / 5 + 1;
+    walk.addBranch(shift_, root_, false);
+  } else {
+    usage.depth = 1;
+  }
+  // The tail is always read, since it's often not full
+  ++usage.leafCount;
+  walk.add(tailLength_, tail_->allocSize(), walk.isShared(tail_));
+  return usage;
+}
+
+// ------------------------------------------------------
+// Vector::equals and Vector::hash
+//
+// The hash of the items x1..xn is mix(x1)*B^(n-1) + ... + mix(xn) modulo 2^32,
+// so the hash of two runs of items joined is hash(a) * B^length(b) + hash(b).
+// A branch's hash is thus computed from the hashes of its children, and two
+// tries holding the same items have the same hash whatever their shape.
+
+struct Vector::Hashing {
+  static const uint32_t Base = 0x01000193;
+
+  enum Comparison { Equal, NotEqual, Unaligned };
+
+  static inline uint32_t mix(void* item) {
+    return (uint32_t)(((uint64_t)(uintptr_t)item * 0x9E3779B97F4A7C15ull) >> 32);
+  }
+
+  // Base^n
+  static uint32_t power(size_t n) {
+    uint32_t result = 1;
+    for (uint32_t b = Base; n != 0; n >>= 1, b *= b) {
+      if (n & 1) result *= b;
+    }
+    return result;
+  }
+
+  static uint32_t hashItems(void* const* items, size_t length) {
+    uint32_t h = 0;
+    for (size_t i = 0; i < length; ++i) h = h * Base + mix(items[i]);
+    return h;
+  }
+
+  // Returns the hash of the items below node, caching it in node. A cached
+  // hash is cleared whenever a node is modified in place.
+  static uint32_t hashNode(uint32_t level, Node* node) {
+    uint32_t h = node->cachedHash();
+    if (h != 0) return h;
+    if (level == 0) {
+      h = hashItems(node->data, node->length);
+    } else {
+      uint32_t fullPower = power((size_t)1 << level);
+      for (uint8_t i = 0; i < node->length; ++i) {
+        Node* child = node->getNode(i);
+        uint32_t p;
+        if (node->relaxed) {
+          p = power(node->sizes()[i] - (i ? node->sizes()[i - 1] : 0));
+        } else if (i + 1 < node->length) {
+          p = fullPower;
+        } else {
+          p = power(nodeCount(child, level - 5));
+        }
+        h = h * p + hashNode(level - 5, child);
+      }
+    }
+    // Nodes which aren't reference counted may be read-only (see Mapping)
+    if (node->refcount_ != Unretainable) node->setCachedHash(h);
+    return h;
+  }
+
+  // Compares the subtrees at a and b, which hold the same number of items at
+  // the same position of two vectors. Returns Unaligned if the subtrees are
+  // shaped differently.
+  static Comparison compareNodes(uint32_t level, const Node* a, const Node* b) {
+    if (a == b) return Equal;
+    if (a->length != b->length || a->relaxed != b->relaxed) return Unaligned;
+    if (a->relaxed && memcmp(a->sizes(), b->sizes(), sizeof(size_t) * a->length) != 0) {
+      return Unaligned;
+    }
+    uint32_t ahash = a->cachedHash(), bhash = b->cachedHash();
+    if (ahash != 0 && bhash != 0 && ahash != bhash) return NotEqual;
+    if (level == 0) {
+      return memcmp(a->data, b->data, sizeof(void*) * a->length) == 0 ? Equal : NotEqual;
+    }
+    for (uint8_t i = 0; i < a->length; ++i) {
+      Comparison c = compareNodes(level - 5, a->getNode(i), b->getNode(i));
+      if (c != Equal) return c;
+    }
+    return Equal;
+  }
+
+  // Compares the items of two vectors of the same length chunk by chunk
+  static bool equalItems(const Vector* a, const Vector* b) {
+    ChunkIterator ait(a), bit(b);
+    void* const* achunk = 0;
+    void* const* bchunk = 0;
+    size_t alength = 0, blength = 0;
+    for (size_t remaining = a->count_; remaining != 0; ) {
+      while (alength == 0) if (!ait.next(achunk, alength)) return false;
+      while (blength == 0) if (!bit.next(bchunk, blength)) return false;
+      size_t n = (alength < blength) ? alength : blength;
+      if (memcmp(achunk, bchunk, sizeof(void*) * n) != 0) return false;
+      achunk += n; alength -= n;
+      bchunk += n; blength -= n;
+      remaining -= n;
+    }
+    return true;
+  }
+};
+
+bool Vector::equals(const Vector* other) const {
+  if (other == this) return true;
+  if (other->count_ != count_) return false;
+  if (count_ == 0) return true;
+  if (other->shift_ == shift_ && other->tailLength_ == tailLength_) {
+    if (memcmp(tail_->data, other->tail_->data, sizeof(void*) * tailLength_) != 0) return false;
+    Hashing::Comparison c = Hashing::compareNodes(shift_, root_, other->root_);
+    if (c != Hashing::Unaligned) return c == Hashing::Equal;
+  }
+  return Hashing::equalItems(this, other);
+}
+
+size_t Vector::hash() const {
+  uint32_t h = 0;
+  if (root_->length != 0) h = Hashing::hashNode(shift_, root_);
+  if (tailLength_ != 0) {
+    h = h * Hashing::power(tailLength_) + Hashing::hashItems(tail_->data, tailLength_);
+  }
+  return (size_t)h ^ ((size_t)count_ * 0x9E3779B97F4A7C15ull);
+}
+
+// ------------------------------------------------------
+// Vector::writeFile and Vector::Mapping
+//
+// A file starts with a FileHeader, followed by the leaves (the tail last),
+// then the branches with each branch after its children, and last an image of
+// the Vector. Nodes and the vector are stored as they are laid out in memory,
+// with a refcount of Unretainable. Pointers to nodes are stored as offsets
+// from the start of the file, 0 meaning no node (or Node::Empty for the root).
+
+namespace {
+
+struct FileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;       // FileByteOrder as written by the writer
+  uint32_t pointerSize;     // sizeof(void*)
+  uint32_t nodeHeaderSize;  // size of a node without its items
+  uint64_t size;            // size of the file
+  uint64_t branchesOffset;  // offset of the first branch
+  uint64_t vectorOffset;    // offset of the vector
+};
+
+static const char FileMagic[8] = { 'h', 'u', 'e', 'v', 'e', 'c', '\0', '\0' };
+static const uint32_t FileVersion = 1;
+static const uint32_t FileByteOrder = 0x01020304;
+
+// Deepest level of a node in a file. A node at level 55 holds up to 2^60
+// items, so counts of items can't overflow.
+static const uint32_t MaxFileLevel = 55;
+
+// The fields of a node before its items, as they're laid out in memory
+struct FileNodeHeader {
+  uint64_t refcount;
+  uint8_t length;
+  uint8_t capacity;
+  uint8_t relaxed;
+  uint8_t branch;
+  uint32_t hash;
+};
+
+// A node which Mapping::open has checked
+struct FileNode {
+  uint64_t offset;
+  uint32_t level;
+  uint64_t count; // number of items below the node
+};
+
+// Returns the node at *offset*, or 0 if no node starts there. nodes is sorted
+// by offset.
+static const FileNode* findFileNode(const std::vector<FileNode>& nodes, uint64_t offset) {
+  size_t low = 0, high = nodes.size();
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (nodes[mid].offset < offset) low = mid + 1; else high = mid;
+  }
+  return (low < nodes.size() && nodes[low].offset == offset) ? &nodes[low] : 0;
+}
+
+} // namespace
+
+struct Vector::FileWriter {
+  FILE* file;
+  uint64_t offset;
+  bool ok;
+  std::unordered_map<const Node*, uint64_t> offsets;
+
+  FileWriter(FILE* file) : file(file), offset(0), ok(true) {}
+
+  void write(const void* p, size_t size) {
+    if (ok && fwrite(p, 1, size, file) != size) ok = false;
+    offset += size;
+  }
+
+  // Writes an image of the first *length* items of node: its header, its
+  // items (or the offsets of its children) and its size table, if it has one.
+  // Returns its offset, which is also recorded in offsets if *record* is true.
+  uint64_t writeNode(const Node* node, uint8_t length, bool record = true) {
+    uint64_t nodeOffset = offset;
+    FileNodeHeader header = { Unretainable, length, length, node->relaxed, node->branch, 0 };
+    write(&header, sizeof(header));
+    if (node->branch) {
+      void* children[32];
+      for (uint8_t i = 0; i < length; ++i) children[i] = (void*)offsets[node->getNode(i)];
+      write(children, sizeof(void*) * length);
+    } else {
+      write(node->data, sizeof(void*) * length);
+    }
+    if (node->relaxed) write(node->sizes(), sizeof(size_t) * length);
+    if (record) offsets[node] = nodeOffset;
+    return nodeOffset;
+  }
+
+  void writeLeaves(uint32_t level, const Node* node) {
+    if (offsets.find(node) != offsets.end()) return;
+    if (level == 0) {
+      writeNode(node, node->length);
+    } else for (uint8_t i = 0; i < node->length; ++i) {
+      writeLeaves(level - 5, node->getNode(i));
+    }
+  }
+
+  void writeBranches(uint32_t level, const Node* node) {
+    if (offsets.find(node) != offsets.end()) return;
+    if (level > 5) for (uint8_t i = 0; i < node->length; ++i) {
+      writeBranches(level - 5, node->getNode(i));
+    }
+    writeNode(node, node->length);
+  }
+};
+
+bool Vector::writeFile(const char* path) const {
+  FILE* file = fopen(path, "wb");
+  if (file == 0) return false;
+  FileWriter writer(file);
+
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  writer.write(&header, sizeof(header));
+
+  bool hasTrie = root_->length != 0;
+  if (hasTrie) writer.writeLeaves(shift_, root_);
+  // The tail might hold items of other vectors past our own, and the same node
+  // might also be a leaf of the trie holding all of them
+  uint64_t tailOffset = (tail_ == 0) ? 0 : writer.writeNode(tail_, tailLength_, false);
+  header.branchesOffset = writer.offset;
+  if (hasTrie) writer.writeBranches(shift_, root_);
+
+  uint64_t buf[(sizeof(Vector) + sizeof(uint64_t) - 1) / sizeof(uint64_t)];
+  memset(buf, 0, sizeof(buf));
+  Vector* image = (Vector*)buf;
+  image->refcount_ = Unretainable;
+  image->count_ = count_;
+  image->shift_ = shift_;
+  image->tailLength_ = tailLength_;
+  image->root_ = (Node*)(hasTrie ? writer.offsets[root_] : 0);
+  image->tail_ = (Node*)tailOffset;
+  header.vectorOffset = writer.offset;
+  writer.write(buf, sizeof(buf));
+
+  memcpy(header.magic, FileMagic, sizeof(FileMagic));
+  header.version = FileVersion;
+  header.byteOrder = FileByteOrder;
+  header.pointerSize = sizeof(void*);
+  static_assert(sizeof(FileNodeHeader) == sizeof(Node), "node header layout");
+  header.nodeHeaderSize = sizeof(Node);
+  header.size = writer.offset;
+  if (writer.ok && fseek(file, 0, SEEK_SET) != 0) writer.ok = false;
+  writer.write(&header, sizeof(header));
+
+  int error = writer.ok ? 0 : (errno ? errno : EIO);
+  if (fclose(file) != 0 && error == 0) error = errno;
+  errno = error;
+  return error == 0;
+}
+
+Vector::Mapping* Vector::Mapping::open(const char* path) {
+  int fd = ::open(path, O_RDONLY);
+  if (fd == -1) return 0;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return 0;
+  }
+  size_t size = (size_t)st.st_size;
+  if (size < sizeof(FileHeader) + sizeof(Vector)) {
+    close(fd);
+    errno = EINVAL;
+    return 0;
+  }
+  // Private, so that the branches can be relocated without changing the file
+  uint8_t* base = (uint8_t*)mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  int error = errno;
+  close(fd);
+  if (base == MAP_FAILED) {
+    errno = error;
+    return 0;
+  }
+
+  const FileHeader* header = (const FileHeader*)base;
+  bool valid = memcmp(header->magic, FileMagic, sizeof(FileMagic)) == 0
+            && header->version == FileVersion
+            && header->byteOrder == FileByteOrder
+            && header->pointerSize == sizeof(void*)
+            && header->nodeHeaderSize == sizeof(Node)
+            && header->size == size
+            && header->branchesOffset >= sizeof(FileHeader)
+            && header->branchesOffset <= header->vectorOffset
+            && header->vectorOffset + sizeof(Vector) <= size;
+
+  // Check the nodes, and turn the child offsets of the branches into pointers.
+  // Each node is recorded along with its level and number of items, so that a
+  // child, which is always written before its parent, can be checked to be a
+  // node of the level below.
+  std::vector<FileNode> nodes;
+  uint64_t offset = sizeof(FileHeader);
+  while (valid && offset < header->vectorOffset) {
+    bool isBranch = offset >= header->branchesOffset;
+    uint64_t end = isBranch ? header->vectorOffset : header->branchesOffset;
+    Node* node = (Node*)(base + offset);
+    if (offset + sizeof(Node) > end || node->refcount_ != Unretainable ||
+        node->branch != isBranch || node->length > 32 || node->capacity != node->length ||
+        (node->relaxed && !isBranch) || node->cachedHash() != 0 ||
+        offset + node->allocSize() > end) {
+      valid = false;
+      break;
+    }
+    FileNode info = { offset, 0, node->length };
+    if (isBranch) {
+      valid = node->length != 0;
+      info.count = 0;
+      for (uint8_t i = 0; valid && i < node->length; ++i) {
+        const FileNode* child = findFileNode(nodes, (uint64_t)node->data[i]);
+        if (child == 0 || child->count == 0) {
+          valid = false;
+          break;
+        }
+        if (i == 0) info.level = child->level + 5;
+        // Only the last child of a regular node may have room left
+        uint64_t full = (uint64_t)1 << info.level;
+        valid = child->level + 5 == info.level && info.level <= MaxFileLevel &&
+                child->count <= full &&
+                (node->relaxed || i + 1 == node->length || child->count == full);
+        info.count += child->count;
+        if (node->relaxed && node->sizes()[i] != info.count) valid = false;
+        node->data[i] = base + child->offset;
+      }
+    }
+    nodes.push_back(info);
+    offset += node->allocSize();
+  }
+
+  // Check the vector against its root and tail, and turn their offsets into
+  // pointers
+  Vector* v = (Vector*)(base + header->vectorOffset);
+  if (valid) {
+    const FileNode* root = (v->root_ == 0) ? 0 : findFileNode(nodes, (uint64_t)v->root_);
+    const FileNode* tail = (v->tail_ == 0) ? 0 : findFileNode(nodes, (uint64_t)v->tail_);
+    valid = v->refcount_ == Unretainable
+         && v->shift_ >= 5 && v->shift_ <= MaxFileLevel && v->shift_ % 5 == 0
+         && (v->root_ == 0 || (root != 0 && root->level == v->shift_))
+         && v->count_ == (root ? root->count : 0) + v->tailLength_
+         && (v->tail_ == 0 || (tail != 0 && tail->level == 0))
+         && (tail ? v->tailLength_ <= ((Node*)(base + tail->offset))->length : v->tailLength_ == 0)
+         && ((v->tail_ == 0) == (v->count_ == 0));
+    if (valid) {
+      v->root_ = root ? (Node*)(base + root->offset) : Node::Empty;
+      v->tail_ = tail ? (Node*)(base + tail->offset) : 0;
+    }
+  }
+
+  if (!valid) {
+    munmap(base, size);
+    errno = EINVAL;
+    return 0;
+  }
+  if (mprotect(base, size, PROT_READ) != 0) {
+    error = errno;
+    munmap(base, size);
+    errno = error;
+    return 0;
+  }
+
+  Mapping* m = __alloc();
+  m->base_ = base;
+  m->size_ = size;
+  m->vector_ = v;
+  return m;
+}
+
+void Vector::Mapping::dealloc() {
+  munmap(base_, size_);
+}
+
 } // namespace hue
@@ -10,6 +10,13 @@
 // it's O(log32(n)) -- "almost-constant" meaning accessing index 1 000 000
 // would only be about 3.986 complex. Very close to 1, thus "almost-constant".
 //
+// Branch nodes can also be "relaxed" (as in Relaxed Radix Balanced trees by Phil
+// Bagwell and Tiark Rompf) which allows vectors to be concatenated and sliced in
+// O(log32(n)) time. A relaxed node has a size table which maps an index to its
+// child, since its children may be less than full. Vectors which have never
+// been concatenated or sliced from the front have no relaxed nodes and are
+// accessed using plain radix arithmetic.
+//
 #ifndef _HUE_RUNTIME_VECTOR_INCLUDED
 #define _HUE_RUNTIME_VECTOR_INCLUDED
 
@@ -25,7 +32,6 @@
 #include <iostream>
 #include <sstream>
 #include <stdexcept>
-#include <bitset>
 
 #ifdef DEBUG_Node_refcount
 static size_t live_node_count = 0;
@@ -50,21 +56,27 @@ static size_t live_vector_count = 0;
 namespace hue {
 
 
-class Vector { HUE_OBJECT(Vector)
+class Vector { HUE_POOLED_OBJECT(Vector)
 
+  // Maximum depth of the trie (5*13 bits > 64 bits)
+  static const int MaxDepth = 13;
   
-  
-  // Rudimentary fixed-size copyable array
-  class Node { HUE_OBJECT(Node)
+  // Rudimentary fixed-size copyable array. A node is either a leaf, holding
+  // values, or a branch, holding references to other nodes. Leaves are never
+  // retained or released item by item, so copying and freeing them is a plain
+  // memcpy and free. The slots of a branch past its length are zero.
+  class Node { HUE_POOLED_OBJECT(Node)
   public:
     static const Node _Empty;
     static Node* Empty;
     typedef void* V;
   
     uint8_t length; // <= 32 = 100000 (only 6-bits are used)
-    uint8_t unused;
-    std::bitset<32> objectBitset; // each bit is a flag which if set means that index is an object
-    // Note: Object superclass is 32-bit wide, meaning we align on 64-bit boundaries.
+    uint8_t capacity; // number of slots allocated for data (>= length)
+    bool relaxed; // true if the node has a size table, following data
+    bool branch; // true if the items are nodes
+    uint32_t hash; // cached hash of the items below the node, or 0 if not known (see Vector::hash)
+    // Note: Object superclass is 64-bit wide, so the node header is 16 bytes.
   
     // Note: We could use bit-fields of 6 and 58 bits here, so we align
     // at 64-bit boundaries. But since refcount is operated on as a native
@@ -73,114 +85,164 @@ class Vector { HUE_OBJECT(Vector)
     //uint8_t length : 6; // <= 32 = 100000
     //uint64_t refcount_ : 58;
   
-    // An empty node is 8 bytes. A node with two elements is 24 bytes, and so on.
+    // An empty node is 16 bytes. A node with two elements is 32 bytes, and so on.
   
     // Must be the last member
     V data[0];
   
     // Node constructors
-    
-    //static Node* create(uint8_t length);
-    //static Node* create(const V value);
-    //static Node* create(const Node& other, V tailValue);
-    //static Node* create(const Node& other, uint8_t length);
-  
-    static Node* create(uint8_t length) {
-      Node* node = alloc(length);
+
+    static Node* createLeaf(uint8_t length) {
+      Node* node = alloc(length, false);
       node->length = length;
-      node->objectBitset = 0;
       return node;
     }
 
-    static Node* create(const V value) {
-      Node* node = alloc(1);
-      ((V*)&node->data)[0] = value;
-      node->length = 1;
-      node->objectBitset = 0;
+    static Node* createBranch(uint8_t length, bool relaxed = false) {
+      Node* node = alloc(length, true, relaxed);
+      node->length = length;
       return node;
     }
 
-    static Node* create(const Node& other, V tailValue) {
-      Node* node = alloc(other.length+1);
+    static Node* create(const Node& other, uint8_t length) {
+      assert(length >= other.length);
+      Node* node = alloc(length, other.branch, other.relaxed);
       __copy(node, &other);
+      node->retainChildren();
+      node->length = length;
+      return node;
+    }
 
-      // Increase refcount of any shallow-copied objects
-      if (node->objectBitset.any()) for (size_t i = 0; i < node->objectBitset.size(); ++i) {
-        if (node->objectBitset[i]) node->getNode(i)->retain();
-      }
-
-      ((V*)&node->data)[other.length] = tailValue;
-      ++node->length;
+    // Creates a copy of the first *length* items of *other*
+    static Node* createPrefix(const Node& other, uint8_t length) {
+      assert(length <= other.length);
+      Node* node = alloc(length, other.branch, other.relaxed);
+      memcpy(node->data, other.data, sizeof(V) * length);
+      if (node->relaxed) memcpy(node->sizes(), other.sizes(), sizeof(size_t) * length);
+      node->length = length;
+      node->retainChildren();
       return node;
     }
 
-    static Node* create(const Node& other, uint8_t length) {
-      assert(length >= other.length);
-      Node* node = alloc(length);
-      __copy(node, &other);
+    // Creates a leaf holding the items in the range [start, end) of the leaf *other*
+    static Node* createSlice(const Node& other, uint8_t start, uint8_t end) {
+      assert(start <= end && end <= other.length && !other.branch);
+      Node* node = createLeaf(end - start);
+      memcpy(node->data, other.data + start, sizeof(V) * (end - start));
+      return node;
+    }
 
-      // Increase refcount of any shallow-copied objects
-      if (node->objectBitset.any()) for (size_t i = 0; i < node->objectBitset.size(); ++i) {
-        if (node->objectBitset[i]) node->getNode(i)->retain();
-      }
+    // Creates an empty node with room for *capacity* items. Used by transients
+    // which fill nodes in place.
+    static Node* createWithCapacity(uint8_t capacity, bool branch) {
+      Node* node = alloc(capacity, branch);
+      node->length = 0;
+      return node;
+    }
 
-      node->length = length;
+    // Creates a copy of *other* with room for *capacity* items
+    static Node* createWithCapacity(const Node& other, uint8_t capacity) {
+      assert(capacity >= other.length);
+      Node* node = alloc(capacity, other.branch, other.relaxed);
+      __copy(node, &other);
+      node->retainChildren();
       return node;
     }
   
     inline void setValue(uint8_t i, V value) {
-      assert(objectBitset[i] == false); // Or we need a retain-release dance
+      assert(!branch);
+      setCachedHash(0);
       ((V*)&data)[i] = value;
     }
   
     inline void setNode(uint8_t i, Node* node, RefRule refrule = RetainReference) {
-      Node* oldNode = objectBitset[i] ? getNode(i) : 0;
+      assert(branch);
+      Node* oldNode = ((Node**)&data)[i];
+      setCachedHash(0);
       if (refrule == RetainReference) node->retain();
       ((Node**)&data)[i] = node;
-      objectBitset[i] = true;
       if (oldNode) oldNode->release();
     }
   
     inline V getValue(uint8_t i) const {
-      assert(objectBitset[i] == false);
+      assert(!branch);
       return ((V*)&data)[i];
     }
   
     inline Node* getNode(uint8_t i) const {
-      assert(objectBitset[i] == true);
+      assert(branch);
       return ((Node**)&data)[i];
     }
+
+    // The cached hash. Threads which share a node may cache its hash at the
+    // same time, so it's loaded and stored atomically.
+    inline uint32_t cachedHash() const { return __atomic_load_n(&hash, __ATOMIC_RELAXED); }
+    inline void setCachedHash(uint32_t h) { __atomic_store_n(&hash, h, __ATOMIC_RELAXED); }
+
+    // Size table of a relaxed node. Entry i is the number of items in the
+    // subtrees of the children 0-i.
+    inline size_t* sizes() { return (size_t*)&data[capacity]; }
+    inline const size_t* sizes() const { return (const size_t*)&data[capacity]; }
+
+    // Finds the child of a relaxed node which holds the i:th item of the node's
+    // subtree, and makes i relative to that child.
+    inline uint8_t relaxedIndexFor(size_t& i, uint32_t level) const {
+      assert(relaxed);
+      // A child holds at most 1 << level items, so the child can't be to the
+      // left of the one a regular node would have used.
+      uint8_t subidx = i >> level;
+      while (sizes()[subidx] <= i) ++subidx;
+      if (subidx) i -= sizes()[subidx - 1];
+      return subidx;
+    }
   
     std::string repr() const;
 
+    // Number of bytes allocated for a node
+    static inline size_t allocSize(uint8_t capacity, bool relaxed) {
+      return sizeof(Node) + ((sizeof(V) + (relaxed ? sizeof(size_t) : 0)) * capacity);
+    }
+    inline size_t allocSize() const { return allocSize(capacity, relaxed); }
+
   private:
-    Node() : refcount_(Unretainable), length(0), objectBitset(0) {}
-  
-    inline static Node* alloc(uint8_t length) {
+    Node() : refcount_(Unretainable), length(0), capacity(0), relaxed(false), branch(true), hash(0) {}
+
+    inline static Node* alloc(uint8_t capacity, bool branch, bool relaxed = false) {
       DEBUG_LIVECOUNT_Node_INC
-      return __alloc(sizeof(Node) + (sizeof(V) * length));
+      Node* node = __alloc(allocSize(capacity, relaxed));
+      node->capacity = capacity;
+      node->relaxed = relaxed;
+      node->branch = branch;
+      node->setCachedHash(0);
+      if (branch) memset(node->data, 0, sizeof(V) * capacity);
+      return node;
     }
 
     static Node* __copy(Node* dest, Node const* source) {
-      // This function performs a memcpy but leaves the reference count unchanged.
-      // Requirement: refcount_ (usually from HUE_OBJECT) must be the first member of the
-      // struct/class.
-      //
-      // TODO: If we can figure out how to communicate a class's intended size, we could
-      // bundle this function into HUE_OBJECT.
-      //
-      return (Node*)memcpy(
-        ((uint8_t*)dest) + sizeof(Ref), // start after refcount_ member
-        ((uint8_t*)source) + sizeof(Ref),      // start after refcount_ member
-        (sizeof(Node)-sizeof(Ref)) + (sizeof(void*) * source->length) // size - refcount_ member
-      );
+      // Copies the items of source, leaving the reference count, capacity
+      // and kind of dest unchanged. The hash isn't copied, both because the
+      // copy is made to be modified and because other threads may be caching
+      // the hash of source.
+      assert(dest->relaxed == source->relaxed && dest->branch == source->branch);
+      dest->length = source->length;
+      dest->setCachedHash(0);
+      memcpy(dest->data, source->data, sizeof(void*) * source->length);
+      if (dest->relaxed) {
+        memcpy(dest->sizes(), source->sizes(), sizeof(size_t) * source->length);
+      }
+      return dest;
+    }
+
+    // Increase refcount of any shallow-copied children
+    inline void retainChildren() {
+      if (branch) for (uint8_t i = 0; i < length; ++i) getNode(i)->retain();
     }
 
     void dealloc() {
       DEBUG_LIVECOUNT_Node_DEC
       // Release any refs we own
-      if (objectBitset.any()) for (size_t i = 0; i < objectBitset.size(); ++i) {
-        if (objectBitset[i]) getNode(i)->release();
+      if (branch) for (uint8_t i = 0; i < length; ++i) {
+        if (getNode(i)) getNode(i)->release();
       }
     }
   };
@@ -193,57 +255,697 @@ public:
   // Number of items contained by the receiver
 const size_t count() const { return count_; }
   
-  // Returns a vector with val added to the end
+  // Returns a vector with val added to the end.
+  //
+  // When the receiver is only referenced by the caller and is the only vector
+  // using its tail, val is written into a free slot of the tail in place and
+  // the returned vector shares that tail. The receiver still sees only its own
+  // items, since each vector records how much of its tail it uses. This makes
+  // the common "v2 = v->append(x); v->release();" loop as cheap as filling an
+  // array, while keeping the receiver intact.
   Vector* append(void* val) const {
     // Note: Return value could be "Vector const*", but that would cause trouble for retain/release.
-  
-    //room in tail?
-    if (tailLength() < 32) {
-      Node* newTail = (tail_ == 0) ? Node::create(val) : Node::create(*tail_, val);
-      return Vector::create(count_ + 1, shift_, root_,RetainReference, newTail,TransferReference);
-    }
-  
-    // Full tail -- push into tree
     Node* newroot;
-    uint32_t newshift = shift_;
-  
-    // Overflow root?
-    if ((count_ >> 5) > (1 << shift_)) {
-      newroot = Node::create(2);
-      newroot->setNode(0, root_);
-      newroot->setNode(1, newPath(shift_, tail_), TransferReference);
-      newshift += 5;
-    } else {
-      newroot = pushTail(shift_, root_, tail_);
-    }
-  
-    Node* newTail = Node::create(val);
+    uint32_t newshift;
+    Node* newTail;
+    appended(val, newroot, newshift, newTail);
     return Vector::create(count_ + 1, newshift, newroot,TransferReference, newTail,TransferReference);
   }
+
+  // Like append, but takes over the caller's reference to the receiver. If that
+  // is the only reference, the receiver itself is modified and returned. It
+  // then grows where it was allocated, even inside a Region.
+  //
+  //   v = v->appendAndRelease(x);
+  //
+  Vector* appendAndRelease(void* val) {
+    if (!isUnique()) {
+      Vector* v = append(val);
+      release();
+      return v;
+    }
+    Region::Alongside alongside(this);
+    if (tailLength_ == 32) {
+      // Nothing else can reach the trie through the receiver, so the parts of
+      // it which aren't shared are modified in place
+      pushTailInPlace(count_, shift_, root_, tail_);
+      tail_ = Node::createWithCapacity(32, false);
+      tailLength_ = 0;
+    } else if (tail_ == 0 || !isOwned(tail_)) {
+      Node* tail = Node::createWithCapacity(32, false);
+      if (tailLength_) memcpy(tail->data, tail_->data, sizeof(void*) * tailLength_);
+      if (tail_) tail_->release();
+      tail_ = tail;
+    }
+    tail_->setValue(tailLength_, val);
+    tail_->length = ++tailLength_;
+    ++count_;
+    return this;
+  }
   
   // Retrieve item at index i
   inline void* itemAt(size_t i) const throw(std::out_of_range) {
-    return nodeFor(i).getValue(i & 0x1f);
+    uint8_t index;
+    return nodeFor(i, index).getValue(index);
+  }
+
+  // Sets *items* to the run of items starting at index i which are stored
+  // next to each other, and returns the number of items in that run. The run
+  // ends at the end of the leaf holding i.
+  //
+  //   for (size_t i = 0; i < v->count(); i += n) {
+  //     void* const* items;
+  //     n = v->chunkAt(i, items);
+  //     ...
+  //   }
+  //
+  size_t chunkAt(size_t i, void* const*& items) const throw(std::out_of_range) {
+    uint8_t index;
+    const Node& node = nodeFor(i, index);
+    items = node.data + index;
+    return ((&node == tail_) ? tailLength_ : node.length) - index;
+  }
+
+  // Number of lookups itemsAt runs side by side
+  static const size_t GatherGroupSize = 32;
+
+  // Retrieves the items at the *n* indices *indices* into *out*. Equivalent to
+  // calling itemAt for each index, but much faster for random indices into a
+  // vector which doesn't fit in the CPU caches.
+  //
+  // Each itemAt walks from the root to a leaf, and every step has to wait for
+  // the node it reads to arrive from memory. itemsAt walks GatherGroupSize
+  // lookups down the trie one level at a time and prefetches the slot of each
+  // node it's going to read at the next level, so the cache misses of a whole
+  // group are waited for at once instead of one after the other.
+  //
+  // Throws std::out_of_range if an index is out of range, in which case some
+  // of the items may have been written to out.
+  void itemsAt(const size_t* indices, size_t n, void** out) const throw(std::out_of_range) {
+    const Node* nodes[GatherGroupSize];
+    size_t offsets[GatherGroupSize]; // index relative to nodes[g]
+    bool relaxed[GatherGroupSize]; // true while nodes[g] may be relaxed
+    size_t tailoff = this->tailoff();
+
+    for (size_t start = 0; start < n; start += GatherGroupSize) {
+      size_t count = (n - start < GatherGroupSize) ? n - start : GatherGroupSize;
+      void** groupOut = out + start;
+
+      for (size_t g = 0; g < count; ++g) {
+        size_t i = indices[start + g];
+        if (i >= count_)
+          throw std::out_of_range("index out of range");
+        if (i >= tailoff) {
+          groupOut[g] = tail_->getValue(i - tailoff);
+          nodes[g] = 0;
+        } else {
+          nodes[g] = root_;
+          offsets[g] = i;
+          relaxed[g] = root_->relaxed;
+        }
+      }
+
+      for (uint32_t level = shift_; level > 0; level -= 5) {
+        for (size_t g = 0; g < count; ++g) {
+          const Node* node = nodes[g];
+          if (node == 0) continue;
+          uint8_t subidx;
+          if (relaxed[g] && node->relaxed) {
+            subidx = node->relaxedIndexFor(offsets[g], level);
+          } else {
+            // Everything below a regular node is regular, so the header of
+            // the nodes below need not be read
+            relaxed[g] = false;
+            subidx = (offsets[g] >> level) & 0x1f;
+          }
+          const Node* child = node->getNode(subidx);
+          nodes[g] = child;
+          if (relaxed[g]) __builtin_prefetch(child);
+          __builtin_prefetch(&child->data[(offsets[g] >> (level - 5)) & 0x1f]);
+        }
+      }
+
+      for (size_t g = 0; g < count; ++g) {
+        if (nodes[g] != 0) groupOut[g] = nodes[g]->getValue(offsets[g] & 0x1f);
+      }
+    }
+  }
+
+  // Returns a vector with the item at index i replaced by val. Only the path from
+  // the root to the leaf holding i is copied.
+  Vector* assoc(size_t i, void* val) const throw(std::out_of_range) {
+    if (i >= count_)
+      throw std::out_of_range("index out of range");
+
+    // i is in tail?
+    if (i >= tailoff()) {
+      Node* newTail = Node::createPrefix(*tail_, tailLength_);
+      newTail->setValue(i - tailoff(), val);
+      return Vector::create(count_, shift_, root_,RetainReference, newTail,TransferReference);
+    }
+
+    Node* newroot = doAssoc(shift_, root_, i, val);
+    return Vector::create(count_, shift_, newroot,TransferReference, tail_,RetainReference, tailLength_);
+  }
+
+  // Returns a vector with the last item removed
+  Vector* pop() const throw(std::out_of_range) {
+    if (count_ == 0)
+      throw std::out_of_range("can't pop an empty vector");
+    if (count_ == 1)
+      return Vector::Empty;
+
+    // More than one item in tail?
+    if (tailLength_ > 1) {
+      Node* newTail = Node::createPrefix(*tail_, tailLength_ - 1);
+      return Vector::create(count_ - 1, shift_, root_,RetainReference, newTail,TransferReference);
+    }
+
+    // The last leaf of the trie becomes the new tail
+    Node* newTail = root_;
+    for (uint32_t level = shift_; level > 0; level -= 5) {
+      newTail = newTail->getNode(newTail->length - 1);
+    }
+    newTail->retain();
+    Node* newroot = popTail(shift_, root_, newTail->length);
+    uint32_t newshift = shift_;
+
+    if (newroot == 0) {
+      newroot = Node::Empty;
+    } else if (shift_ > 5 && newroot->length == 1) {
+      // Collapse the root
+      Node* child = newroot->getNode(0)->retain();
+      newroot->release();
+      newroot = child;
+      newshift -= 5;
+    }
+
+    return Vector::create(count_ - 1, newshift, newroot,TransferReference, newTail,TransferReference);
+  }
+
+  // Returns a vector with the items of the receiver followed by the items of
+  // *other*. The two tries are merged along their right and left edges, which
+  // takes O(log32(n)) time and produces relaxed nodes where needed.
+  Vector* concat(const Vector* other) const {
+    if (other->count_ == 0) return const_cast<Vector*>(this)->retain();
+    if (count_ == 0) return const_cast<Vector*>(other)->retain();
+
+    // other fits in our tail?
+    if (other->root_->length == 0 && tailLength_ + other->count_ <= 32) {
+      Node* newTail = Node::createLeaf((uint8_t)(tailLength_ + other->count_));
+      memcpy(newTail->data, tail_->data, sizeof(void*) * tailLength_);
+      memcpy(newTail->data + tailLength_, other->tail_->data, sizeof(void*) * other->count_);
+      return Vector::create(count_ + other->count_, shift_, root_,RetainReference, newTail,TransferReference);
+    }
+
+    // Our tail becomes the last leaf of our trie
+    Node* tail = ownTail();
+    Node* tailTrie = createBranch(5, &tail, 1);
+    uint32_t leftShift;
+    Node* left = concatTries(root_, shift_, tailTrie, 5, leftShift);
+    tailTrie->release();
+
+    // other's tail becomes our tail
+    uint32_t newshift;
+    Node* newroot = concatTries(left, leftShift, other->root_, other->shift_, newshift);
+    left->release();
+
+    return Vector::create(count_ + other->count_, newshift, newroot,TransferReference,
+                          other->tail_,RetainReference, other->tailLength_);
+  }
+
+  // Returns a vector with the first n items of the receiver
+  Vector* take(size_t n) const {
+    if (n >= count_) return const_cast<Vector*>(this)->retain();
+    if (n == 0) return Vector::Empty;
+
+    size_t tailoff = this->tailoff();
+    if (n > tailoff) {
+      Node* newTail = Node::createPrefix(*tail_, (uint8_t)(n - tailoff));
+      return Vector::create(n, shift_, root_,RetainReference, newTail,TransferReference);
+    }
+
+    // The leaf holding the last item becomes the tail
+    uint8_t index;
+    const Node& leaf = nodeFor(n - 1, index);
+    Node* newTail = Node::createPrefix(leaf, index + 1);
+    size_t leafStart = n - newTail->length;
+    if (leafStart == 0) {
+      return Vector::create(n, 5, Node::Empty,TransferReference, newTail,TransferReference);
+    }
+
+    uint32_t newshift = shift_;
+    Node* newroot = collapse(sliceRight(shift_, root_, leafStart), newshift);
+    return Vector::create(n, newshift, newroot,TransferReference, newTail,TransferReference);
+  }
+
+  // Returns a vector without the first n items of the receiver
+  Vector* drop(size_t n) const {
+    if (n == 0) return const_cast<Vector*>(this)->retain();
+    if (n >= count_) return Vector::Empty;
+
+    size_t tailoff = this->tailoff();
+    if (n >= tailoff) {
+      Node* newTail = Node::createSlice(*tail_, (uint8_t)(n - tailoff), tailLength_);
+      return Vector::create(count_ - n, 5, Node::Empty,TransferReference, newTail,TransferReference);
+    }
+
+    uint32_t newshift = shift_;
+    Node* newroot = collapse(sliceLeft(shift_, root_, n), newshift);
+    return Vector::create(count_ - n, newshift, newroot,TransferReference, tail_,RetainReference, tailLength_);
+  }
+
+  // Returns a vector with the items in the range [from, to) of the receiver
+  Vector* slice(size_t from, size_t to) const throw(std::out_of_range) {
+    if (from > to || to > count_)
+      throw std::out_of_range("slice out of range");
+    Vector* head = take(to);
+    Vector* v = head->drop(from);
+    head->release();
+    return v;
+  }
+
+  // A transient is a mutable builder for a vector. It starts out sharing all
+  // nodes with the vector it was created from and copies a node the first time
+  // it needs to modify it. From then on that node is owned exclusively by the
+  // transient and is modified in place. A node is considered owned when it has
+  // room for 32 items and is only referenced from a path of owned nodes (i.e.
+  // its refcount is 1 and so is the refcount of all its parents).
+  //
+  // Call persistent() to get an immutable vector of the current contents. The
+  // transient can be used after that, in which case it will copy any nodes it
+  // now shares with the returned vector before modifying them.
+  //
+  // A transient must not be used by more than one thread at a time.
+  class Transient { HUE_OBJECT(Transient)
+  public:
+    static Transient* create(const Vector* v) {
+      Transient* t = __alloc();
+      t->count_ = v->count_;
+      t->shift_ = v->shift_;
+      t->root_ = v->root_->retain();
+      t->tail_ = v->tail_ ? v->ownTail() : 0;
+      return t;
+    }
+
+    // Number of items contained by the receiver
+    const size_t count() const { return count_; }
+
+    // Adds val to the end of the receiver. Returns the receiver.
+    Transient* append(void* val) {
+      Region::Alongside alongside(this);
+      if (tail_ == 0) {
+        tail_ = Node::createWithCapacity(32, false);
+      } else if (tail_->length == 32) {
+        // Full tail -- push into tree
+        pushTailInPlace(count_, shift_, root_, tail_);
+        tail_ = Node::createWithCapacity(32, false);
+      } else if (!isOwned(tail_)) {
+        Node* tail = Node::createWithCapacity(*tail_, 32);
+        tail_->release();
+        tail_ = tail;
+      }
+
+      uint8_t i = tail_->length++;
+      tail_->setValue(i, val);
+      ++count_;
+      return this;
+    }
+
+    // Returns an immutable vector with the contents of the receiver
+    Vector* persistent() const {
+      if (tail_ == 0) return Vector::Empty;
+      return Vector::create(count_, shift_, root_, RetainReference, tail_, RetainReference);
+    }
+
+  protected:
+    void dealloc() {
+      root_->release();
+      if (tail_) tail_->release();
+    }
+
+  private:
+    size_t count_;
+    uint32_t shift_;
+    Node* root_;
+    Node* tail_;
+  };
+
+  // Returns a transient which initially has the same contents as the receiver
+  Transient* asTransient() const { return Transient::create(this); }
+
+  // Returns a vector containing the *count* items starting at *items*. The trie is
+  // built bottom-up in a single pass, allocating every node at its final size.
+  static Vector* fromArray(void* const* items, size_t count) {
+    if (count == 0) return Vector::Empty;
+
+    size_t tailoff = ((count - 1) >> 5) << 5;
+    Node* tail = Node::createLeaf((uint8_t)(count - tailoff));
+    memcpy(tail->data, items + tailoff, sizeof(void*) * tail->length);
+    if (tailoff == 0) {
+      return Vector::create(count, 5, Node::Empty, TransferReference, tail, TransferReference);
+    }
+
+    // Number of nodes at each level, starting with the leaves at level 0. The
+    // root level is the first one to have a single node.
+    size_t levelCount[MaxDepth+1];
+    levelCount[0] = tailoff >> 5;
+    int depth = 0;
+    do {
+      ++depth;
+      levelCount[depth] = (levelCount[depth-1] + 31) >> 5;
+    } while (levelCount[depth] > 1);
+
+    // The node currently being filled at each level, and how many nodes that
+    // level has completed so far
+    Node* open[MaxDepth+1];
+    uint8_t openLength[MaxDepth+1];
+    size_t completed[MaxDepth+1];
+    for (int level = 1; level <= depth; ++level) {
+      open[level] = 0;
+      completed[level] = 0;
+    }
+
+    Node* root = 0;
+    for (size_t leafi = 0; leafi < levelCount[0]; ++leafi) {
+      Node* node = Node::createLeaf(32);
+      memcpy(node->data, items + (leafi << 5), sizeof(void*) * 32);
+
+      // Add the node to its parent, completing parents as they fill up
+      for (int level = 1; node != 0; ++level) {
+        if (open[level] == 0) {
+          size_t remaining = levelCount[level-1] - (completed[level] << 5);
+          open[level] = Node::createBranch((uint8_t)(remaining < 32 ? remaining : 32));
+          openLength[level] = 0;
+        }
+        Node* parent = open[level];
+        parent->setNode(openLength[level]++, node, TransferReference);
+        node = 0;
+        if (openLength[level] == parent->length) {
+          open[level] = 0;
+          ++completed[level];
+          if (level == depth) {
+            root = parent;
+          } else {
+            node = parent;
+          }
+        }
+      }
+    }
+
+    assert(root != 0);
+    return Vector::create(count, 5 * depth, root, TransferReference, tail, TransferReference);
+  }
+
+  // Iterates over the items of a vector one leaf ("chunk") at a time. Each step
+  // yields a pointer to the leaf's items and how many there are, so scanning a
+  // vector becomes a loop over contiguous memory instead of a descent from the
+  // root for every item. The path to the current leaf is kept, so moving to the
+  // next leaf only touches the nodes that differ.
+  //
+  //   Vector::ChunkIterator it(v);
+  //   void* const* items; size_t length;
+  //   while (it.next(items, length)) {
+  //     for (size_t i = 0; i < length; ++i) sum += (uint64_t)items[i];
+  //   }
+  //
+  // The iterator does not retain the vector, which must outlive the iterator.
+  class ChunkIterator {
+  public:
+    // Creates an iterator positioned before the first chunk, or after the last
+    // chunk if *atEnd* is true.
+    ChunkIterator(const Vector* v, bool atEnd = false)
+        : v_(v), depth_(v->shift_ / 5), offset_(atEnd ? v->count_ : 0),
+          length_(0), state_(atEnd ? AfterEnd : BeforeStart) {
+      assert(depth_ <= MaxDepth);
+    }
+
+    // Moves to the next chunk. Returns false if there are no more chunks.
+    bool next(void* const*& items, size_t& length) {
+      switch (state_) {
+        case BeforeStart:
+          if (v_->root_->length != 0) {
+            descend(0, false);
+            state_ = InTree;
+          } else if (v_->tail_ != 0) {
+            state_ = InTail;
+          } else {
+            return false;
+          }
+          break;
+        case InTree:
+          offset_ += length_;
+          if (!step(false)) {
+            if (v_->tail_ == 0) { state_ = AfterEnd; return false; }
+            state_ = InTail;
+          }
+          break;
+        case InTail:
+          offset_ += length_;
+          state_ = AfterEnd;
+          return false;
+        case AfterEnd:
+          return false;
+      }
+      return current(items, length);
+    }
+
+    // Moves to the previous chunk. Returns false if there are no more chunks.
+    bool prev(void* const*& items, size_t& length) {
+      switch (state_) {
+        case AfterEnd:
+          if (v_->tail_ != 0) {
+            state_ = InTail;
+          } else if (v_->root_->length != 0) {
+            descend(0, true);
+            state_ = InTree;
+          } else {
+            return false;
+          }
+          break;
+        case InTail:
+          if (v_->root_->length == 0) { state_ = BeforeStart; offset_ = 0; return false; }
+          descend(0, true);
+          state_ = InTree;
+          break;
+        case InTree:
+          if (!step(true)) { state_ = BeforeStart; offset_ = 0; return false; }
+          break;
+        case BeforeStart:
+          return false;
+      }
+      current(items, length);
+      offset_ -= length_;
+      return true;
+    }
+
+    // Index of the first item in the current chunk
+    inline size_t offset() const { return offset_; }
+
+  private:
+    enum State { BeforeStart, InTree, InTail, AfterEnd };
+
+    // Sets items and length to the current chunk
+    bool current(void* const*& items, size_t& length) {
+      if (state_ == InTail) {
+        items = v_->tail_->data;
+        length = length_ = v_->tailLength_;
+        return true;
+      }
+      const Node* leaf = path_[depth_-1]->getNode(index_[depth_-1]);
+      items = leaf->data;
+      length = length_ = leaf->length;
+      return true;
+    }
+
+    // Fills the path from *level* down to a leaf, following the first (or last
+    // if *backwards*) child of each node.
+    void descend(int level, bool backwards) {
+      const Node* node = (level == 0) ? v_->root_ : path_[level-1]->getNode(index_[level-1]);
+      for (; level < depth_; ++level) {
+        path_[level] = node;
+        index_[level] = backwards ? node->length - 1 : 0;
+        node = node->getNode(index_[level]);
+      }
+    }
+
+    // Moves the path to the next (or previous if *backwards*) leaf in the tree.
+    // Returns false if the path is already at the last (or first) leaf.
+    bool step(bool backwards) {
+      for (int level = depth_ - 1; level >= 0; --level) {
+        if (backwards ? index_[level] > 0 : index_[level] + 1 < path_[level]->length) {
+          index_[level] += backwards ? -1 : 1;
+          descend(level + 1, backwards);
+          return true;
+        }
+      }
+      return false;
+    }
+
+    const Vector* v_;
+    int depth_;
+    size_t offset_;
+    size_t length_; // length of the current chunk
+    State state_;
+    const Node* path_[MaxDepth];
+    uint8_t index_[MaxDepth];
+  };
+
+  // Runs body(i) for each i in [0, count) on the calling thread. The tree walks
+  // below (mapChunks and reduceChunks) take a "fork" like this one, which is
+  // called with the children of a branch and the number of items below each
+  // child, and may run them concurrently (see VectorParallel.h).
+  struct SerialFork {
+    template <typename B> void operator()(size_t count, size_t, B& body) {
+      for (size_t i = 0; i < count; ++i) body(i);
+    }
+  };
+
+  // Returns a vector with the same shape as the receiver where each leaf is
+  // produced by calling f(items, result, length), which must write *length*
+  // items to *result*.
+  template <typename F>
+  Vector* mapChunks(F f) const {
+    SerialFork fork;
+    return mapChunks(f, fork);
+  }
+
+  template <typename F, typename Fork>
+  Vector* mapChunks(F& f, Fork& fork) const {
+    if (count_ == 0) return Vector::Empty;
+    Node* root = mapNode(shift_, root_, f, fork);
+    Node* tail = Node::createLeaf(tailLength_);
+    f((void* const*)tail_->data, tail->data, (size_t)tailLength_);
+    return Vector::create(count_, shift_, root,TransferReference, tail,TransferReference);
+  }
+
+  // Folds the items of the receiver one leaf at a time. f(acc, items, length,
+  // offset) returns acc with the *length* items starting at index *offset*
+  // folded in. Each subtree is folded starting with *identity* and the results
+  // of adjacent subtrees are joined with combine(left, right), so combine must
+  // be associative.
+  template <typename R, typename F, typename C>
+  R reduceChunks(const R& identity, F f, C combine) const {
+    SerialFork fork;
+    return reduceChunks(identity, f, combine, fork);
+  }
+
+  template <typename R, typename F, typename C, typename Fork>
+  R reduceChunks(const R& identity, F& f, C& combine, Fork& fork) const {
+    if (count_ == 0) return identity;
+    R r = reduceNode(shift_, root_, 0, identity, f, combine, fork);
+    return combine(r, f(identity, (void* const*)tail_->data, (size_t)tailLength_, tailoff()));
   }
 
+  // Memory held by a vector, as reported by memoryUsage
+  struct MemoryUsage {
+    size_t bytes;         // bytes allocated for the vector and all its nodes
+    size_t depth;         // number of levels, including the leaves (0 if empty)
+    size_t leafCount;     // number of leaves, including the tail
+    size_t branchCount;   // number of branches
+    size_t relaxedCount;  // number of branches with a size table
+    size_t fill[33];      // number of nodes (leaves and branches) by length
+    size_t sharedBytes;   // part of bytes in nodes which *other* also uses
+    size_t sharedCount;   // number of nodes which *other* also uses
+  };
+
+  // Walks the receiver and returns the memory it holds. Nodes which *other*
+  // also uses (the very same node, found by address) are reported as shared.
+  // A node which is reachable more than once is counted each time.
+  //
+  // In *cheap* mode leaves are never read: their lengths are taken from their
+  // parents and they're assumed to have no spare capacity, which is true of
+  // all leaves in the trie except those which were tails with room to grow
+  // when they got there. This visits about 1/32 of the nodes and is meant for
+  // sampling in production.
+  MemoryUsage memoryUsage(const Vector* other = 0, bool cheap = false) const;
+
+  // Writes the receiver to a file at *path* which can be loaded with
+  // Mapping::open. Nodes are written contiguously with the leaves first, and
+  // nodes which appear more than once in the trie are written once. Items are
+  // written as they are, so this is only meaningful for vectors of immediate
+  // values. Returns false and sets errno on failure.
+  bool writeFile(const char* path) const;
+
+  // Returns true if the receiver and *other* hold the same items, compared by
+  // value like memcmp. Subtrees which the two vectors share (the very same
+  // node at the same position) are skipped without being read, so comparing
+  // a vector with a version derived from it takes time proportional to the
+  // number of paths that differ. Vectors whose tries are shaped differently
+  // (e.g. one was built by concat) are compared item by item.
+  bool equals(const Vector* other) const;
+
+  // Returns a hash of the items of the receiver. Vectors which are equal (see
+  // equals) have the same hash, regardless of how their tries are shaped.
+  //
+  // The hash of each trie node is cached in the node the first time it's
+  // computed, so hashing a vector derived from an already hashed one only
+  // reads the nodes which aren't shared between the two. Nodes of a Mapping
+  // and the tail are never cached.
+  size_t hash() const;
+
+  // A vector loaded from a file written by writeFile. The file is mapped into
+  // memory, and the vector and its nodes are used right where they are in the
+  // mapping. While loading, the header of every node is read to check that
+  // the file is well formed, and the branches, which are stored at the end of
+  // the file and make up about 1/32 of it, are modified to turn their child
+  // offsets into pointers. After that the mapping is made read-only.
+  //
+  // The vector and its nodes are not reference counted (like Vector::Empty),
+  // so vectors derived from it copy any node they modify. Derived vectors
+  // still share the other nodes, so they must be released before the mapping.
+  //
+  //   Vector::Mapping* m = Vector::Mapping::open("items.vec");
+  //   Vector* v = m->vector()->append(x);
+  //   ...
+  //   v->release();
+  //   m->release();
+  //
+  class Mapping { HUE_OBJECT(Mapping)
+  public:
+    // Maps the file at *path*. Returns 0 and sets errno on failure. errno is
+    // EINVAL if the file isn't a vector written by this build.
+    static Mapping* open(const char* path);
+
+    // The mapped vector. It's valid for as long as the mapping is.
+    Vector* vector() const { return vector_; }
+
+    // Number of bytes mapped
+    size_t size() const { return size_; }
+
+  protected:
+    void dealloc();
+
+  private:
+    void* base_;
+    size_t size_;
+    Vector* vector_;
+  };
+
 protected:
 
   // Used for the empty vector ::Empty
-  Vector() : refcount_(Unretainable), count_(0), shift_(5), root_(Node::Empty), tail_(0) {}
+  Vector() : refcount_(Unretainable), count_(0), shift_(5), tailLength_(0), root_(Node::Empty), tail_(0) {}
   
+  // Creates a vector using the first *tailLength* items of *tail*, or all of
+  // them if tailLength is omitted
   static Vector* create(size_t count, uint32_t shift,
                         Node* root, RefRule root_refrule,
-                        Node* tail, RefRule tail_refrule ) {
+                        Node* tail, RefRule tail_refrule, int tailLength = -1) {
     DEBUG_LIVECOUNT_Vector_INC
     Vector* v = __alloc(sizeof(Vector));
     v->count_ = count;
     v->shift_ = shift;
+    v->tailLength_ = (tailLength < 0) ? tail->length : tailLength;
     v->root_ = (root_refrule == TransferReference) ? root : root->retain();
     v->tail_ = (tail_refrule == TransferReference) ? tail : tail->retain();
     assert(v->shift_ % 5 == 0);
+    assert(v->tailLength_ <= tail->length);
     return v;
   }
   
+  inline size_t allocSize() const { return sizeof(Vector); }
+
   void dealloc() {
     DEBUG_LIVECOUNT_Vector_DEC
     if (root_) root_->release();
@@ -251,41 +953,117 @@ protected:
   }
 
   inline size_t tailLength() const {
-    return count_ - tailoff();
+    return tailLength_;
+  }
+
+  // Returns a reference to the tail holding exactly the receiver's tail items,
+  // copying it if another vector has appended to it in place
+  Node* ownTail() const {
+    if (tail_->length == tailLength_) return tail_->retain();
+    return Node::createPrefix(*tail_, tailLength_);
+  }
+
+  // Computes the trie and tail of the receiver with val appended. Returns
+  // references to the new root and tail.
+  void appended(void* val, Node*& newroot, uint32_t& newshift, Node*& newTail) const {
+    appended(count_, shift_, tailLength_, root_, tail_, isUnique(), val, newroot, newshift, newTail);
+  }
+
+  // Like appended above, for the vector made up of the given parts. *unique*
+  // tells if the vector is only referenced by the caller.
+  static void appended(size_t count, uint32_t shift, uint8_t tailLength, Node* root, Node* tail,
+                       bool unique, void* val, Node*& newroot, uint32_t& newshift, Node*& newTail) {
+    newshift = shift;
+    // A tail which will likely be appended to in place by its only owner gets
+    // room for 32 items up front
+
+    //room in tail?
+    if (tailLength < 32) {
+      newroot = root->retain();
+      if (unique && tail != 0 && isOwned(tail)) {
+        // The receiver is the only one using the tail, so any slots past its
+        // length are free
+        tail->setValue(tailLength, val);
+        tail->length = tailLength + 1;
+        newTail = tail->retain();
+        return;
+      }
+      newTail = Node::createWithCapacity(unique ? 32 : tailLength + 1, false);
+      if (tailLength) memcpy(newTail->data, tail->data, sizeof(void*) * tailLength);
+      newTail->setValue(tailLength, val);
+      newTail->length = tailLength + 1;
+      return;
+    }
+
+    // Full tail -- push into tree
+    if (root->relaxed) {
+      newroot = pushLeaf(root, newshift, tail);
+    } else if ((count >> 5) > (1 << shift)) {
+      // Overflow root
+      newroot = Node::createBranch(2);
+      newroot->setNode(0, root);
+      newroot->setNode(1, newPath(shift, tail), TransferReference);
+      newshift += 5;
+    } else {
+      newroot = pushTail(count, shift, root, tail);
+    }
+
+    newTail = unique ? Node::createWithCapacity(32, false) : Node::createLeaf(1);
+    newTail->setValue(0, val);
+    newTail->length = 1;
   }
 
   // Offset of tail (the start of tail relative to count)
   inline size_t tailoff() const {
-    if (tail_ == 0 || count_ < 32)
-      return 0;
-    return ((count_ - 1) >> 5) << 5;
+    return count_ - tailLength();
   }
   
-  // Finds the node for index i
-  const Node& nodeFor(size_t i) const throw(std::out_of_range) {
-    if (i >= count_)
+  // Finds the leaf node for index i. *index* is set to the position of i in that leaf.
+  inline const Node& nodeFor(size_t i, uint8_t& index) const throw(std::out_of_range) {
+    return nodeFor(count_, shift_, tailLength_, root_, tail_, i, index);
+  }
+
+  // Like nodeFor above, for the vector made up of the given parts
+  static const Node& nodeFor(size_t count, uint32_t shift, uint8_t tailLength,
+                             const Node* root, const Node* tail,
+                             size_t i, uint8_t& index) throw(std::out_of_range) {
+    if (i >= count)
       throw std::out_of_range("index out of range");
 
     // i is in tail?
-    if (i >= tailoff())
-      return *tail_;
+    size_t tailoff = count - tailLength;
+    if (i >= tailoff) {
+      index = i - tailoff;
+      return *tail;
+    }
 
-    Node* node = root_;
-    for (uint32_t level = shift_; level > 0; level -= 5) {
+    const Node* node = root;
+    uint32_t level = shift;
+
+    // Relaxed nodes are looked up using their size tables. Below a relaxed node
+    // (and in tries without relaxed nodes) radix lookup is used.
+    while (node->relaxed) {
+      node = node->getNode(node->relaxedIndexFor(i, level));
+      level -= 5;
+    }
+
+    for (; level > 0; level -= 5) {
       node = node->getNode( (i >> level) & 0x1f );
     }
     
     assert(node != 0);
+    index = i & 0x1f;
     return *node;
   }
   
-  // Create a new tail. Returns a node with a +1 refcount.
-  Node* pushTail(size_t level, Node* parent, Node* tailnode) const {
+  // Create a new tail. Returns a node with a +1 refcount. *count* is the
+  // number of items of the vector, including those in the tail being pushed.
+  static Node* pushTail(size_t count, size_t level, Node* parent, Node* tailnode) {
     //if parent is leaf, insert node,
     // else does it map to an existing child? -> nodeToInsert = pushNode one more level
     // else alloc new path
     //return  nodeToInsert placed in copy of parent
-    size_t subidx = ((count_ - 1) >> level) & 0x1f;
+    size_t subidx = ((count - 1) >> level) & 0x1f;
     Node* nodeToInsert;
     
     if (level == 5) {
@@ -297,19 +1075,21 @@ protected:
         nodeToInsert = newPath(level-5, tailnode);
       } else {
         Node* child = parent->getNode(subidx);
-        nodeToInsert = pushTail(level-5, child, tailnode);
+        nodeToInsert = pushTail(count, level-5, child, tailnode);
       }
     }
     
+    // Note: parent is always copied, even when it already has a slot at subidx,
+    // since it might be shared with other vectors (or a transient).
     Node* node;
     if (parent != 0 && parent->length) {
       if (parent->length <= subidx) {
         node = Node::create(*parent, subidx+1);
       } else {
-        node = parent->retain();
+        node = Node::create(*parent, parent->length);
       }
     } else {
-      node = Node::create(subidx+1);
+      node = Node::createBranch(subidx+1);
     }
     
     assert(node->length > subidx);
@@ -320,14 +1100,407 @@ protected:
     return node;
   }
   
+  // A node is owned by a transient (or by a vector which is only referenced
+  // once) when it has room for 32 items and is only referenced from a path of
+  // owned nodes. Owned nodes are modified in place, so a node is also only
+  // owned if the nodes linked into it come from the same place (see
+  // Region::isCurrent).
+  static inline bool isOwned(const Node* node) {
+    return node->isUnique() && node->capacity == 32 && Region::isCurrent(node);
+  }
+
+  // Returns the child at index i of the owned node *parent*, first replacing
+  // it with a copy if it isn't owned.
+  static Node* ownedChild(Node* parent, uint8_t i) {
+    Node* child = parent->getNode(i);
+    if (!isOwned(child)) {
+      child = Node::createWithCapacity(*child, 32);
+      parent->setNode(i, child, TransferReference);
+    }
+    return child;
+  }
+
+  // Moves the full leaf *tail* into the trie at *root*, which holds count - 32
+  // items, modifying owned nodes in place and replacing the root if it isn't
+  // owned. Transfers the reference of tail.
+  static void pushTailInPlace(size_t count, uint32_t& shift, Node*& root, Node* tail) {
+    if (root->relaxed) {
+      // Relaxed tries are not built in place
+      Node* newroot = Vector::pushLeaf(root, shift, tail);
+      root->release();
+      tail->release();
+      root = newroot;
+    } else if ((count >> 5) > ((size_t)1 << shift)) {
+      // Overflow root
+      Node* newroot = Node::createWithCapacity(32, true);
+      newroot->length = 2;
+      newroot->setNode(0, root, TransferReference);
+      newroot->setNode(1, newOwnedPath(shift, tail), TransferReference);
+      root = newroot;
+      shift += 5;
+    } else {
+      if (!isOwned(root)) {
+        Node* newroot = Node::createWithCapacity(*root, 32);
+        root->release();
+        root = newroot;
+      }
+      pushTailIntoOwned(count, shift, root, tail);
+    }
+  }
+
+  static void pushTailIntoOwned(size_t count, uint32_t level, Node* parent, Node* tail) {
+    parent->setCachedHash(0);
+    uint8_t subidx = ((count - 1) >> level) & 0x1f;
+    if (level == 5) {
+      assert(subidx == parent->length);
+      parent->length = subidx + 1;
+      parent->setNode(subidx, tail, TransferReference);
+    } else if (subidx < parent->length) {
+      pushTailIntoOwned(count, level - 5, ownedChild(parent, subidx), tail);
+    } else {
+      assert(subidx == parent->length);
+      parent->length = subidx + 1;
+      parent->setNode(subidx, newOwnedPath(level - 5, tail), TransferReference);
+    }
+  }
+
+  // Create a new path of owned nodes. Transfers the reference of node.
+  static Node* newOwnedPath(uint32_t level, Node* node) {
+    if (level == 0) return node;
+    Node* newnode = Node::createWithCapacity(32, true);
+    newnode->length = 1;
+    newnode->setNode(0, newOwnedPath(level - 5, node), TransferReference);
+    return newnode;
+  }
+
+  // Copy the path to index i, replacing the item with val. Returns a node with a +1
+  // refcount.
+  static Node* doAssoc(uint32_t level, const Node* node, size_t i, void* val) {
+    Node* newnode = Node::create(*node, node->length);
+    if (level == 0) {
+      newnode->setValue(i & 0x1f, val);
+    } else {
+      uint8_t subidx = node->relaxed ? node->relaxedIndexFor(i, level) : (i >> level) & 0x1f;
+      newnode->setNode(subidx, doAssoc(level - 5, node->getNode(subidx), i, val), TransferReference);
+    }
+    return newnode;
+  }
+
+  // Copy the path to the last leaf, leaving that leaf out. *removed* is the number
+  // of items in that leaf. Returns a node with a +1 refcount, or 0 if the node
+  // would become empty.
+  static Node* popTail(uint32_t level, const Node* node, size_t removed) {
+    uint8_t last = node->length - 1;
+    if (level > 5) {
+      Node* newchild = popTail(level - 5, node->getNode(last), removed);
+      if (newchild != 0) {
+        Node* newnode = Node::create(*node, node->length);
+        newnode->setNode(last, newchild, TransferReference);
+        if (newnode->relaxed) newnode->sizes()[last] -= removed;
+        return newnode;
+      }
+    }
+    return (last == 0) ? 0 : Node::createPrefix(*node, last);
+  }
+
+  // Pushes the full leaf *leaf* onto the end of the possibly relaxed trie at
+  // *root*, growing the trie by one level if needed. Returns a node with a +1
+  // refcount and updates *shift* to the shift of the new root.
+  static Node* pushLeaf(const Node* root, uint32_t& shift, Node* leaf) {
+    Node* newroot = pushLeaf(shift, root, leaf);
+    if (newroot == 0) {
+      // Overflow root
+      Node* children[2] = { const_cast<Node*>(root)->retain(), newPath(shift, leaf) };
+      newroot = createBranch(shift + 5, children, 2);
+      shift += 5;
+    }
+    return newroot;
+  }
+
+  // Returns a copy of node with leaf added to the rightmost path, or 0 if the
+  // rightmost path is full.
+  static Node* pushLeaf(uint32_t level, const Node* node, Node* leaf) {
+    uint8_t length = node->length;
+    Node* newchild = 0;
+    if (level > 5) {
+      newchild = pushLeaf(level - 5, node->getNode(length - 1), leaf);
+      if (newchild != 0) {
+        Node* newnode = Node::create(*node, length);
+        newnode->setNode(length - 1, newchild, TransferReference);
+        if (newnode->relaxed) newnode->sizes()[length - 1] += leaf->length;
+        return newnode;
+      }
+    }
+    if (length == 32) return 0;
+    Node* newnode = Node::create(*node, length + 1);
+    newnode->setNode(length, newPath(level - 5, leaf), TransferReference);
+    if (newnode->relaxed) {
+      newnode->sizes()[length] = (length ? newnode->sizes()[length - 1] : 0) + leaf->length;
+    }
+    return newnode;
+  }
+
+  // Number of items in the subtree at node
+  static size_t nodeCount(const Node* node, uint32_t level) {
+    if (level == 0 || node->length == 0) return node->length;
+    if (node->relaxed) return node->sizes()[node->length - 1];
+    return ((size_t)(node->length - 1) << level) + nodeCount(node->getNode(node->length - 1), level - 5);
+  }
+
+  // Creates a branch node at *level* holding *count* children, taking over their
+  // references. The node is only made relaxed if its subtree isn't laid out like
+  // a regular trie, i.e. with all leaves full and all children but the last
+  // holding 1 << level items.
+  static Node* createBranch(uint32_t level, Node* const* children, uint8_t count) {
+    size_t sizes[32];
+    size_t total = 0;
+    bool regular = true;
+    for (uint8_t i = 0; i < count; ++i) {
+      size_t n = nodeCount(children[i], level - 5);
+      total += n;
+      sizes[i] = total;
+      if ((level == 5) ? (n != 32) : (children[i]->relaxed || (i < count - 1 && n != ((size_t)1 << level)))) {
+        regular = false;
+      }
+    }
+    Node* node = Node::createBranch(count, !regular);
+    for (uint8_t i = 0; i < count; ++i) {
+      node->setNode(i, children[i], TransferReference);
+    }
+    if (node->relaxed) memcpy(node->sizes(), sizes, sizeof(size_t) * count);
+    return node;
+  }
+
+  // Removes single-child roots. Takes over the reference to root and returns a
+  // node with a +1 refcount.
+  static Node* collapse(Node* root, uint32_t& shift) {
+    while (shift > 5 && root->length == 1) {
+      Node* child = root->getNode(0)->retain();
+      root->release();
+      root = child;
+      shift -= 5;
+    }
+    return root;
+  }
+
+  // Concatenates the tries left and right. Returns a node with a +1 refcount and
+  // sets *shift* to the shift of that node.
+  static Node* concatTries(const Node* left, uint32_t leftShift,
+                           const Node* right, uint32_t rightShift, uint32_t& shift) {
+    if (left->length == 0) {
+      shift = rightShift;
+      return const_cast<Node*>(right)->retain();
+    }
+    if (right->length == 0) {
+      shift = leftShift;
+      return const_cast<Node*>(left)->retain();
+    }
+    shift = ((leftShift > rightShift) ? leftShift : rightShift) + 5;
+    return collapse(concatSubtries(left, leftShift, right, rightShift), shift);
+  }
+
+  // Merges the right edge of *left* with the left edge of *right*. Returns a node
+  // one level above the higher of the two, with one or two children.
+  static Node* concatSubtries(const Node* left, uint32_t leftShift,
+                              const Node* right, uint32_t rightShift) {
+    Node* centre = 0;
+    uint32_t level = leftShift;
+    if (leftShift > rightShift) {
+      centre = concatSubtries(left->getNode(left->length - 1), leftShift - 5, right, rightShift);
+      right = 0;
+    } else if (leftShift < rightShift) {
+      centre = concatSubtries(left, leftShift, right->getNode(0), rightShift - 5);
+      left = 0;
+      level = rightShift;
+    } else if (leftShift > 5) {
+      centre = concatSubtries(left->getNode(left->length - 1), leftShift - 5,
+                              right->getNode(0), rightShift - 5);
+    }
+    Node* node = rebalance(level, left, centre, right);
+    if (centre) centre->release();
+    return node;
+  }
+
+  // The number of extra nodes a level may have over the optimal number after a
+  // concatenation. Allowing some slack avoids copying most of a level.
+  static const uint8_t ConcatExtras = 2;
+
+  // Redistributes the children of left (except its last), centre and right (except
+  // its first) into as few nodes at *level* as the concat invariant requires.
+  // Without a centre, all children of left and right are redistributed. Returns
+  // a node at level + 5 with one or two children.
+  static Node* rebalance(uint32_t level, const Node* left, const Node* centre, const Node* right) {
+    const Node* slots[64];
+    uint8_t count = 0;
+    if (left) for (uint8_t i = 0; i < left->length - (centre ? 1 : 0); ++i) {
+      slots[count++] = left->getNode(i);
+    }
+    if (centre) for (uint8_t i = 0; i < centre->length; ++i) {
+      slots[count++] = centre->getNode(i);
+    }
+    if (right) for (uint8_t i = (centre ? 1 : 0); i < right->length; ++i) {
+      slots[count++] = right->getNode(i);
+    }
+
+    // Plan the new sizes. As long as there are too many nodes, pick the first
+    // node which isn't full and spread its contents over the following nodes.
+    uint8_t plan[64];
+    size_t total = 0;
+    for (uint8_t i = 0; i < count; ++i) {
+      plan[i] = slots[i]->length;
+      total += plan[i];
+    }
+    uint8_t planCount = count;
+    size_t optimal = (total + 31) / 32;
+    while (planCount > optimal + ConcatExtras) {
+      uint8_t i = 0;
+      while (plan[i] == 32) ++i;
+      size_t remaining = plan[i];
+      while (remaining > 0) {
+        assert(i + 1 < planCount);
+        size_t size = remaining + plan[i + 1];
+        if (size > 32) size = 32;
+        remaining = remaining + plan[i + 1] - size;
+        plan[i++] = size;
+      }
+      for (uint8_t j = i; j < planCount - 1; ++j) plan[j] = plan[j + 1];
+      --planCount;
+    }
+
+    // Carry out the plan, reusing the nodes which are unaffected
+    Node* nodes[64] = {0};
+    uint8_t slot = 0, offset = 0;
+    for (uint8_t i = 0; i < planCount; ++i) {
+      if (offset == 0 && slots[slot]->length == plan[i]) {
+        nodes[i] = const_cast<Node*>(slots[slot++])->retain();
+        continue;
+      }
+      Node* children[32];
+      Node* leaf = (level == 5) ? Node::createLeaf(plan[i]) : 0;
+      for (uint8_t filled = 0; filled < plan[i]; ) {
+        uint8_t n = slots[slot]->length - offset;
+        if (n > plan[i] - filled) n = plan[i] - filled;
+        if (leaf) {
+          memcpy(leaf->data + filled, slots[slot]->data + offset, sizeof(void*) * n);
+        } else for (uint8_t j = 0; j < n; ++j) {
+          children[filled + j] = slots[slot]->getNode(offset + j)->retain();
+        }
+        filled += n;
+        offset += n;
+        if (offset == slots[slot]->length) {
+          ++slot;
+          offset = 0;
+        }
+      }
+      nodes[i] = leaf ? leaf : createBranch(level - 5, children, plan[i]);
+    }
+
+    Node* parents[2];
+    uint8_t parentCount = 0;
+    parents[parentCount++] = createBranch(level, nodes, (planCount > 32) ? 32 : planCount);
+    if (planCount > 32) parents[parentCount++] = createBranch(level, nodes + 32, planCount - 32);
+    return createBranch(level + 5, parents, parentCount);
+  }
+
+  // Returns the subtree at node with only the items before *end*, which must be
+  // at a leaf boundary
+  static Node* sliceRight(uint32_t level, const Node* node, size_t end) {
+    if (level == 0) {
+      assert(end == node->length);
+      return const_cast<Node*>(node)->retain();
+    }
+    size_t i = end - 1;
+    uint8_t subidx;
+    if (node->relaxed) {
+      subidx = node->relaxedIndexFor(i, level);
+    } else {
+      subidx = (i >> level) & 0x1f;
+      i &= ((size_t)1 << level) - 1;
+    }
+    Node* newchild = sliceRight(level - 5, node->getNode(subidx), i + 1);
+    if (subidx == node->length - 1 && newchild == node->getNode(subidx)) {
+      newchild->release();
+      return const_cast<Node*>(node)->retain();
+    }
+    Node* newnode = Node::createPrefix(*node, subidx + 1);
+    newnode->setNode(subidx, newchild, TransferReference);
+    if (newnode->relaxed) newnode->sizes()[subidx] = end;
+    return newnode;
+  }
+
+  // Returns the subtree at node without the items before *start*
+  static Node* sliceLeft(uint32_t level, const Node* node, size_t start) {
+    if (start == 0) return const_cast<Node*>(node)->retain();
+    if (level == 0) return Node::createSlice(*node, start, node->length);
+    size_t i = start;
+    uint8_t subidx;
+    if (node->relaxed) {
+      subidx = node->relaxedIndexFor(i, level);
+    } else {
+      subidx = (i >> level) & 0x1f;
+      i &= ((size_t)1 << level) - 1;
+    }
+    Node* children[32];
+    uint8_t count = 0;
+    children[count++] = sliceLeft(level - 5, node->getNode(subidx), i);
+    for (uint8_t j = subidx + 1; j < node->length; ++j) {
+      children[count++] = node->getNode(j)->retain();
+    }
+    return createBranch(level, children, count);
+  }
+
+  // Helper for mapChunks. Returns a node with a +1 refcount.
+  template <typename F, typename Fork>
+  static Node* mapNode(uint32_t level, const Node* node, F& f, Fork& fork) {
+    if (node->length == 0) return const_cast<Node*>(node)->retain();
+    if (level == 0) {
+      Node* leaf = Node::createLeaf(node->length);
+      f((void* const*)node->data, leaf->data, (size_t)node->length);
+      return leaf;
+    }
+    Node* children[32];
+    auto body = [&](size_t i) {
+      children[i] = mapNode(level - 5, node->getNode(i), f, fork);
+    };
+    fork(node->length, (size_t)1 << level, body);
+    Node* newnode = Node::createBranch(node->length, node->relaxed);
+    for (uint8_t i = 0; i < node->length; ++i) {
+      newnode->setNode(i, children[i], TransferReference);
+    }
+    if (node->relaxed) memcpy(newnode->sizes(), node->sizes(), sizeof(size_t) * node->length);
+    return newnode;
+  }
+
+  // Helper for reduceChunks. *offset* is the index of the first item below node.
+  template <typename R, typename F, typename C, typename Fork>
+  static R reduceNode(uint32_t level, const Node* node, size_t offset,
+                      const R& identity, F& f, C& combine, Fork& fork) {
+    if (node->length == 0) return identity;
+    if (level == 0) return f(identity, (void* const*)node->data, (size_t)node->length, offset);
+    R parts[32];
+    auto body = [&](size_t i) {
+      size_t childOffset = offset;
+      if (node->relaxed) {
+        if (i > 0) childOffset += node->sizes()[i - 1];
+      } else {
+        childOffset += i << level;
+      }
+      parts[i] = reduceNode(level - 5, node->getNode(i), childOffset, identity, f, combine, fork);
+    };
+    fork(node->length, (size_t)1 << level, body);
+    R r = parts[0];
+    for (uint8_t i = 1; i < node->length; ++i) r = combine(r, parts[i]);
+    return r;
+  }
+
   // Create a new path. Returns a node with a +1 refcount.
-  Node* newPath(uint32_t level, Node* node) const {
+  static Node* newPath(uint32_t level, Node* node) {
     if (level == 0) {
       node->retain();
       return node;
     }
     // Create a new node with a single value, which is the parent node
-    Node* newnode = Node::create(1);
+    Node* newnode = Node::createBranch(1);
     newnode->setNode(0, newPath(level - 5, node), TransferReference);
     
     return newnode;
@@ -336,10 +1509,118 @@ protected:
 private:
   size_t count_; // number of items in this vector
   uint32_t shift_;
+  uint8_t tailLength_; // number of items of tail_ which belong to this vector
   Node* root_;
   Node* tail_;
   
   static const Vector _Empty;
+
+  struct UsageWalk; // see memoryUsage
+  struct FileWriter; // see writeFile
+  struct Hashing; // see hash and equals
+
+  friend class VectorRef;
+};
+
+
+// A vector held by value. It has the same parts as a Vector, but rather than
+// living on the heap with a reference count of its own it's passed around in
+// registers or on the stack, so making a new version of a vector doesn't
+// allocate and release a Vector. A VectorRef holds a reference to its root
+// and tail, which release() gives up; a copy made with the copy constructor
+// borrows those references, like a copied Vector* does.
+//
+//   VectorRef v;
+//   for (size_t i = 0; i < 1000; ++i) v = v.appendAndRelease((void*)i);
+//   Vector* boxed = v.box(); // to store the vector in some other object
+//   v.release();
+//
+class VectorRef {
+public:
+  // The empty vector
+  VectorRef() : count_(0), shift_(5), tailLength_(0), root_(Vector::Node::Empty), tail_(0) {}
+
+  // Returns a reference to the items of v
+  explicit VectorRef(const Vector* v)
+      : count_(v->count_), shift_(v->shift_), tailLength_(v->tailLength_)
+      , root_(v->root_->retain()), tail_(v->tail_ ? v->tail_->retain() : 0) {}
+
+  // Number of items contained by the receiver
+  inline size_t count() const { return count_; }
+
+  // Retrieve item at index i
+  inline void* itemAt(size_t i) const throw(std::out_of_range) {
+    uint8_t index;
+    return Vector::nodeFor(count_, shift_, tailLength_, root_, tail_, i, index).getValue(index);
+  }
+
+  // See Vector::chunkAt
+  size_t chunkAt(size_t i, void* const*& items) const throw(std::out_of_range) {
+    uint8_t index;
+    const Vector::Node& node = Vector::nodeFor(count_, shift_, tailLength_, root_, tail_, i, index);
+    items = node.data + index;
+    return ((&node == tail_) ? tailLength_ : node.length) - index;
+  }
+
+  // Returns a vector with val added to the end. The receiver is left as it is.
+  VectorRef append(void* val) const {
+    VectorRef v;
+    Vector::appended(count_, shift_, tailLength_, root_, tail_, true, val, v.root_, v.shift_, v.tail_);
+    v.count_ = count_ + 1;
+    v.tailLength_ = v.tail_->length;
+    return v;
+  }
+
+  // Like append, but takes over the receiver's references, so the trie and
+  // tail are modified in place when nothing else uses them, and grow where the
+  // tail was allocated (see Vector::appendAndRelease).
+  //
+  //   v = v.appendAndRelease(x);
+  //
+  VectorRef appendAndRelease(void* val) {
+    VectorRef v = *this;
+    Region::Alongside alongside(v.tail_);
+    if (v.tailLength_ == 32) {
+      Vector::pushTailInPlace(v.count_, v.shift_, v.root_, v.tail_);
+      v.tail_ = Vector::Node::createWithCapacity(32, false);
+      v.tailLength_ = 0;
+    } else if (v.tail_ == 0 || !Vector::isOwned(v.tail_)) {
+      Vector::Node* tail = Vector::Node::createWithCapacity(32, false);
+      if (v.tailLength_) memcpy(tail->data, v.tail_->data, sizeof(void*) * v.tailLength_);
+      if (v.tail_) v.tail_->release();
+      v.tail_ = tail;
+    }
+    v.tail_->setValue(v.tailLength_, val);
+    v.tail_->length = ++v.tailLength_;
+    ++v.count_;
+    return v;
+  }
+
+  // Returns a vector on the heap holding the receiver's items
+  Vector* box() const {
+    if (tail_ == 0) return Vector::Empty;
+    return Vector::create(count_, shift_, root_, RetainReference, tail_, RetainReference, tailLength_);
+  }
+
+  // Takes another reference to the receiver's items
+  VectorRef retain() const {
+    root_->retain();
+    if (tail_) tail_->retain();
+    return *this;
+  }
+
+  // Gives up the receiver's references
+  void release() {
+    root_->release();
+    if (tail_) tail_->release();
+  }
+
+private:
+  size_t count_;
+  uint32_t shift_;
+  uint8_t tailLength_;
+  Vector::Node* root_;
+  Vector::Node* tail_;
 };
 
 } // namespace hue
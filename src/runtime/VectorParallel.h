@@ -0,0 +1,106 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+//
+// Parallel reduce, map and forEach over vectors.
+//
+// The work is split along the trie: the children of a branch are independent
+// subtrees, so they are handed to a WorkPool as separate tasks, which split
+// their own children in turn. Subtrees with fewer than *grain* items are
+// processed serially on the thread which got them. map builds the result trie
+// the same way, each task producing one subtree.
+//
+// The functions passed in are called concurrently from several threads and
+// must not modify shared state without synchronization.
+//
+#ifndef _HUE_RUNTIME_VECTOR_PARALLEL_INCLUDED
+#define _HUE_RUNTIME_VECTOR_PARALLEL_INCLUDED
+
+#include <hue/runtime/Vector.h>
+#include <hue/runtime/TypedVector.h>
+#include <hue/runtime/WorkPool.h>
+
+namespace hue { namespace parallel {
+
+// Default number of items below which a subtree is processed serially
+static const size_t DefaultGrain = 1 << 15;
+
+// A fork (see Vector::SerialFork) which runs the children of a branch as tasks
+// in a WorkPool, batching children so that each task has at least *grain*
+// items.
+class PoolFork {
+public:
+  PoolFork(WorkPool& pool, size_t grain) : pool_(pool), grain_(grain ? grain : 1) {}
+
+  template <typename B> void operator()(size_t count, size_t itemsPerChild, B& body) {
+    size_t perTask = (itemsPerChild >= grain_) ? 1 : grain_ / itemsPerChild;
+    if (count <= perTask || pool_.concurrency() == 1) {
+      for (size_t i = 0; i < count; ++i) body(i);
+      return;
+    }
+    // Run the first batch on this thread while the others are picked up by
+    // the pool
+    WorkPool::Group group(pool_);
+    for (size_t start = perTask; start < count; start += perTask) {
+      size_t end = (start + perTask < count) ? start + perTask : count;
+      group.spawn([&body, start, end] {
+        for (size_t i = start; i < end; ++i) body(i);
+      });
+    }
+    for (size_t i = 0; i < perTask; ++i) body(i);
+    group.wait();
+  }
+
+private:
+  WorkPool& pool_;
+  size_t grain_;
+};
+
+// Type of the items of a vector
+template <typename V> struct ItemOf { typedef typename V::Item type; };
+template <> struct ItemOf<Vector> { typedef void* type; };
+
+// Folds the items of v. f(acc, items, length) returns acc with *length* items
+// folded in, starting from *identity* for each subtree. Results of adjacent
+// subtrees are joined with combine(left, right), which must be associative.
+//
+//   int64_t sum = parallel::reduce(v, (int64_t)0,
+//     [](int64_t acc, const int64_t* items, size_t length) {
+//       return acc + kernels::span::sum(items, length);
+//     },
+//     [](int64_t a, int64_t b) { return a + b; });
+//
+template <typename V, typename R, typename F, typename C>
+R reduce(const V* v, const R& identity, F f, C combine,
+         size_t grain = DefaultGrain, WorkPool& pool = WorkPool::shared()) {
+  typedef typename ItemOf<V>::type Item;
+  PoolFork fork(pool, grain);
+  auto chunkf = [&f](const R& acc, const Item* items, size_t length, size_t) {
+    return f(acc, items, length);
+  };
+  return v->reduceChunks(identity, chunkf, combine, fork);
+}
+
+// Calls f(items, length, offset) for each leaf of v, where *offset* is the index
+// of the first of the *length* items. Leaves are visited in no particular order.
+template <typename V, typename F>
+void forEach(const V* v, F f, size_t grain = DefaultGrain, WorkPool& pool = WorkPool::shared()) {
+  typedef typename ItemOf<V>::type Item;
+  PoolFork fork(pool, grain);
+  auto chunkf = [&f](bool, const Item* items, size_t length, size_t offset) {
+    f(items, length, offset);
+    return true;
+  };
+  auto combine = [](bool, bool) { return true; };
+  v->reduceChunks(true, chunkf, combine, fork);
+}
+
+// Returns a vector of the same length as v where each leaf is produced by
+// f(items, result, length), which must write *length* items to *result*
+template <typename V, typename F>
+V* map(const V* v, F f, size_t grain = DefaultGrain, WorkPool& pool = WorkPool::shared()) {
+  PoolFork fork(pool, grain);
+  return v->mapChunks(f, fork);
+}
+
+}} // namespace hue::parallel
+#endif // _HUE_RUNTIME_VECTOR_PARALLEL_INCLUDED
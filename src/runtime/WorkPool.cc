@@ -0,0 +1,123 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+#include "WorkPool.h"
+#include "object.h"
+
+#include <chrono>
+
+namespace hue {
+
+// The pool and queue index of the worker running on the current thread, if any
+static __thread WorkPool* currentPool = 0;
+static __thread size_t currentWorker = 0;
+
+
+// ------------------------------------------------------
+// WorkPool::Group
+
+void WorkPool::Group::spawn(const Function& f) {
+  ++pending_;
+  Task task = { f, this };
+  pool_.push(task);
+}
+
+void WorkPool::Group::wait() {
+  while (pending_ != 0) {
+    if (!pool_.runOne()) std::this_thread::yield();
+  }
+  // The tasks may have released objects which this thread owns
+  mergeQueuedReleases();
+}
+
+
+// ------------------------------------------------------
+// WorkPool
+
+WorkPool::WorkPool(size_t threadCount) : queued_(0), stop_(false) {
+  if (threadCount) useAtomicRefcounts();
+  for (size_t i = 0; i <= threadCount; ++i) queues_.push_back(new Queue);
+  for (size_t i = 0; i < threadCount; ++i) {
+    threads_.push_back(std::thread(&WorkPool::workerMain, this, i));
+  }
+}
+
+WorkPool::~WorkPool() {
+  {
+    std::lock_guard<std::mutex> lock(idleMutex_);
+    stop_ = true;
+  }
+  idle_.notify_all();
+  for (size_t i = 0; i < threads_.size(); ++i) threads_[i].join();
+  for (size_t i = 0; i < queues_.size(); ++i) delete queues_[i];
+}
+
+WorkPool& WorkPool::shared() {
+  static WorkPool pool(std::thread::hardware_concurrency() > 1 ?
+                       std::thread::hardware_concurrency() - 1 : 0);
+  return pool;
+}
+
+void WorkPool::push(const Task& task) {
+  // Workers push to their own queue and everyone else to the shared queue
+  Queue* queue = (currentPool == this) ? queues_[currentWorker] : queues_.back();
+  {
+    std::lock_guard<std::mutex> lock(queue->mutex);
+    queue->tasks.push_back(task);
+  }
+  ++queued_;
+  idle_.notify_one();
+}
+
+bool WorkPool::pop(Queue& queue, bool back, Task& task) {
+  std::lock_guard<std::mutex> lock(queue.mutex);
+  if (queue.tasks.empty()) return false;
+  if (back) {
+    task = queue.tasks.back();
+    queue.tasks.pop_back();
+  } else {
+    task = queue.tasks.front();
+    queue.tasks.pop_front();
+  }
+  --queued_;
+  return true;
+}
+
+// Runs one task, if any is queued. Returns false if there was nothing to run.
+bool WorkPool::runOne() {
+  if (queued_ == 0) return false;
+  Task task;
+  bool found = false;
+  size_t self = (currentPool == this) ? currentWorker : queues_.size() - 1;
+
+  // Our own queue first (newest task), then the shared queue and finally
+  // steal from the other workers (oldest task)
+  if (self != queues_.size() - 1) found = pop(*queues_[self], true, task);
+  if (!found) found = pop(*queues_.back(), false, task);
+  size_t workers = queues_.size() - 1;
+  for (size_t i = 0; !found && i < workers; ++i) {
+    size_t victim = (self + 1 + i) % workers;
+    if (victim != self) found = pop(*queues_[victim], false, task);
+  }
+  if (!found) return false;
+
+  task.function();
+  --task.group->pending_;
+  return true;
+}
+
+void WorkPool::workerMain(size_t index) {
+  currentPool = this;
+  currentWorker = index;
+  while (!stop_) {
+    if (!runOne()) {
+      mergeQueuedReleases();
+      // Sleep until something is queued. The timeout covers a push which
+      // happens between checking queued_ and waiting.
+      std::unique_lock<std::mutex> lock(idleMutex_);
+      idle_.wait_for(lock, std::chrono::milliseconds(1),
+                     [this] { return stop_ || queued_ != 0; });
+    }
+  }
+}
+
+} // namespace hue
@@ -0,0 +1,102 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+//
+// A work-stealing thread pool for fork-join parallelism.
+//
+// Each worker thread has its own queue of tasks. A worker takes tasks from the
+// back of its own queue (the most recently spawned and thus smallest task) and,
+// when its queue is empty, steals from the front of another worker's queue (the
+// oldest and thus largest task). Tasks spawned from threads outside the pool go
+// into a shared queue which all workers steal from.
+//
+// Tasks are spawned into a Group. Waiting on a group runs pending tasks on the
+// waiting thread until all tasks of the group have finished, so tasks may spawn
+// and wait on groups of their own without starving the pool.
+//
+//   WorkPool::Group group(WorkPool::shared());
+//   for (int i = 0; i < 4; ++i) group.spawn([i] { work(i); });
+//   group.wait();
+//
+// Tasks must not throw.
+//
+#ifndef _HUE_RUNTIME_WORK_POOL_INCLUDED
+#define _HUE_RUNTIME_WORK_POOL_INCLUDED
+
+#include <stddef.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace hue {
+
+class WorkPool {
+public:
+  typedef std::function<void()> Function;
+
+  // A set of tasks which can be waited on
+  class Group {
+  public:
+    Group(WorkPool& pool) : pool_(pool), pending_(0) {}
+    ~Group() { wait(); }
+
+    // Runs f in the pool
+    void spawn(const Function& f);
+
+    // Returns when all tasks spawned into the receiver have finished
+    void wait();
+
+  private:
+    friend class WorkPool;
+    Group(const Group&);
+    Group& operator=(const Group&);
+
+    WorkPool& pool_;
+    std::atomic<size_t> pending_;
+  };
+
+  // Starts a pool with *threadCount* worker threads. A pool with no threads
+  // runs all tasks on the threads waiting for them.
+  explicit WorkPool(size_t threadCount);
+  ~WorkPool();
+
+  // A pool with one thread per hardware thread, started on first use
+  static WorkPool& shared();
+
+  // Number of threads which may run tasks at the same time (the workers and
+  // the thread waiting for a group)
+  size_t concurrency() const { return threads_.size() + 1; }
+
+private:
+  struct Task {
+    Function function;
+    Group* group;
+  };
+
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  WorkPool(const WorkPool&);
+  WorkPool& operator=(const WorkPool&);
+
+  void push(const Task& task);
+  bool runOne();
+  bool pop(Queue& queue, bool back, Task& task);
+  void workerMain(size_t index);
+
+  std::vector<std::thread> threads_;
+  std::vector<Queue*> queues_; // one per worker, followed by the shared queue
+  std::atomic<size_t> queued_; // number of tasks in all queues
+  std::atomic<bool> stop_;
+  std::mutex idleMutex_;
+  std::condition_variable idle_;
+};
+
+} // namespace hue
+#endif // _HUE_RUNTIME_WORK_POOL_INCLUDED
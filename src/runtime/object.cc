@@ -0,0 +1,252 @@
+// Copyright (c) 2012, Rasmus Andersson. All rights reserved. Use of this source
+// code is governed by a MIT-style license that can be found in the LICENSE file.
+#include "object.h"
+
+#include <pthread.h>
+
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace hue {
+
+namespace {
+
+struct QueuedObject {
+  RefCount* refs;
+  void* object;
+  void (*destroy)(void*);
+};
+
+typedef std::vector<QueuedObject, RawAllocator<QueuedObject> > ObjectQueue;
+
+// Objects waiting to be merged by one owner. An owner's record is kept when
+// it exits, and given to the next thread along with its tag.
+struct Owner {
+  std::mutex mutex;
+  ObjectQueue queue;
+  uint32_t id;
+  bool exited;
+  Owner* nextFree;
+  Owner(uint32_t id) : id(id), exited(false), nextFree(0) {}
+};
+
+// Owners by id. Id 1 (FirstTag) is kept for the thread which calls
+// useAtomicRefcounts.
+static std::mutex ownersMutex;
+static Owner* owners[RefCount::MaxOwners + 1];
+static uint32_t ownerCount = 1;
+static Owner* freeOwners = 0;
+
+static pthread_key_t ownerKey;
+static pthread_once_t ownerKeyOnce = PTHREAD_ONCE_INIT;
+
+// Adds the owner's count to the shared count. Called by the owner, or by any
+// thread once the owner has exited. Returns true if the object is unreferenced.
+static bool merge(RefCount* refs) {
+  uint32_t biased = refs->loadLocal() & RefCount::CountMask;
+  refs->storeLocal(0);
+  uint32_t s = refs->loadShared();
+  uint32_t merged;
+  do {
+    merged = (uint32_t)((RefCount::sharedCount(s) + (int32_t)biased) << 2) | RefCount::Merged;
+  } while (!__atomic_compare_exchange_n(&refs->shared, &s, merged, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  return RefCount::sharedCount(merged) == 0;
+}
+
+static void mergeAll(ObjectQueue& queue) {
+  for (size_t i = 0; i < queue.size(); ++i) {
+    if (merge(queue[i].refs)) destroyObject(queue[i].object, queue[i].destroy);
+  }
+}
+
+// Called when a thread exits. Merges its queued objects, makes threads which
+// later release objects it owned merge them themselves, and then frees its
+// tag for another thread.
+static void ownerExit(void* arg) {
+  Owner* owner = (Owner*)arg;
+  // Whatever the thread releases from here on is counted as if by another
+  // thread
+  RefCount::threadTag_ = RefCount::NoOwner;
+  ObjectQueue queue;
+  {
+    std::lock_guard<std::mutex> lock(owner->mutex);
+    owner->exited = true;
+    queue.swap(owner->queue);
+    __atomic_store_n(&RefCount::mergesPending_[owner->id], 0, __ATOMIC_RELAXED);
+  }
+  mergeAll(queue);
+  std::lock_guard<std::mutex> lock(ownersMutex);
+  owner->nextFree = freeOwners;
+  freeOwners = owner;
+}
+
+static void makeOwnerKey() {
+  pthread_key_create(&ownerKey, ownerExit);
+}
+
+// Makes *owner* the calling thread's. Threads which would have merged objects
+// of the previous owner of the tag are done by the time owner->mutex is taken,
+// so the calling thread is the only one to touch their owner's counts.
+static uint32_t becomeOwner(Owner* owner) {
+  {
+    std::lock_guard<std::mutex> lock(owner->mutex);
+    owner->exited = false;
+  }
+  pthread_once(&ownerKeyOnce, makeOwnerKey);
+  pthread_setspecific(ownerKey, owner);
+  RefCount::threadTag_ = owner->id << RefCount::TagShift;
+  return RefCount::threadTag_;
+}
+
+} // namespace
+
+
+bool AtomicRefcounts = false;
+
+void useAtomicRefcounts() {
+  if (AtomicRefcounts) return;
+  // The calling thread has been using objects, which are tagged as owned by
+  // the first thread
+  if (RefCount::threadTag_ == 0) {
+    std::lock_guard<std::mutex> lock(ownersMutex);
+    owners[1] = newRaw<Owner>(1u);
+    becomeOwner(owners[1]);
+  }
+  AtomicRefcounts = true;
+}
+
+__thread uint32_t RefCount::threadTag_ = 0;
+uint8_t RefCount::mergesPending_[RefCount::MaxOwners + 1];
+
+uint32_t RefCount::newThreadTag() {
+  std::lock_guard<std::mutex> lock(ownersMutex);
+  Owner* owner = freeOwners;
+  if (owner != 0) {
+    freeOwners = owner->nextFree;
+  } else if (ownerCount < MaxOwners) {
+    owner = newRaw<Owner>(++ownerCount);
+    owners[owner->id] = owner;
+  } else {
+    threadTag_ = NoOwner;
+    return NoOwner;
+  }
+  return becomeOwner(owner);
+}
+
+void RefCount::mergeQueued() {
+  uint32_t id = threadTag_ >> TagShift;
+  ObjectQueue queue;
+  {
+    std::lock_guard<std::mutex> lock(owners[id]->mutex);
+    queue.swap(owners[id]->queue);
+    __atomic_store_n(&mergesPending_[id], 0, __ATOMIC_RELAXED);
+  }
+  mergeAll(queue);
+}
+
+bool RefCount::releaseLastLocal() {
+  // Give up ownership. From here on the owner counts in the shared count too.
+  storeLocal(0);
+  uint32_t s = __atomic_fetch_or(&shared, Merged, __ATOMIC_ACQ_REL);
+  // A queued object is left for the owner's next merge, which frees it
+  return sharedCount(s) == 0 && (s & Queued) == 0;
+}
+
+bool RefCount::releaseShared(uint32_t l, uint32_t s, void* object, void (*destroy)(void*)) {
+  // Released the last reference of a merged object
+  if (s & Merged) return sharedCount(s) == 0 && (s & Queued) == 0;
+
+  // The owner still holds references, or has already been asked to merge
+  if (sharedCount(s) == 0 || (s & Queued)) return false;
+
+  // A reference counted by the owner was released here. Ask the owner to
+  // merge. Its tag is taken from *l*, since the owner may clear it meanwhile.
+  while (!__atomic_compare_exchange_n(&shared, &s, s | Queued, true,
+                                      __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    if ((s & (Merged | Queued)) || sharedCount(s) >= 0) return false;
+  }
+  uint32_t id = l >> TagShift;
+  Owner* owner = owners[id];
+  std::lock_guard<std::mutex> lock(owner->mutex);
+  if (!owner->exited) {
+    QueuedObject q = { this, object, destroy };
+    owner->queue.push_back(q);
+    __atomic_store_n(&mergesPending_[id], 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  // The tag can't be given to another thread while the lock is held
+  return merge(this);
+}
+
+
+// ------------------------------------------------------
+// Deferred release
+
+// Number of objects destroyed between looking at the clock
+static const size_t DrainCheckInterval = 64;
+
+static pthread_key_t releaseQueueKey;
+static pthread_once_t releaseQueueKeyOnce = PTHREAD_ONCE_INIT;
+
+static void releaseQueueExit(void* arg) {
+  ReleaseQueue* queue = (ReleaseQueue*)arg;
+  ReleaseQueue::current_ = queue;
+  drainReleases();
+  ReleaseQueue::current_ = 0;
+  deallocateRaw(queue->entries, sizeof(ReleaseQueue::Entry) * queue->capacity);
+  deleteRaw(queue);
+}
+
+static void makeReleaseQueueKey() {
+  pthread_key_create(&releaseQueueKey, releaseQueueExit);
+}
+
+__thread ReleaseQueue* ReleaseQueue::current_ = 0;
+
+void ReleaseQueue::grow() {
+  size_t newCapacity = capacity ? capacity * 2 : 256;
+  entries = (Entry*)reallocateRaw(entries, sizeof(Entry) * capacity, sizeof(Entry) * newCapacity);
+  capacity = newCapacity;
+}
+
+void setDeferredRelease(bool deferred) {
+  static __thread ReleaseQueue* queue = 0;
+  if (deferred) {
+    if (queue == 0) {
+      queue = newRaw<ReleaseQueue>();
+      queue->entries = 0;
+      queue->count = 0;
+      queue->capacity = 0;
+      pthread_once(&releaseQueueKeyOnce, makeReleaseQueueKey);
+      pthread_setspecific(releaseQueueKey, queue);
+    }
+    ReleaseQueue::current_ = queue;
+  } else if (ReleaseQueue::current_ != 0) {
+    drainReleases();
+    ReleaseQueue::current_ = 0;
+  }
+}
+
+bool drainReleases(uint64_t budgetNanos) {
+  ReleaseQueue* queue = ReleaseQueue::current_;
+  if (queue == 0) return true;
+  typedef std::chrono::steady_clock Clock;
+  Clock::time_point deadline = Clock::now() + std::chrono::nanoseconds(budgetNanos);
+  size_t n = 0;
+  // Newest first, which keeps the queue short: it holds the siblings of the
+  // objects on one path down the graph rather than a whole level of it
+  while (queue->count != 0) {
+    ReleaseQueue::Entry e = queue->entries[--queue->count];
+    e.destroy(e.object);
+    if (budgetNanos && ++n % DrainCheckInterval == 0 && Clock::now() >= deadline) break;
+  }
+  return queue->count == 0;
+}
+
+size_t pendingReleases() {
+  return ReleaseQueue::current_ ? ReleaseQueue::current_->count : 0;
+}
+
+} // namespace hue
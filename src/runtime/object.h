@@ -7,10 +7,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-// Memory
-#define hue_alloc malloc
-#define hue_realloc realloc
-#define hue_dealloc free
+#include <hue/runtime/Allocator.h>
+#include <hue/runtime/ObjectStats.h>
+#include <hue/runtime/Pool.h>
 
 namespace hue {
 
@@ -23,6 +22,224 @@ typedef uint64_t Ref;
 // objects of the same kind.
 static const Ref Unretainable = UINT64_MAX;
 
+// Whether threads other than the first may use objects. While a program has
+// only one thread, retain and release skip checking which thread owns an
+// object (see RefCount). The runtime turns this on before it starts a second
+// thread (see WorkPool); code which starts threads of its own must call
+// useAtomicRefcounts first, from the thread which has been using objects.
+// Defining HUE_ATOMIC_REFCOUNTS when building makes it always on.
+extern bool AtomicRefcounts;
+void useAtomicRefcounts();
+
+#ifdef HUE_ATOMIC_REFCOUNTS
+#define _HUE_ATOMIC_REFCOUNTS true
+#else
+#define _HUE_ATOMIC_REFCOUNTS hue::AtomicRefcounts
+#endif
+
+// Reference counts are biased towards the thread which allocated an object,
+// its owner. The owner counts its references with plain loads and stores, and
+// other threads count theirs with atomic operations on a separate, shared
+// count. Objects which are only used by one thread -- which is most of them,
+// and all of them in a program with one thread -- never pay for atomics, and
+// threads reading an object owned by another thread don't write to the
+// owner's half of the counter.
+//
+// When the owner's count drops to zero, the object is "merged": the owner
+// gives it up and all references are counted in the shared count from then
+// on. When another thread releases a reference which was counted by the
+// owner, the shared count goes below zero and the object is queued for its
+// owner to merge. The owner does this the next time it allocates an object,
+// or when it exits. Objects owned by a thread which has exited are merged by
+// the thread which would have queued them.
+//
+// Owners are told apart by a 16-bit tag, which is given to the next thread
+// once its owner has exited; the new thread then owns the objects which are
+// still tagged with it. Threads started while more than MaxOwners threads are
+// running don't own objects, and count all their references atomically.
+//
+// The two counts share the 64-bit refcount_ word, so objects are laid out
+// as if they had a plain counter and Unretainable (all bits set) still works.
+struct RefCount {
+  uint32_t local;  // owner tag (16 bits) and the owner's count (16 bits)
+  uint32_t shared; // shared count (30 bits, signed) and Merged and Queued flags
+
+  static const uint32_t TagShift = 16;
+  static const uint32_t CountMask = 0x0000ffff;
+  static const uint32_t TagMask = 0xffff0000;
+  // Tag of threads which don't own objects. Objects they allocate have no owner.
+  static const uint32_t NoOwner = 0xffff0000;
+  static const uint32_t MaxOwners = 65534;
+  // Tag of the thread which used objects before AtomicRefcounts was turned on
+  static const uint32_t FirstTag = 1 << TagShift;
+
+  static const uint32_t Merged = 1;    // owner's count has been added to the shared count
+  static const uint32_t Queued = 2;    // waiting for the owner to merge
+  static const uint32_t SharedOne = 4; // one reference in the shared count
+
+  static inline int32_t sharedCount(uint32_t shared) { return (int32_t)shared >> 2; }
+
+  // Tag of the calling thread, or 0 if it has none yet. The runtime library
+  // is never loaded with dlopen, so the tag can use the cheaper initial-exec
+  // TLS model; the default would make every retain and release call a function.
+  static __thread uint32_t threadTag_ __attribute__((tls_model("initial-exec")));
+  static uint32_t newThreadTag();
+  static inline uint32_t threadTag() {
+    uint32_t tag = threadTag_;
+    return (tag != 0) ? tag : newThreadTag();
+  }
+
+  // Set by other threads when objects are queued for owner i
+  static uint8_t mergesPending_[MaxOwners + 1];
+  static void mergeQueued();
+  static inline void mergePending(uint32_t tag) {
+    if (tag != 0 && tag != NoOwner &&
+        __atomic_load_n(&mergesPending_[tag >> TagShift], __ATOMIC_RELAXED)) {
+      mergeQueued();
+    }
+  }
+
+  inline uint32_t loadLocal() const { return __atomic_load_n(&local, __ATOMIC_RELAXED); }
+  inline void storeLocal(uint32_t v) { __atomic_store_n(&local, v, __ATOMIC_RELAXED); }
+  inline uint32_t loadShared() const { return __atomic_load_n(&shared, __ATOMIC_ACQUIRE); }
+
+  // True if the calling thread owns an object whose local half is *l*. The
+  // only thread is the first one until AtomicRefcounts is turned on.
+  static inline bool isOwner(uint32_t l) {
+    return (l & TagMask) == (_HUE_ATOMIC_REFCOUNTS ? threadTag() : FirstTag);
+  }
+
+  // Sets the count of a new object to 1, owned by the calling thread
+  inline void init() {
+    if (!_HUE_ATOMIC_REFCOUNTS) {
+      local = FirstTag | 1;
+      shared = 0;
+      return;
+    }
+    uint32_t tag = threadTag();
+    if (tag == NoOwner) {
+      local = 0;
+      shared = SharedOne | Merged;
+      return;
+    }
+    mergePending(tag);
+    local = tag | 1;
+    shared = 0;
+  }
+
+  inline void retain() {
+    uint32_t l = loadLocal();
+    if (l == UINT32_MAX) return; // Unretainable
+    if (isOwner(l) && (l & CountMask) != CountMask) {
+      storeLocal(l + 1);
+    } else {
+      __atomic_fetch_add(&shared, SharedOne, __ATOMIC_RELAXED);
+    }
+  }
+
+  // Returns true if that was the last reference. *destroy* is called with
+  // *object* if the object is queued and later found to be unreferenced.
+  inline bool release(void* object, void (*destroy)(void*)) {
+    uint32_t l = loadLocal();
+    if (l == UINT32_MAX) return false; // Unretainable
+    if (isOwner(l)) {
+      if ((l & CountMask) != 1) {
+        storeLocal(l - 1);
+        return false;
+      }
+      // No other thread holds a reference, so none can take one
+      if (loadShared() == 0) return true;
+      return releaseLastLocal();
+    }
+    uint32_t s = __atomic_sub_fetch(&shared, SharedOne, __ATOMIC_ACQ_REL);
+    if (sharedCount(s) > 0) return false;
+    return releaseShared(l, s, object, destroy);
+  }
+
+  bool releaseLastLocal();
+  bool releaseShared(uint32_t l, uint32_t s, void* object, void (*destroy)(void*));
+
+  // Number of references. Only exact when no other thread changes them.
+  inline int64_t count() const {
+    if (loadLocal() == UINT32_MAX) return -1;
+    return (int64_t)(loadLocal() & CountMask) + sharedCount(loadShared());
+  }
+
+  // True if the caller holds the only reference. Since no other thread can
+  // then retain the object, this is exact.
+  inline bool isUnique() const {
+    uint32_t l = loadLocal();
+    uint32_t s = loadShared();
+    return l != UINT32_MAX && (s & Queued) == 0 && (l & CountMask) + sharedCount(s) == 1;
+  }
+};
+
+// Objects are normally destroyed when their last reference is released,
+// which releases the objects they reference, and so on: releasing the last
+// reference to a large vector frees all of its nodes there and then. A thread
+// can defer this instead. Objects whose last reference it releases are then
+// pushed onto the thread's release queue and destroyed by drainReleases,
+// which can be given a time budget. Destroying a queued object queues the
+// objects it frees in turn, so releasing a graph of any size takes constant
+// stack and can be spread over many calls. Objects allocated in a Region are
+// still destroyed at once, since the region may free them before the queue
+// is drained.
+//
+//   setDeferredRelease(true);
+//   v->release();                // returns at once
+//   while (!drainReleases(100000)) handleOtherWork(); // ~0.1 ms at a time
+//
+struct ReleaseQueue {
+  struct Entry {
+    void* object;
+    void (*destroy)(void*);
+  };
+  Entry* entries;
+  size_t count;
+  size_t capacity;
+
+  inline void push(void* object, void (*destroy)(void*)) {
+    if (count == capacity) grow();
+    entries[count].object = object;
+    entries[count].destroy = destroy;
+    ++count;
+  }
+  void grow();
+
+  // The calling thread's queue, if it defers releases
+  static __thread ReleaseQueue* current_ __attribute__((tls_model("initial-exec")));
+};
+
+// Destroys an object which is no longer referenced, or queues it. Objects
+// from the thread's regions are never queued, since a region may be gone
+// before its objects are drained.
+inline void destroyObject(void* object, void (*destroy)(void*)) {
+  ReleaseQueue* queue = ReleaseQueue::current_;
+  if (queue != 0 && !(Region::current_ != 0 && Region::owns(object))) {
+    queue->push(object, destroy);
+  } else {
+    destroy(object);
+  }
+}
+
+// Turns deferred release on or off for the calling thread. Turning it off
+// destroys any objects still queued. A thread's queue is also drained when
+// the thread exits.
+void setDeferredRelease(bool deferred);
+
+// Destroys queued objects until the queue is empty or about *budgetNanos*
+// nanoseconds have passed (no limit if 0). Returns true if the queue is empty.
+bool drainReleases(uint64_t budgetNanos = 0);
+
+// Number of objects in the calling thread's queue
+size_t pendingReleases();
+
+// Merges the objects which other threads have queued for the calling thread,
+// freeing the ones which are no longer referenced. This happens by itself
+// when the thread allocates an object or exits; call it to have it happen
+// sooner, like after waiting for other threads.
+inline void mergeQueuedReleases() { RefCount::mergePending(RefCount::threadTag_); }
+
 // Reference ownership rules
 typedef enum {
   RetainReference = 0, // ownership is retained (reference count is increased by the receiver)
@@ -30,27 +247,59 @@ typedef enum {
 } RefRule;
 
 // Implements the functions and data needed for a class to become reference counted.
-// Messy, but it works...
-#define HUE_OBJECT(T) \
+// Objects are allocated with hue::allocate (see Allocator.h) and must be
+// sizeof(T) bytes. Messy, but it works...
+#define HUE_OBJECT(T) _HUE_OBJECT(T, hue::allocate(size), hue::deallocate(this, sizeof(T)), \
+                                  sizeof(T))
+
+// Like HUE_OBJECT but allocates the object from the size-class pool (see Pool.h).
+// The class must implement "size_t allocSize() const" which returns the size
+// that was passed to __alloc.
+#define HUE_POOLED_OBJECT(T) _HUE_OBJECT(T, hue::Pool::alloc(size), \
+                                         hue::Pool::dealloc(this, this->allocSize()), \
+                                         this->allocSize())
+
+// Allocations, frees, retains and releases are counted per type (see
+// ObjectStats.h). SIZE is the size the object was allocated with.
+#define _HUE_OBJECT(T, ALLOC, DEALLOC, SIZE) \
 public: \
-  Ref refcount_; \
+  union { \
+    Ref refcount_; \
+    hue::RefCount refs_; \
+  }; \
+  static const char* __typeName() { return __PRETTY_FUNCTION__; } \
 private: \
+  static inline hue::ObjectStats::Counters& __stats() { \
+    return hue::ObjectStats::counters(hue::ObjectType<T>::type); \
+  } \
   static T* __alloc(size_t size = sizeof(T)) { \
-    T* obj = (T*)hue_alloc(size); \
-    obj->refcount_ = 1; \
+    T* obj = (T*)ALLOC; \
+    obj->refs_.init(); \
+    hue::ObjectStats::Counters& stats = __stats(); \
+    stats.allocCount.add(); \
+    stats.allocBytes.add(size); \
     return obj; \
   } \
+  void __destroy() { \
+    hue::ObjectStats::Counters& stats = __stats(); \
+    stats.deallocCount.add(); \
+    stats.deallocBytes.add(SIZE); \
+    dealloc(); \
+    DEALLOC; \
+  } \
+  static void __destroyObject(void* obj) { ((T*)obj)->__destroy(); } \
 public: \
   inline T* retain() { \
-    if (refcount_ != hue::Unretainable) __sync_add_and_fetch(&refcount_, 1); \
+    __stats().retainCount.add(); \
+    refs_.retain(); \
     return this; \
   } \
   inline void release() { \
-    if (refcount_ != hue::Unretainable && __sync_sub_and_fetch(&refcount_, 1) == 0) { \
-      dealloc(); \
-      hue_dealloc(this); \
-    } \
+    __stats().releaseCount.add(); \
+    if (refs_.release(this, &T::__destroyObject)) hue::destroyObject(this, &T::__destroyObject); \
   } \
+  /* True if the caller holds the only reference */ \
+  inline bool isUnique() const { return refs_.isUnique(); } \
 protected:
 
 
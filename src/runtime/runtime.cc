@@ -6,6 +6,7 @@
 
 #include "../utf8/unchecked.h"
 #include "runtime.h"
+#include "Vector.h"
 
 #include <unistd.h>
 #include <string>
@@ -42,3 +43,117 @@ void stdout_write(const TextS text) {
 }
 
 } // namespace hue
+
+// ------------------------------------------------------
+// Memory
+
+void hue_use_atomic_refcounts() {
+  hue::useAtomicRefcounts();
+}
+
+int hue_install_allocator(const hue::Allocator* allocator) {
+  return hue::Allocator::install(*allocator) ? 1 : 0;
+}
+
+hue::Region* hue_region_begin() {
+  return hue::newRaw<hue::Region>();
+}
+
+void hue_region_end(hue::Region* region) {
+  hue::deleteRaw(region);
+}
+
+void hue_set_deferred_release(int deferred) {
+  hue::setDeferredRelease(deferred != 0);
+}
+
+int hue_drain_releases(int64_t budget_ns) {
+  return hue::drainReleases(budget_ns > 0 ? (uint64_t)budget_ns : 0) ? 1 : 0;
+}
+
+size_t hue_object_stats(hue::ObjectStats::Totals* totals, size_t capacity) {
+  return hue::ObjectStats::collect(totals, capacity);
+}
+
+void hue_dump_object_stats(FILE* f) {
+  hue::ObjectStats::dump(f);
+}
+
+// ------------------------------------------------------
+// Vectors
+
+using hue::Vector;
+using hue::VectorRef;
+
+Vector* hue_vector_create(void* const* items, int64_t count) {
+  return Vector::fromArray(items, (size_t)count);
+}
+
+Vector* hue_vector_append(Vector* v, void* item) {
+  return v->append(item);
+}
+
+int64_t hue_vector_count(const Vector* v) {
+  return (int64_t)v->count();
+}
+
+static void checkIndex(int64_t i, size_t count) {
+  if (i < 0 || (uint64_t)i >= count) {
+    fprintf(stderr, "hue: index %lld out of range of vector of %lld items\n",
+            (long long)i, (long long)count);
+    abort();
+  }
+}
+
+void* hue_vector_item_at(const Vector* v, int64_t i) {
+  checkIndex(i, v->count());
+  return v->itemAt((size_t)i);
+}
+
+int64_t hue_vector_chunk_at(const Vector* v, int64_t i, void* const** items) {
+  if (i < 0 || (uint64_t)i >= v->count()) return 0;
+  return (int64_t)v->chunkAt((size_t)i, *items);
+}
+
+Vector* hue_vector_retain(Vector* v) {
+  return v->retain();
+}
+
+void hue_vector_release(Vector* v) {
+  v->release();
+}
+
+void hue_vector_ref_create(void* const* items, int64_t count, VectorRef* out) {
+  Vector* v = Vector::fromArray(items, (size_t)count);
+  *out = VectorRef(v);
+  v->release();
+}
+
+void hue_vector_ref_append(const VectorRef* v, void* item, VectorRef* out) {
+  *out = v->append(item);
+}
+
+void hue_vector_ref_append_and_release(VectorRef* v, void* item) {
+  *v = v->appendAndRelease(item);
+}
+
+void* hue_vector_ref_item_at(const VectorRef* v, int64_t i) {
+  checkIndex(i, v->count());
+  return v->itemAt((size_t)i);
+}
+
+Vector* hue_vector_ref_box(const VectorRef* v) {
+  return v->box();
+}
+
+void hue_vector_ref_unbox(const Vector* v, VectorRef* out) {
+  *out = VectorRef(v);
+}
+
+void hue_vector_ref_retain(const VectorRef* v) {
+  v->retain();
+}
+
+void hue_vector_ref_release(VectorRef* v) {
+  v->release();
+}
@@ -0,0 +1,570 @@
+#include "../src/runtime/Vector.h"
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+using std::cerr;
+using std::cout;
+using std::endl;
+using namespace hue;
+
+// Benchmarks of Vector next to std::vector and a plain array:
+//
+//   bench_vector [N [repetitions [warmups]]]
+//
+// Each benchmark runs *warmups* times untimed and then *repetitions* times on
+// N items. Operations are timed in batches of BatchSize, and the median and
+// 99th percentile are taken over the time per operation of all batches of all
+// repetitions. Operations which only make sense as a whole (like building or
+// releasing all N items) are timed as one batch. Results are written to
+// stderr as text and to stdout as JSON, which "make bench" keeps so that runs
+// can be compared.
+
+static const size_t BatchSize = 1024;
+
+typedef std::chrono::steady_clock Clock;
+
+// Collects the time per operation of each batch
+class Sampler {
+public:
+  Sampler() : recording_(false), totalNs_(0), totalOps_(0) {}
+
+  void setRecording(bool recording) { recording_ = recording; }
+
+  inline void start() { start_ = Clock::now(); }
+  inline void stop(size_t ops) {
+    Clock::time_point end = Clock::now();
+    if (!recording_ || ops == 0) return;
+    double ns = std::chrono::duration<double, std::nano>(end - start_).count();
+    samples_.push_back(ns / ops);
+    totalNs_ += ns;
+    totalOps_ += ops;
+  }
+
+  std::vector<double>& samples() { return samples_; }
+  double mean() const { return totalOps_ ? totalNs_ / totalOps_ : 0; }
+  size_t ops() const { return totalOps_; }
+
+private:
+  bool recording_;
+  Clock::time_point start_;
+  std::vector<double> samples_;
+  double totalNs_;
+  size_t totalOps_;
+};
+
+// Data shared by the benchmarks. All containers hold the items 0, 2, 4, ...
+struct Fixture {
+  size_t n;
+  Vector* vector;
+  std::vector<void*> stdVector;
+  void** array;
+  size_t* randomIndices;
+};
+
+// Keeps the compiler from discarding the work being timed
+static uint64_t sink = 0;
+
+static inline void* itemFor(size_t i) { return (void*)(i * 2); }
+
+// Runs body(i, end) over [0, n) in batches, timing each batch
+template <typename Body>
+static inline void batched(Sampler& s, size_t n, Body body) {
+  for (size_t i = 0; i < n; i += BatchSize) {
+    size_t end = std::min(n, i + BatchSize);
+    s.start();
+    body(i, end);
+    s.stop(end - i);
+  }
+}
+
+// ---- append
+
+static void appendVector(Sampler& s, Fixture& f) {
+  Vector* v = Vector::Empty;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) {
+      Vector* oldV = v;
+      v = v->append(itemFor(i));
+      oldV->release();
+    }
+  });
+  sink += v->count();
+  v->release();
+}
+
+static void appendAndReleaseVector(Sampler& s, Fixture& f) {
+  Vector* v = Vector::Empty;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) v = v->appendAndRelease(itemFor(i));
+  });
+  sink += v->count();
+  v->release();
+}
+
+static void appendVectorRef(Sampler& s, Fixture& f) {
+  VectorRef v;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) {
+      VectorRef oldV = v;
+      v = v.append(itemFor(i));
+      oldV.release();
+    }
+  });
+  sink += v.count();
+  v.release();
+}
+
+static void appendAndReleaseVectorRef(Sampler& s, Fixture& f) {
+  VectorRef v;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) v = v.appendAndRelease(itemFor(i));
+  });
+  sink += v.count();
+  v.release();
+}
+
+static void appendTransient(Sampler& s, Fixture& f) {
+  Vector::Transient* t = Vector::Empty->asTransient();
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) t->append(itemFor(i));
+  });
+  sink += t->count();
+  t->release();
+}
+
+static void appendStdVector(Sampler& s, Fixture& f) {
+  std::vector<void*> v;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) v.push_back(itemFor(i));
+  });
+  sink += v.size();
+}
+
+static void appendArray(Sampler& s, Fixture& f) {
+  void** a = (void**)malloc(sizeof(void*) * f.n);
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) a[i] = itemFor(i);
+  });
+  sink += (uint64_t)a[f.n - 1];
+  free(a);
+}
+
+// ---- bulk build
+
+static void buildVector(Sampler& s, Fixture& f) {
+  s.start();
+  Vector* v = Vector::fromArray(f.array, f.n);
+  s.stop(f.n);
+  sink += v->count();
+  v->release();
+}
+
+static void buildStdVector(Sampler& s, Fixture& f) {
+  s.start();
+  std::vector<void*> v(f.array, f.array + f.n);
+  s.stop(f.n);
+  sink += v.size();
+}
+
+static void buildArray(Sampler& s, Fixture& f) {
+  s.start();
+  void** a = (void**)malloc(sizeof(void*) * f.n);
+  memcpy(a, f.array, sizeof(void*) * f.n);
+  s.stop(f.n);
+  sink += (uint64_t)a[f.n - 1];
+  free(a);
+}
+
+// ---- sequential iteration
+
+static void iterateVectorItemAt(Sampler& s, Fixture& f) {
+  uint64_t sum = 0;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) sum += (uint64_t)f.vector->itemAt(i);
+  });
+  sink += sum;
+}
+
+static void iterateVectorChunks(Sampler& s, Fixture& f) {
+  uint64_t sum = 0;
+  void* const* chunk;
+  size_t length;
+  s.start();
+  Vector::ChunkIterator it(f.vector);
+  while (it.next(chunk, length)) {
+    for (size_t i = 0; i < length; ++i) sum += (uint64_t)chunk[i];
+  }
+  s.stop(f.n);
+  sink += sum;
+}
+
+static void iterateStdVector(Sampler& s, Fixture& f) {
+  uint64_t sum = 0;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) sum += (uint64_t)f.stdVector[i];
+  });
+  sink += sum;
+}
+
+static void iterateArray(Sampler& s, Fixture& f) {
+  uint64_t sum = 0;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) sum += (uint64_t)f.array[i];
+  });
+  sink += sum;
+}
+
+// ---- random access
+
+static void randomVectorItemAt(Sampler& s, Fixture& f) {
+  uint64_t sum = 0;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) sum += (uint64_t)f.vector->itemAt(f.randomIndices[i]);
+  });
+  sink += sum;
+}
+
+static void randomVectorItemsAt(Sampler& s, Fixture& f) {
+  uint64_t sum = 0;
+  void* items[BatchSize];
+  batched(s, f.n, [&](size_t i, size_t end) {
+    f.vector->itemsAt(f.randomIndices + i, end - i, items);
+    for (size_t j = 0; j < end - i; ++j) sum += (uint64_t)items[j];
+  });
+  sink += sum;
+}
+
+static void randomStdVector(Sampler& s, Fixture& f) {
+  uint64_t sum = 0;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) sum += (uint64_t)f.stdVector[f.randomIndices[i]];
+  });
+  sink += sum;
+}
+
+static void randomArray(Sampler& s, Fixture& f) {
+  uint64_t sum = 0;
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) sum += (uint64_t)f.array[f.randomIndices[i]];
+  });
+  sink += sum;
+}
+
+// ---- assoc (replacing items at random indices)
+
+static void assocVector(Sampler& s, Fixture& f) {
+  Vector* v = f.vector->retain();
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) {
+      Vector* oldV = v;
+      v = v->assoc(f.randomIndices[i], (void*)i);
+      oldV->release();
+    }
+  });
+  sink += v->count();
+  v->release();
+}
+
+static void assocStdVector(Sampler& s, Fixture& f) {
+  std::vector<void*> v(f.stdVector);
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) v[f.randomIndices[i]] = (void*)i;
+  });
+  sink += (uint64_t)v[0];
+}
+
+static void assocArray(Sampler& s, Fixture& f) {
+  void** a = (void**)malloc(sizeof(void*) * f.n);
+  memcpy(a, f.array, sizeof(void*) * f.n);
+  batched(s, f.n, [&](size_t i, size_t end) {
+    for (; i < end; ++i) a[f.randomIndices[i]] = (void*)i;
+  });
+  sink += (uint64_t)a[0];
+  free(a);
+}
+
+// ---- concat (of the N items with themselves)
+
+static void concatVector(Sampler& s, Fixture& f) {
+  static const size_t Rounds = 32;
+  for (size_t r = 0; r < Rounds; ++r) {
+    s.start();
+    for (size_t i = 0; i < Rounds; ++i) {
+      Vector* c = f.vector->concat(f.vector);
+      sink += c->count();
+      c->release();
+    }
+    s.stop(Rounds);
+  }
+}
+
+static void concatStdVector(Sampler& s, Fixture& f) {
+  s.start();
+  std::vector<void*> c;
+  c.reserve(f.n * 2);
+  c.insert(c.end(), f.stdVector.begin(), f.stdVector.end());
+  c.insert(c.end(), f.stdVector.begin(), f.stdVector.end());
+  sink += c.size();
+  std::vector<void*>().swap(c);
+  s.stop(1);
+}
+
+static void concatArray(Sampler& s, Fixture& f) {
+  s.start();
+  void** c = (void**)malloc(sizeof(void*) * f.n * 2);
+  memcpy(c, f.array, sizeof(void*) * f.n);
+  memcpy(c + f.n, f.array, sizeof(void*) * f.n);
+  sink += (uint64_t)c[f.n];
+  free(c);
+  s.stop(1);
+}
+
+// ---- release (of all N items)
+
+static void releaseVector(Sampler& s, Fixture& f) {
+  Vector* v = Vector::Empty;
+  for (size_t i = 0; i < f.n; ++i) v = v->appendAndRelease(itemFor(i));
+  s.start();
+  v->release();
+  s.stop(f.n);
+}
+
+// Deferred release drained 0.1 ms at a time. Each sample is the length of one
+// drainReleases call rather than the time per item, so the p99 and max are
+// the longest pauses.
+static void releaseVectorDeferred(Sampler& s, Fixture& f) {
+  Vector* v = Vector::Empty;
+  for (size_t i = 0; i < f.n; ++i) v = v->appendAndRelease(itemFor(i));
+  setDeferredRelease(true);
+  v->release();
+  bool done = false;
+  while (!done) {
+    s.start();
+    done = drainReleases(100000);
+    s.stop(1);
+  }
+  setDeferredRelease(false);
+}
+
+static void releaseStdVector(Sampler& s, Fixture& f) {
+  std::vector<void*>* v = new std::vector<void*>(f.stdVector);
+  s.start();
+  delete v;
+  s.stop(f.n);
+}
+
+static void releaseArray(Sampler& s, Fixture& f) {
+  void** a = (void**)malloc(sizeof(void*) * f.n);
+  memcpy(a, f.array, sizeof(void*) * f.n);
+  s.start();
+  free(a);
+  s.stop(f.n);
+}
+
+// ---- share (threads using the fixture's vector, which main owns)
+
+// Runs body(i, end) over [0, n) split between *threads* threads, timed as one
+// batch. With no contention the time per operation drops as threads are added
+// (up to the number of cores).
+template <typename Body>
+static void onThreads(Sampler& s, size_t n, size_t threads, Body body) {
+  useAtomicRefcounts();
+  std::vector<std::thread> workers;
+  s.start();
+  for (size_t t = 0; t < threads; ++t) {
+    workers.push_back(std::thread(body, n * t / threads, n * (t + 1) / threads));
+  }
+  for (size_t t = 0; t < threads; ++t) workers[t].join();
+  s.stop(n);
+}
+
+static inline void retainAndRead(Vector* v, const size_t* indices, size_t i, size_t end) {
+  uint64_t sum = 0;
+  for (; i < end; ++i) {
+    v->retain();
+    sum += (uint64_t)v->itemAt(indices[i]);
+    v->release();
+  }
+  __sync_add_and_fetch(&sink, sum);
+}
+
+static void shareOwner(Sampler& s, Fixture& f) {
+  batched(s, f.n, [&](size_t i, size_t end) { retainAndRead(f.vector, f.randomIndices, i, end); });
+}
+
+static void shareReaders(Sampler& s, Fixture& f, size_t threads) {
+  onThreads(s, f.n, threads, [&](size_t i, size_t end) {
+    retainAndRead(f.vector, f.randomIndices, i, end);
+  });
+}
+
+static void shareReaders1(Sampler& s, Fixture& f) { shareReaders(s, f, 1); }
+static void shareReaders2(Sampler& s, Fixture& f) { shareReaders(s, f, 2); }
+static void shareReaders4(Sampler& s, Fixture& f) { shareReaders(s, f, 4); }
+
+// Each append copies the path to the tail, retaining the nodes beside it
+static void shareAppenders(Sampler& s, Fixture& f, size_t threads) {
+  onThreads(s, f.n, threads, [&](size_t i, size_t end) {
+    uint64_t sum = 0;
+    for (; i < end; ++i) {
+      Vector* v = f.vector->append(itemFor(i));
+      sum += v->count();
+      v->release();
+    }
+    __sync_add_and_fetch(&sink, sum);
+  });
+}
+
+// The append benchmarks again, once threads may share objects. This can't be
+// undone, so it runs after all the single-threaded benchmarks.
+static void appendVectorThreaded(Sampler& s, Fixture& f) {
+  useAtomicRefcounts();
+  appendVector(s, f);
+}
+
+static void appendVectorRefThreaded(Sampler& s, Fixture& f) {
+  useAtomicRefcounts();
+  appendVectorRef(s, f);
+}
+
+static void shareAppenders1(Sampler& s, Fixture& f) { shareAppenders(s, f, 1); }
+static void shareAppenders4(Sampler& s, Fixture& f) { shareAppenders(s, f, 4); }
+
+struct Benchmark {
+  const char* group;
+  const char* name;
+  void (*run)(Sampler&, Fixture&);
+};
+
+static const Benchmark benchmarks[] = {
+  { "append",  "Vector::append",            appendVector },
+  { "append",  "Vector::appendAndRelease",  appendAndReleaseVector },
+  { "append",  "VectorRef::append",         appendVectorRef },
+  { "append",  "VectorRef::appendAndRelease", appendAndReleaseVectorRef },
+  { "append",  "Vector::Transient::append", appendTransient },
+  { "append",  "std::vector::push_back",    appendStdVector },
+  { "append",  "array",                     appendArray },
+  { "build",   "Vector::fromArray",         buildVector },
+  { "build",   "std::vector",               buildStdVector },
+  { "build",   "array",                     buildArray },
+  { "iterate", "Vector::itemAt",            iterateVectorItemAt },
+  { "iterate", "Vector::ChunkIterator",     iterateVectorChunks },
+  { "iterate", "std::vector",               iterateStdVector },
+  { "iterate", "array",                     iterateArray },
+  { "random",  "Vector::itemAt",            randomVectorItemAt },
+  { "random",  "Vector::itemsAt",           randomVectorItemsAt },
+  { "random",  "std::vector",               randomStdVector },
+  { "random",  "array",                     randomArray },
+  { "assoc",   "Vector::assoc",             assocVector },
+  { "assoc",   "std::vector",               assocStdVector },
+  { "assoc",   "array",                     assocArray },
+  { "concat",  "Vector::concat",            concatVector },
+  { "concat",  "std::vector",               concatStdVector },
+  { "concat",  "array",                     concatArray },
+  { "release", "Vector::release",           releaseVector },
+  { "release", "Vector::release, deferred (ns per 0.1 ms drain)", releaseVectorDeferred },
+  { "release", "std::vector",               releaseStdVector },
+  { "release", "array",                     releaseArray },
+  { "append",  "Vector::append, threads on",        appendVectorThreaded },
+  { "append",  "VectorRef::append, threads on",     appendVectorRefThreaded },
+  { "share",   "retain+itemAt+release, owner",      shareOwner },
+  { "share",   "retain+itemAt+release, 1 reader",   shareReaders1 },
+  { "share",   "retain+itemAt+release, 2 readers",  shareReaders2 },
+  { "share",   "retain+itemAt+release, 4 readers",  shareReaders4 },
+  { "share",   "Vector::append, 1 thread",          shareAppenders1 },
+  { "share",   "Vector::append, 4 threads",         shareAppenders4 },
+};
+
+// Returns the p:th quantile (0-1) of sorted samples, using the nearest rank
+static double quantile(const std::vector<double>& sorted, double p) {
+  if (sorted.empty()) return 0;
+  size_t rank = (size_t)(p * sorted.size() + 0.999999);
+  return sorted[std::max((size_t)1, std::min(rank, sorted.size())) - 1];
+}
+
+int main(int argc, char **argv) {
+  size_t N = (argc > 1) ? atoll(argv[1]) : 1000000;
+  size_t R = (argc > 2) ? atoll(argv[2]) : 10;
+  size_t W = (argc > 3) ? atoll(argv[3]) : 1;
+  assert(N > 0 && R > 0);
+
+  Fixture f;
+  f.n = N;
+  f.array = (void**)malloc(sizeof(void*) * N);
+  f.randomIndices = (size_t*)malloc(sizeof(size_t) * N);
+  uint64_t r = 88172645463325252ull;
+  for (size_t i = 0; i < N; ++i) {
+    f.array[i] = itemFor(i);
+    r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+    f.randomIndices[i] = r % N;
+  }
+  f.stdVector.assign(f.array, f.array + N);
+  f.vector = Vector::Empty;
+  for (size_t i = 0; i < N; ++i) f.vector = f.vector->appendAndRelease(itemFor(i));
+
+  cout.precision(6);
+  cout << "{\n  \"benchmark\": \"vector\", \"n\": " << N << ", \"repetitions\": " << R
+       << ", \"warmups\": " << W << ", \"batch_size\": " << BatchSize << ",\n  \"results\": [";
+
+  size_t count = sizeof(benchmarks) / sizeof(benchmarks[0]);
+  for (size_t bi = 0; bi < count; ++bi) {
+    const Benchmark& b = benchmarks[bi];
+    Sampler s;
+    for (size_t i = 0; i < W; ++i) b.run(s, f);
+    s.setRecording(true);
+    for (size_t i = 0; i < R; ++i) b.run(s, f);
+
+    std::vector<double>& samples = s.samples();
+    std::sort(samples.begin(), samples.end());
+    double median = quantile(samples, 0.5);
+    double p99 = quantile(samples, 0.99);
+
+    cerr << b.group << " " << b.name << ": median " << median << " ns/op, p99 " << p99
+         << " ns/op, mean " << s.mean() << " ns/op (" << samples.size() << " samples)" << endl;
+    cout << (bi ? ",\n" : "\n") << "    { \"group\": \"" << b.group << "\", \"name\": \"" << b.name
+         << "\", \"ops\": " << s.ops() << ", \"samples\": " << samples.size()
+         << ", \"mean_ns\": " << s.mean() << ", \"median_ns\": " << median
+         << ", \"p99_ns\": " << p99 << ", \"min_ns\": " << samples.front()
+         << ", \"max_ns\": " << samples.back() << " }";
+  }
+
+  // Memory per item. Vectors built in different ways differ in how full
+  // their nodes are.
+  cout << "\n  ],\n  \"memory\": [";
+  Vector* appended = Vector::Empty;
+  for (size_t i = 0; i < N; ++i) {
+    Vector* oldV = appended;
+    appended = appended->append(itemFor(i));
+    oldV->release();
+  }
+  Vector* built = Vector::fromArray(f.array, N);
+  std::vector<void*> pushed;
+  for (size_t i = 0; i < N; ++i) pushed.push_back(itemFor(i));
+  struct { const char* name; size_t bytes; } memory[] = {
+    { "Vector::append",           appended->memoryUsage().bytes },
+    { "Vector::appendAndRelease", f.vector->memoryUsage().bytes },
+    { "Vector::fromArray",        built->memoryUsage().bytes },
+    { "std::vector::push_back",   sizeof(pushed) + sizeof(void*) * pushed.capacity() },
+    { "array",                    sizeof(void*) * N },
+  };
+  for (size_t i = 0; i < sizeof(memory) / sizeof(memory[0]); ++i) {
+    double perItem = (double)memory[i].bytes / N;
+    cerr << "memory " << memory[i].name << ": " << perItem << " bytes/item" << endl;
+    cout << (i ? ",\n" : "\n") << "    { \"name\": \"" << memory[i].name << "\", \"bytes\": "
+         << memory[i].bytes << ", \"bytes_per_item\": " << perItem << " }";
+  }
+  cout << "\n  ],\n  \"checksum\": " << sink << "\n}" << endl;
+
+  appended->release();
+  built->release();
+  f.vector->release();
+  free(f.array);
+  free(f.randomIndices);
+  return 0;
+}
@@ -0,0 +1,232 @@
+#include "../src/runtime/Vector.h"
+#include "../src/runtime/runtime.h"
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using namespace hue;
+
+// An allocator which counts what goes through it and hands the rest to malloc
+struct Tracking {
+  size_t allocCount;
+  size_t deallocCount;
+  size_t liveBytes;
+};
+
+static void* trackingAlloc(void* context, size_t size) {
+  Tracking* t = (Tracking*)context;
+  ++t->allocCount;
+  t->liveBytes += size;
+  return Allocator::System.alloc(0, size);
+}
+
+static void* trackingRealloc(void* context, void* ptr, size_t oldSize, size_t size) {
+  Tracking* t = (Tracking*)context;
+  t->liveBytes += size - oldSize;
+  return Allocator::System.realloc(0, ptr, oldSize, size);
+}
+
+static void trackingDealloc(void* context, void* ptr, size_t size) {
+  Tracking* t = (Tracking*)context;
+  ++t->deallocCount;
+  t->liveBytes -= size;
+  Allocator::System.dealloc(0, ptr, size);
+}
+
+static size_t live_toy_count = 0;
+
+class Toy { HUE_OBJECT(Toy)
+public:
+  uint64_t value;
+  static Toy* create(uint64_t value) {
+    Toy* obj = __alloc();
+    obj->value = value;
+    ++live_toy_count;
+    return obj;
+  }
+  void dealloc() { --live_toy_count; }
+};
+
+// Bytes taken by the names of the types counted so far (see ObjectStats.h)
+static size_t typeNameBytes() {
+  ObjectStats::Totals totals[ObjectStats::MaxTypes];
+  size_t count = ObjectStats::collect(totals, ObjectStats::MaxTypes);
+  size_t bytes = 0;
+  for (size_t i = 0; i < count; ++i) bytes += strlen(totals[i].name) + 1;
+  return bytes;
+}
+
+// True if an allocator can still be installed after *first* has run as the
+// first thing in a fresh process
+static bool installsAfter(void (*first)()) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    first();
+    _exit(Allocator::install(Allocator::System) ? 0 : 1);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  assert(WIFEXITED(status));
+  return WEXITSTATUS(status) == 0;
+}
+
+static void doNothing() {}
+static void growReleaseQueue() {
+  ReleaseQueue queue = { 0, 0, 0 };
+  queue.grow();
+}
+static void deferReleases() { setDeferredRelease(true); }
+static void beginRegion() { hue_region_begin(); }
+static void startThreads() { useAtomicRefcounts(); }
+static void countObject() { Toy::create(0); }
+
+int main() {
+  // Whatever first gets memory for the runtime, be it reallocating a release
+  // queue or making a record for a thread, uses the allocator
+  assert(installsAfter(doNothing));
+  assert(!installsAfter(growReleaseQueue));
+  assert(!installsAfter(deferReleases));
+  assert(!installsAfter(beginRegion));
+  assert(!installsAfter(startThreads));
+  assert(!installsAfter(countObject));
+
+  // The allocator is installed before anything is allocated
+  static Tracking tracking = { 0, 0, 0 };
+  Allocator allocator = { trackingAlloc, trackingRealloc, trackingDealloc, &tracking };
+  assert(hue_install_allocator(&allocator) == 1);
+
+  // Objects get their memory from it, and so does the runtime's bookkeeping:
+  // the first object makes the thread's table of counts and its type's name
+  Toy* toy = Toy::create(1);
+  assert(tracking.allocCount == 3);
+  size_t records = sizeof(ObjectStats::ThreadStats) + typeNameBytes();
+  assert(tracking.liveBytes == records + sizeof(Toy));
+  toy->release();
+  assert(tracking.deallocCount == 1);
+  assert(tracking.liveBytes == records);
+
+  // ...and so do the pool's slabs and its cache for the thread
+  Vector* v = Vector::Empty;
+  for (size_t i = 0; i < 10000; ++i) v = v->appendAndRelease((void*)i);
+  records = sizeof(ObjectStats::ThreadStats) + sizeof(Pool::ThreadCache) + typeNameBytes();
+  size_t liveBytes = tracking.liveBytes;
+  assert(liveBytes == records + Pool::stats().slabBytes);
+
+  // Once something has been allocated, the allocator can't be replaced
+  assert(!Allocator::install(Allocator::System));
+  assert(Allocator::current().context == &tracking);
+
+  // A region. Objects allocated by this thread come from the region and
+  // needn't be released.
+  size_t poolAllocs = Pool::stats().allocCount;
+  size_t allocs = tracking.allocCount;
+  {
+    Region region;
+    assert(Region::current() == &region);
+    Vector* rv = Vector::Empty;
+    for (size_t i = 0; i < 100000; ++i) rv = rv->append((void*)i); // the old vectors are never released
+    assert(rv->count() == 100000);
+    for (size_t i = 0; i < 100000; ++i) assert((size_t)rv->itemAt(i) == i);
+    assert(region.contains(rv));
+    assert(region.allocatedBytes() > 100000 * sizeof(void*));
+    assert(region.chunkBytes() >= region.allocatedBytes());
+
+    // Releasing objects from the region frees nothing. A vector derived from
+    // one outside the region lives in the region too.
+    Toy* inside = Toy::create(2);
+    assert(region.contains(inside));
+    inside->release();
+    assert(live_toy_count == 0);
+    Vector* outside = v->append((void*)1);
+    assert(region.contains(outside));
+    outside->release();
+
+    // Regions nest
+    {
+      Region inner;
+      Toy* t = Toy::create(3);
+      assert(inner.contains(t) && !region.contains(t));
+      rv->retain();
+      rv->release(); // in the outer region
+    }
+    assert(Region::current() == &region);
+  }
+  assert(Region::current() == 0);
+  assert(Pool::stats().allocCount == poolAllocs); // the pool wasn't used
+  // The chunks came from the allocator and have been returned to it
+  assert(tracking.allocCount > allocs);
+  assert(tracking.liveBytes == liveBytes);
+
+  // The same, through the C API
+  Region* region = hue_region_begin();
+  Toy* t = Toy::create(4);
+  assert(region->contains(t));
+  hue_region_end(region);
+  assert(tracking.liveBytes == liveBytes);
+
+  // Objects allocated before a region can be released inside it
+  Toy* before = Toy::create(5);
+  {
+    Region region;
+    before->release();
+  }
+  assert(tracking.liveBytes == liveBytes);
+
+  // Objects from outside a region which are modified in place in it grow
+  // outside it, and can be used after it's gone
+  Vector* full = Vector::Empty;
+  for (size_t i = 0; i < 32; ++i) full = full->appendAndRelease((void*)i);
+  VectorRef ref;
+  for (size_t i = 0; i < 32; ++i) ref = ref.appendAndRelease((void*)i);
+  Vector::Transient* transient = Vector::Empty->asTransient();
+  for (size_t i = 0; i < 32; ++i) transient->append((void*)i);
+  {
+    Region region;
+    full = full->appendAndRelease((void*)32);
+    ref = ref.appendAndRelease((void*)32);
+    transient->append((void*)32);
+    assert(!region.contains(full));
+    assert(region.allocatedBytes() == 0);
+  }
+  Vector* built = transient->persistent();
+  for (size_t i = 0; i < 33; ++i) {
+    assert((size_t)full->itemAt(i) == i);
+    assert((size_t)ref.itemAt(i) == i);
+    assert((size_t)built->itemAt(i) == i);
+  }
+  full->release();
+  ref.release();
+  built->release();
+  transient->release();
+
+  // With deferred release, objects from a region are destroyed at once rather
+  // than queued, since the region is gone before the queue is drained.
+  // Objects from outside it are still queued.
+  size_t toys = live_toy_count;
+  setDeferredRelease(true);
+  Toy* outside = Toy::create(6);
+  {
+    Region region;
+    Vector* rv = Vector::Empty;
+    for (size_t i = 0; i < 1000; ++i) rv = rv->appendAndRelease((void*)i);
+    Toy* inside = Toy::create(7);
+    inside->release();
+    assert(live_toy_count == toys + 1);
+    rv->release();
+    assert(pendingReleases() == 0);
+    outside->release();
+    assert(pendingReleases() == 1);
+  }
+  assert(live_toy_count == toys + 1);
+  assert(drainReleases());
+  assert(live_toy_count == toys);
+  setDeferredRelease(false);
+
+  v->release();
+  return 0;
+}
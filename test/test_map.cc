@@ -0,0 +1,174 @@
+#define DEBUG_MapNode_refcount
+#define DEBUG_Map_refcount
+#include "../src/runtime/Map.h"
+
+#include <iostream>
+#include <unordered_map>
+
+using std::cerr;
+using std::endl;
+using namespace hue;
+
+typedef Map<uint64_t, uint64_t> IntMap;
+
+// A hash which puts every key in one of four buckets, so that most keys collide
+struct BadHash {
+  size_t operator()(uint64_t key) const { return key % 4; }
+};
+typedef Map<uint64_t, uint64_t, BadHash> BadMap;
+
+// Asserts that m holds the same entries as ref
+template <typename M>
+static void assertSameEntries(const M* m, const std::unordered_map<uint64_t, uint64_t>& ref) {
+  assert(m->count() == ref.size());
+  for (std::unordered_map<uint64_t, uint64_t>::const_iterator it = ref.begin(); it != ref.end(); ++it) {
+    const uint64_t* value = m->get(it->first);
+    assert(value != 0);
+    assert(*value == it->second);
+  }
+  size_t visited = 0;
+  m->forEach([&](const uint64_t& key, const uint64_t& value) {
+    std::unordered_map<uint64_t, uint64_t>::const_iterator it = ref.find(key);
+    assert(it != ref.end());
+    assert(it->second == value);
+    ++visited;
+  });
+  assert(visited == ref.size());
+}
+
+// Applies the same random assoc and dissoc operations to a map and a reference
+template <typename M>
+static void testRandomOps(size_t opCount, uint64_t keyRange) {
+  std::unordered_map<uint64_t, uint64_t> ref;
+  M* m = M::Empty;
+  uint64_t r = 88172645463325252ull;
+  for (size_t i = 0; i < opCount; ++i) {
+    r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+    uint64_t key = r % keyRange;
+    M* oldM = m;
+    if ((r >> 32) % 4 == 0) {
+      m = m->dissoc(key);
+      ref.erase(key);
+    } else {
+      m = m->assoc(key, i);
+      ref[key] = i;
+    }
+    oldM->release();
+    assert(m->count() == ref.size());
+  }
+  assertSameEntries(m, ref);
+
+  // Remove everything
+  for (uint64_t key = 0; key < keyRange; ++key) {
+    M* oldM = m;
+    m = m->dissoc(key);
+    oldM->release();
+  }
+  assert(m == M::Empty);
+  assert(m->count() == 0);
+}
+
+int main() {
+  // Empty map
+  IntMap* m = IntMap::Empty;
+  assert(m->count() == 0);
+  assert(m->get(1) == 0);
+  assert(!m->contains(1));
+  IntMap* m2 = m->dissoc(1);
+  assert(m2 == m);
+
+  // Persistent: older versions are not affected
+  m = IntMap::Empty->assoc(1, 100);
+  m2 = m->assoc(2, 200);
+  IntMap* m3 = m2->assoc(1, 101);
+  assert(m->count() == 1 && *m->get(1) == 100 && !m->contains(2));
+  assert(m2->count() == 2 && *m2->get(1) == 100 && *m2->get(2) == 200);
+  assert(m3->count() == 2 && *m3->get(1) == 101 && *m3->get(2) == 200);
+  IntMap* m4 = m3->dissoc(1);
+  assert(m4->count() == 1 && !m4->contains(1) && *m4->get(2) == 200);
+  assert(m3->count() == 2 && *m3->get(1) == 101);
+  IntMap* m5 = m4->dissoc(3); // not present
+  assert(m5 == m4);
+  m->release(); m2->release(); m3->release(); m4->release(); m5->release();
+
+  // Random operations, with few keys (mostly replacing) and many keys (deep tries)
+  testRandomOps<IntMap>(1000, 50);
+  testRandomOps<IntMap>(100000, 20000);
+
+  // Keys with equal hashes end up in collision nodes
+  testRandomOps<BadMap>(5000, 200);
+
+  // Transient
+  std::unordered_map<uint64_t, uint64_t> ref;
+  IntMap* base = IntMap::Empty;
+  for (uint64_t i = 0; i < 1000; ++i) {
+    IntMap* oldM = base;
+    base = base->assoc(i, i);
+    oldM->release();
+    ref[i] = i;
+  }
+  IntMap::Transient* t = base->asTransient();
+  std::unordered_map<uint64_t, uint64_t> tref = ref;
+  for (uint64_t i = 500; i < 3000; ++i) {
+    t->assoc(i, i * 2);
+    tref[i] = i * 2;
+  }
+  for (uint64_t i = 0; i < 3000; i += 3) {
+    t->dissoc(i);
+    tref.erase(i);
+  }
+  assert(t->count() == tref.size());
+  assert(*t->get(1) == 1);
+  assert(t->get(3) == 0);
+  IntMap* p1 = t->persistent();
+  assertSameEntries(p1, tref);
+  assertSameEntries(base, ref); // not affected by the transient
+
+  // Changes after persistent() don't affect the persistent map
+  t->assoc(1, 12345);
+  t->dissoc(2);
+  assertSameEntries(p1, tref);
+  assert(*t->get(1) == 12345);
+  assert(!t->get(2));
+  IntMap* p2 = t->persistent();
+  tref[1] = 12345;
+  tref.erase(2);
+  assertSameEntries(p2, tref);
+  t->release();
+  p1->release();
+  p2->release();
+
+  // A transient emptied completely
+  t = base->asTransient();
+  for (uint64_t i = 0; i < 1000; ++i) t->dissoc(i);
+  assert(t->count() == 0);
+  IntMap* p3 = t->persistent();
+  assert(p3 == IntMap::Empty);
+  t->assoc(7, 8);
+  assert(*t->get(7) == 8);
+  t->release();
+  base->release();
+
+  // Transient with colliding keys
+  BadMap::Transient* bt = BadMap::Empty->asTransient();
+  for (uint64_t i = 0; i < 100; ++i) bt->assoc(i, i);
+  for (uint64_t i = 0; i < 100; i += 2) bt->dissoc(i);
+  BadMap* bm = bt->persistent();
+  bt->release();
+  assert(bm->count() == 50);
+  for (uint64_t i = 0; i < 100; ++i) assert(bm->contains(i) == (i % 2 == 1));
+  bm->release();
+
+  // Verify that there are no leaks
+  #ifdef DEBUG_LIVECOUNT_MapNode
+  //cerr << "livecount of MapNode: " << DEBUG_LIVECOUNT_MapNode << endl;
+  assert(DEBUG_LIVECOUNT_MapNode == 0);
+  #endif
+
+  #ifdef DEBUG_LIVECOUNT_Map
+  //cerr << "livecount of Map: " << DEBUG_LIVECOUNT_Map << endl;
+  assert(DEBUG_LIVECOUNT_Map == 0);
+  #endif
+
+  return 0;
+}
@@ -0,0 +1,92 @@
+#include "../src/runtime/Map.h"
+#include <stdlib.h>
+#include <time.h>
+
+#include <iostream>
+#include <unordered_map>
+
+using std::cerr;
+using std::endl;
+using namespace hue;
+
+typedef Map<uint64_t, uint64_t> IntMap;
+
+// Spreads consecutive integers over the whole range of keys
+static inline uint64_t keyFor(uint64_t i) { return i * 0x9E3779B97F4A7C15ull; }
+
+int main(int argc, char **argv) {
+  // This test inserts N (argv[0] as int) keys into a std::unordered_map, a
+  // persistent Map and a transient Map, then looks up keys in random order and
+  // finally removes all keys.
+
+  uint64_t N = (argc > 1) ? atoll(argv[1]) : 1000000;
+  uint64_t i;
+
+  clock_t start1 = clock();
+  std::unordered_map<uint64_t, uint64_t> um;
+  for (i = 0; i < N; ++i) um[keyFor(i)] = i;
+  double ms1 = ((double)(clock() - start1)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Inserting " << N << " keys into std::unordered_map: " << ms1 << " ms (avg " << ((ms1 / N) * 1000000.0) << " ns/insert)" << endl;
+
+  clock_t start2 = clock();
+  IntMap* m = IntMap::Empty;
+  for (i = 0; i < N; ++i) {
+    IntMap* oldM = m;
+    m = m->assoc(keyFor(i), i);
+    oldM->release();
+  }
+  double ms2 = ((double)(clock() - start2)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Inserting " << N << " keys into Map: " << ms2 << " ms (avg " << ((ms2 / N) * 1000000.0) << " ns/insert)" << endl;
+  assert(m->count() == N);
+
+  clock_t start3 = clock();
+  IntMap::Transient* t = IntMap::Empty->asTransient();
+  for (i = 0; i < N; ++i) t->assoc(keyFor(i), i);
+  IntMap* tm = t->persistent();
+  t->release();
+  double ms3 = ((double)(clock() - start3)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Inserting " << N << " keys into Map::Transient: " << ms3 << " ms (avg " << ((ms3 / N) * 1000000.0) << " ns/insert)" << endl;
+  assert(tm->count() == N);
+
+  // Random order of lookups
+  uint64_t* order = (uint64_t*)malloc(sizeof(uint64_t) * N);
+  uint64_t r = 88172645463325252ull;
+  for (i = 0; i < N; ++i) {
+    r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+    order[i] = keyFor(r % N);
+  }
+
+  clock_t start4 = clock();
+  uint64_t umsum = 0;
+  for (i = 0; i < N; ++i) umsum += um.find(order[i])->second;
+  double ms4 = ((double)(clock() - start4)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Looking up " << N << " random keys in std::unordered_map: " << ms4 << " ms (avg " << ((ms4 / N) * 1000000.0) << " ns/lookup)" << endl;
+
+  clock_t start5 = clock();
+  uint64_t msum = 0;
+  for (i = 0; i < N; ++i) msum += *m->get(order[i]);
+  double ms5 = ((double)(clock() - start5)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Looking up " << N << " random keys in Map: " << ms5 << " ms (avg " << ((ms5 / N) * 1000000.0) << " ns/lookup)" << endl;
+  if (umsum != msum) cerr << "sums differ: " << umsum << " != " << msum << endl; // also avoids stripping
+  assert(umsum == msum);
+
+  clock_t start6 = clock();
+  for (i = 0; i < N; ++i) um.erase(keyFor(i));
+  double ms6 = ((double)(clock() - start6)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Removing " << N << " keys from std::unordered_map: " << ms6 << " ms (avg " << ((ms6 / N) * 1000000.0) << " ns/remove)" << endl;
+
+  clock_t start7 = clock();
+  for (i = 0; i < N; ++i) {
+    IntMap* oldM = m;
+    m = m->dissoc(keyFor(i));
+    oldM->release();
+  }
+  double ms7 = ((double)(clock() - start7)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Removing " << N << " keys from Map: " << ms7 << " ms (avg " << ((ms7 / N) * 1000000.0) << " ns/remove)" << endl;
+  assert(m == IntMap::Empty);
+
+  free(order);
+  m->release();
+  tm->release();
+  return 0;
+}
@@ -16,6 +16,11 @@
 #include <iostream>
 #include <stdexcept>
 #include <bitset>
+#include <condition_variable>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <vector>
 
 using std::cerr;
 using std::endl;
@@ -41,7 +46,7 @@ public:
     __sync_sub_and_fetch(&live_toy_count, 1);
   }
   
-  inline Ref refcount() const { return __sync_fetch_and_add(&refcount_, 0); }
+  inline int64_t refcount() const { return refs_.count(); }
 };
 
 class Cat { HUE_OBJECT(Cat)
@@ -65,18 +70,12 @@ public:
     __sync_sub_and_fetch(&live_cat_count, 1);
   }
   
-  inline Ref refcount() const { return __sync_fetch_and_add(&refcount_, 0); }
+  inline int64_t refcount() const { return refs_.count(); }
 };
 
 
-int main() {
-  //HeapProfilerStart("main");
-  //ProfilerStart("main.prof");
-  
-  uint64_t i = 0;
-  uint64_t N = 10000;
-  
-  for (; i < N; ++i) {
+static void testRetainRelease(uint64_t N) {
+  for (uint64_t i = 0; i < N; ++i) {
     Toy* toy = Toy::create(i, i % 2 == 0 );
     
     assert(live_cat_count == 0);
@@ -101,6 +100,216 @@ int main() {
     assert(live_toy_count == 0);
     assert(live_cat_count == 0);
   }
+}
+
+// References counted by the thread which created the toy are merged with
+// the ones counted by other threads as the counts reach zero
+static void testBiased() {
+  // Released by another thread while owned by this one. The toy is queued and
+  // freed the next time this thread allocates.
+  Toy* toy = Toy::create(1, true);
+  assert(toy->isUnique());
+  std::thread([toy] { toy->release(); }).join();
+  assert(live_toy_count == 1);
+  Toy* toy2 = Toy::create(2, true);
+  assert(live_toy_count == 1);
+  toy2->release();
+  assert(live_toy_count == 0);
+
+  // Retained by another thread, then released by this one first
+  toy = Toy::create(3, true);
+  std::thread([toy] { toy->retain(); }).join();
+  assert(toy->refcount() == 2);
+  assert(!toy->isUnique());
+  toy->release();
+  assert(live_toy_count == 1);
+  assert(toy->refcount() == 1);
+  assert(toy->isUnique());
+  std::thread([toy] { toy->release(); }).join();
+  assert(live_toy_count == 0);
+
+  // Owned by a thread which has exited
+  Toy* orphan = 0;
+  std::thread([&orphan] {
+    orphan = Toy::create(4, true);
+    orphan->retain();
+    orphan->release();
+  }).join();
+  assert(orphan->isUnique());
+  orphan->retain();
+  assert(orphan->refcount() == 2);
+  orphan->release();
+  orphan->release();
+  assert(live_toy_count == 0);
+
+  // Unretainable objects are left alone
+  Toy stat;
+  stat.refcount_ = Unretainable;
+  stat.retain();
+  stat.release();
+  assert(!stat.isUnique());
+}
+
+// More threads than would fit in an 8-bit tag. Threads which run at the same
+// time own objects under tags of their own, and a thread which has exited
+// hands its tag, and the objects still tagged with it, to the next thread.
+static void testManyThreads() {
+  const size_t N = 300;
+  std::mutex mutex;
+  std::condition_variable allStarted;
+  std::set<uint32_t> tags;
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < N; ++t) {
+    threads.push_back(std::thread([&mutex, &allStarted, &tags, N, t] {
+      Toy* toy = Toy::create(t, true);
+      std::unique_lock<std::mutex> lock(mutex);
+      tags.insert(toy->refs_.local & RefCount::TagMask);
+      if (tags.size() == N) allStarted.notify_all();
+      allStarted.wait(lock, [&tags, N] { return tags.size() == N; });
+      lock.unlock();
+      toy->release();
+    }));
+  }
+  for (size_t t = 0; t < N; ++t) threads[t].join();
+  assert(tags.size() == N);
+  assert(tags.count(0) == 0 && tags.count((uint32_t)RefCount::NoOwner) == 0);
+  assert(live_toy_count == 0);
+
+  // One thread after another, each releasing the toy made by the one before.
+  // They all have the same tag.
+  tags.clear();
+  Toy* passed = 0;
+  Toy* kept = Toy::create(0, true);
+  for (size_t t = 0; t < 1000; ++t) {
+    std::thread([&passed, &tags, kept, t] {
+      Toy* toy = Toy::create(t, true);
+      tags.insert(toy->refs_.local & RefCount::TagMask);
+      kept->retain();
+      if (passed) passed->release();
+      passed = toy;
+    }).join();
+  }
+  assert(tags.size() == 1);
+  assert(live_toy_count == 2);
+  passed->release();
+  assert(kept->refcount() == 1001);
+  for (size_t t = 0; t < 1000; ++t) kept->release();
+  assert(kept->isUnique());
+  kept->release();
+  mergeQueuedReleases();
+  assert(live_toy_count == 0);
+}
+
+// Returns the counts of the type whose name ends with *name*
+static ObjectStats::Totals statsOf(const char* name) {
+  ObjectStats::Totals totals[ObjectStats::MaxTypes];
+  size_t count = ObjectStats::collect(totals, ObjectStats::MaxTypes);
+  for (size_t i = 0; i < count; ++i) {
+    size_t n = strlen(totals[i].name);
+    if (n >= strlen(name) && strcmp(totals[i].name + n - strlen(name), name) == 0) return totals[i];
+  }
+  assert(!"type not counted");
+  return totals[0];
+}
+
+static void testStats() {
+  ObjectStats::Totals toys = statsOf("Toy");
+  ObjectStats::Totals cats = statsOf("Cat");
+  assert(toys.liveCount == 0 && toys.liveBytes == 0);
+  assert(toys.allocBytes == toys.allocCount * sizeof(Toy));
+
+  Toy* toy = Toy::create(1, true);
+  Cat* cat = Cat::create(2, "Zelda", toy); // retains toy
+  ObjectStats::Totals t = statsOf("Toy");
+  assert(t.allocCount == toys.allocCount + 1);
+  assert(t.liveCount == 1 && t.liveBytes == sizeof(Toy));
+  assert(t.retainCount == toys.retainCount + 1);
+
+  // Counts of threads which have exited are kept
+  std::thread([toy] {
+    Toy::create(3, true)->release();
+    toy->retain();
+    toy->release();
+  }).join();
+  toy->release();
+  cat->release();
+  mergeQueuedReleases();
+  t = statsOf("Toy");
+  assert(t.allocCount == toys.allocCount + 2);
+  assert(t.deallocCount == toys.deallocCount + 2);
+  assert(t.liveCount == 0 && t.liveBytes == 0);
+  assert(t.retainCount == toys.retainCount + 2);
+  assert(t.releaseCount == toys.releaseCount + 4);
+  assert(statsOf("Cat").deallocCount == cats.deallocCount + 1);
+
+  // The dump has a line per type
+  FILE* f = tmpfile();
+  ObjectStats::dump(f);
+  rewind(f);
+  char line[512];
+  size_t lines = 0;
+  bool sawToy = false;
+  while (fgets(line, sizeof(line), f)) {
+    ++lines;
+    sawToy = sawToy || strstr(line, " Toy\n") != 0;
+  }
+  fclose(f);
+  assert(sawToy);
+  assert(lines >= 3);
+}
+
+int main() {
+  //HeapProfilerStart("main");
+  //ProfilerStart("main.prof");
+  
+  // Single-threaded programs skip checking which thread owns an object
+  assert(!AtomicRefcounts);
+  testRetainRelease(10000);
+  Toy* early = Toy::create(1, true);
+
+  // Objects made before are owned by the thread which turned threads on
+  useAtomicRefcounts();
+  assert(AtomicRefcounts);
+  assert((early->refs_.local & RefCount::TagMask) == RefCount::threadTag());
+  early->retain();
+  std::thread([early] { early->release(); }).join();
+  assert(early->refcount() == 1);
+  early->release();
+  mergeQueuedReleases();
+  assert(live_toy_count == 0);
+
+  testRetainRelease(10000);
+  testBiased();
+  testStats();
+  testManyThreads();
+
+  // Threads retaining and releasing the same object
+  Toy* toy = Toy::create(1, true);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < 4; ++t) {
+    threads.push_back(std::thread([toy] {
+      for (size_t i = 0; i < 100000; ++i) {
+        toy->retain();
+        toy->release();
+      }
+    }));
+  }
+  for (size_t t = 0; t < threads.size(); ++t) threads[t].join();
+  assert(toy->refcount() == 1);
+  toy->release();
+  assert(live_toy_count == 0);
+
+  // Objects handed between threads, each releasing the other's references
+  for (size_t round = 0; round < 100; ++round) {
+    Toy* toys[64];
+    for (size_t i = 0; i < 64; ++i) toys[i] = Toy::create(i, true)->retain();
+    std::thread([&toys] {
+      for (size_t i = 0; i < 64; ++i) toys[i]->release();
+    }).join();
+    for (size_t i = 0; i < 64; ++i) toys[i]->release();
+  }
+  Toy::create(0, true)->release(); // merges the ones still queued
+  assert(live_toy_count == 0);
   
   //ProfilerStop();
   //HeapProfilerStop();
@@ -0,0 +1,85 @@
+#include "../src/runtime/Vector.h"
+
+#include <thread>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using namespace hue;
+
+int main() {
+  Pool::Stats before = Pool::stats();
+
+  // Blocks are aligned and freed blocks are reused
+  void* a = Pool::alloc(24);
+  assert(((uintptr_t)a % Pool::Granularity) == 0);
+  memset(a, 0xab, 24);
+  Pool::dealloc(a, 24);
+  void* b = Pool::alloc(17);
+  assert(b == a); // same size class, most recently freed
+  Pool::dealloc(b, 17);
+
+  // Many live blocks of every size class, plus some larger than MaxSize
+  std::vector<void*> blocks;
+  for (size_t i = 0; i < 20000; ++i) {
+    size_t size = 1 + (i * 7) % (Pool::MaxSize + 200);
+    void* p = Pool::alloc(size);
+    memset(p, (int)i, size);
+    blocks.push_back(p);
+  }
+  for (size_t i = 0; i < blocks.size(); ++i) {
+    size_t size = 1 + (i * 7) % (Pool::MaxSize + 200);
+    assert(*(uint8_t*)blocks[i] == (uint8_t)i);
+    Pool::dealloc(blocks[i], size);
+  }
+
+  Pool::Stats classes[Pool::ClassCount + 1];
+  Pool::Stats after = Pool::stats(classes);
+  assert(after.allocCount - before.allocCount == 20002);
+  assert(after.deallocCount - before.deallocCount == 20002);
+  assert(after.slabBytes > 0);
+  assert(classes[Pool::ClassCount].allocCount > 0); // larger than MaxSize
+  assert(classes[Pool::sizeClass(24)].allocCount >= 2);
+
+  // Blocks allocated in one thread and freed in another. Counters of threads
+  // which have exited are kept.
+  std::vector<void*> shared(10000);
+  std::thread producer([&shared] {
+    for (size_t i = 0; i < shared.size(); ++i) shared[i] = Pool::alloc(48);
+  });
+  producer.join();
+  std::vector<std::thread> consumers;
+  for (size_t t = 0; t < 4; ++t) {
+    consumers.push_back(std::thread([&shared, t] {
+      for (size_t i = t; i < shared.size(); i += 4) Pool::dealloc(shared[i], 48);
+      // Churn which reuses blocks
+      for (size_t i = 0; i < 10000; ++i) {
+        void* p = Pool::alloc(48);
+        Pool::dealloc(p, 48);
+      }
+    }));
+  }
+  for (size_t t = 0; t < consumers.size(); ++t) consumers[t].join();
+
+  Pool::Stats afterThreads = Pool::stats();
+  assert(afterThreads.allocCount - after.allocCount == 10000 + 4 * 10000);
+  assert(afterThreads.deallocCount - after.deallocCount == 10000 + 4 * 10000);
+
+  // Vectors are allocated from the pool and give everything back
+  Pool::Stats beforeVector = Pool::stats();
+  Vector* v = Vector::Empty;
+  for (uint64_t i = 0; i < 100000; ++i) {
+    Vector* oldV = v;
+    v = v->append((void*)i);
+    oldV->release();
+  }
+  Vector* v2 = v->concat(v);
+  v->release();
+  v2->release();
+  Pool::Stats afterVector = Pool::stats();
+  assert(afterVector.allocCount - beforeVector.allocCount > 100000);
+  assert(afterVector.allocCount - beforeVector.allocCount ==
+         afterVector.deallocCount - beforeVector.deallocCount);
+
+  return 0;
+}
@@ -0,0 +1,148 @@
+#define DEBUG_TypedNode_refcount
+#define DEBUG_TypedVector_refcount
+#include "../src/runtime/TypedVector.h"
+
+#include <iostream>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using namespace hue;
+
+// Asserts that v holds the same items as ref, both by index and by chunks
+template <typename V>
+static void assertSameItems(const V* v, const std::vector<typename V::Item>& ref) {
+  assert(v->count() == ref.size());
+  for (size_t i = 0; i < ref.size(); ++i) {
+    assert(v->itemAt(i) == ref[i]);
+  }
+  size_t offset = 0;
+  const typename V::Item* chunk;
+  size_t length;
+  typename V::ChunkIterator it(v);
+  while (it.next(chunk, length)) {
+    assert(length <= V::LeafSize);
+    assert(it.offset() == offset);
+    for (size_t i = 0; i < length; ++i) assert(chunk[i] == ref[offset + i]);
+    offset += length;
+  }
+  assert(offset == ref.size());
+  typename V::ChunkIterator rit(v, true);
+  while (rit.prev(chunk, length)) {
+    offset -= length;
+    assert(rit.offset() == offset);
+    for (size_t i = 0; i < length; ++i) assert(chunk[i] == ref[offset + i]);
+  }
+  assert(offset == 0);
+}
+
+template <typename V>
+static void testVector(size_t N) {
+  typedef typename V::Item T;
+  std::vector<T> ref;
+
+  // Append using single operations
+  V* v = V::Empty;
+  for (size_t i = 0; i < N; ++i) {
+    V* oldV = v;
+    v = v->append((T)(i * 7 + 3));
+    oldV->release();
+    ref.push_back((T)(i * 7 + 3));
+  }
+  assertSameItems(v, ref);
+
+  // Build the same vector using a transient, freezing it half way through
+  typename V::Transient* t = V::Empty->asTransient();
+  V* half = 0;
+  for (size_t i = 0; i < N; ++i) {
+    if (i == N / 2) half = t->persistent();
+    t->append(ref[i]);
+  }
+  if (half == 0) half = t->persistent();
+  V* v2 = t->persistent();
+  t->release();
+  assertSameItems(v2, ref);
+  assertSameItems(half, std::vector<T>(ref.begin(), ref.begin() + N / 2));
+  half->release();
+  v2->release();
+
+  // Build from an array
+  v2 = V::fromArray(ref.data(), ref.size());
+  assertSameItems(v2, ref);
+  v2->release();
+
+  // Replace every 100th item
+  std::vector<T> ref2 = ref;
+  v2 = v->retain();
+  for (size_t i = 0; i < N; i += 100) {
+    V* oldV2 = v2;
+    v2 = v2->assoc(i, (T)i);
+    oldV2->release();
+    ref2[i] = (T)i;
+  }
+  assertSameItems(v2, ref2);
+  assertSameItems(v, ref);
+
+  // Pop all items
+  while (v2->count() != 0) {
+    V* oldV2 = v2;
+    v2 = v2->pop();
+    oldV2->release();
+    ref2.pop_back();
+    if (ref2.size() % 1000 == 0) assertSameItems(v2, ref2);
+  }
+  v2->release();
+
+  // Slicing and concatenation
+  size_t cuts[] = { 0, 1, V::LeafSize - 1, V::LeafSize, V::LeafSize + 1, N / 3, N / 2, N - 1, N };
+  const size_t ncuts = sizeof(cuts) / sizeof(cuts[0]);
+  for (size_t a = 0; a < ncuts; ++a) {
+    if (cuts[a] > N) continue;
+    V* head = v->take(cuts[a]);
+    V* rest = v->drop(cuts[a]);
+    assertSameItems(head, std::vector<T>(ref.begin(), ref.begin() + cuts[a]));
+    assertSameItems(rest, std::vector<T>(ref.begin() + cuts[a], ref.end()));
+    V* joined = head->concat(rest);
+    assertSameItems(joined, ref);
+    for (size_t b = a; b < ncuts; ++b) {
+      if (cuts[b] > N || cuts[b] < cuts[a]) continue;
+      V* s = v->slice(cuts[a], cuts[b]);
+      assertSameItems(s, std::vector<T>(ref.begin() + cuts[a], ref.begin() + cuts[b]));
+      s->release();
+    }
+    head->release();
+    rest->release();
+    joined->release();
+  }
+
+  v->release();
+}
+
+int main() {
+  // Leaves have a fixed byte budget, so narrow types get more items per leaf
+  assert(IntVector::LeafSize == 32);
+  assert(FloatVector::LeafSize == 32);
+  assert(CharVector::LeafSize == 64);
+  assert(ByteVector::LeafSize == 256);
+
+  size_t sizes[] = { 0, 1, 31, 32, 33, 300, 1057, 40000, 300000 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    testVector<IntVector>(sizes[i]);
+    testVector<FloatVector>(sizes[i]);
+    testVector<ByteVector>(sizes[i]);
+    testVector<CharVector>(sizes[i]);
+  }
+
+  // Verify that there are no leaks
+  #ifdef DEBUG_LIVECOUNT_TypedNode
+  //cerr << "livecount of TypedNode: " << DEBUG_LIVECOUNT_TypedNode << endl;
+  assert(DEBUG_LIVECOUNT_TypedNode == 0);
+  #endif
+
+  #ifdef DEBUG_LIVECOUNT_TypedVector
+  //cerr << "livecount of TypedVector: " << DEBUG_LIVECOUNT_TypedVector << endl;
+  assert(DEBUG_LIVECOUNT_TypedVector == 0);
+  #endif
+
+  return 0;
+}
@@ -2,10 +2,62 @@
 #define DEBUG_Vector_refcount
 #include "../src/runtime/Vector.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <vector>
+
 using std::cerr;
 using std::endl;
 using namespace hue;
 
+typedef std::vector<uint64_t> RefVector;
+
+// Asserts that v holds the same items as ref, both by index and by chunks
+static void assertSameItems(const Vector* v, const RefVector& ref) {
+  assert(v->count() == ref.size());
+  for (size_t i = 0; i < ref.size(); ++i) {
+    if ((uint64_t)v->itemAt(i) != ref[i]) {
+      cerr << "itemAt(" << i << ") returned " << (uint64_t)v->itemAt(i)
+           << " but expected " << ref[i] << endl;
+    }
+    assert((uint64_t)v->itemAt(i) == ref[i]);
+  }
+  size_t offset = 0;
+  void* const* chunk;
+  size_t length;
+  Vector::ChunkIterator it(v);
+  while (it.next(chunk, length)) {
+    for (size_t i = 0; i < length; ++i) assert((uint64_t)chunk[i] == ref[offset + i]);
+    offset += length;
+  }
+  assert(offset == ref.size());
+}
+
+static Vector* vectorOf(size_t count, uint64_t first, RefVector& ref) {
+  ref.clear();
+  Vector::Transient* t = Vector::Empty->asTransient();
+  for (size_t i = 0; i < count; ++i) {
+    t->append((void*)(first + i));
+    ref.push_back(first + i);
+  }
+  Vector* v = t->persistent();
+  t->release();
+  return v;
+}
+
+// Writes *file* to *path* with *size* bytes at *offset* replaced by those at
+// *value*, and maps it
+static Vector::Mapping* openPatched(const char* path, std::vector<char> file,
+                                    size_t offset, const void* value, size_t size) {
+  memcpy(&file[offset], value, size);
+  FILE* f = fopen(path, "wb");
+  assert(f != 0 && fwrite(&file[0], 1, file.size(), f) == file.size());
+  fclose(f);
+  return Vector::Mapping::open(path);
+}
+
 int main() {
   // This test starts with an empty vector, appends 1 000 000 values using
   // single operations, and finally confirms the values by accessing each item.
@@ -33,6 +85,601 @@ int main() {
     assert(_ == (uint64_t)(i * 10));
   }
   
+  // Build a vector of N values using a transient. Freeze it half way through
+  // and make sure the frozen vector is unaffected by further appends.
+  Vector::Transient* t = Vector::Empty->asTransient();
+  Vector* half = 0;
+  for (i = 0; i < N; ++i) {
+    if (i == N / 2) half = t->persistent();
+    t->append((void*)(i * 10));
+  }
+  assert(t->count() == N);
+  
+  Vector* v2 = t->persistent();
+  t->release();
+  assert(v2->count() == N);
+  assert(half->count() == N / 2);
+  for (i = 0; i < N; ++i) {
+    assert((uint64_t)v2->itemAt(i) == (uint64_t)(i * 10));
+    if (i < N / 2) assert((uint64_t)half->itemAt(i) == (uint64_t)(i * 10));
+  }
+  
+  // Mix persistent appends and a transient started from the same vector
+  Vector* v3 = half->append((void*)1);
+  t = half->asTransient();
+  for (i = 0; i < 100; ++i) t->append((void*)2);
+  Vector* v4 = t->persistent();
+  t->release();
+  assert(v3->count() == N / 2 + 1);
+  assert(v4->count() == N / 2 + 100);
+  assert((uint64_t)v3->itemAt(N / 2) == 1);
+  assert((uint64_t)v4->itemAt(N / 2) == 2);
+  assert((uint64_t)v4->itemAt(N / 2 + 99) == 2);
+  for (i = 0; i < N / 2; ++i) {
+    assert((uint64_t)v3->itemAt(i) == (uint64_t)(i * 10));
+    assert((uint64_t)v4->itemAt(i) == (uint64_t)(i * 10));
+  }
+  
+  half->release();
+  v2->release();
+  v3->release();
+  v4->release();
+  
+  // Build vectors from arrays of sizes around leaf and level boundaries and
+  // make sure they are identical to vectors built by appending
+  void** items = (void**)malloc(sizeof(void*) * N);
+  for (i = 0; i < N; ++i) items[i] = (void*)(i * 10);
+  size_t sizes[] = { 0, 1, 31, 32, 33, 64, 1024, 1056, 1057, 32*32*32+32, 32*32*32+33, N };
+  for (size_t si = 0; si < sizeof(sizes) / sizeof(sizes[0]); ++si) {
+    size_t n = sizes[si];
+    Vector* fv = Vector::fromArray(items, n);
+    assert(fv->count() == n);
+    for (i = 0; i < n; ++i) assert(fv->itemAt(i) == items[i]);
+    // Appending must continue the same trie layout
+    Vector* fv2 = fv;
+    for (i = 0; i < 64; ++i) {
+      Vector* oldfv2 = fv2;
+      fv2 = fv2->append((void*)i);
+      if (oldfv2 != fv) oldfv2->release();
+    }
+    assert(fv2->count() == n + 64);
+    assert(fv2->itemAt(n + 63) == (void*)63);
+    if (n) assert(fv2->itemAt(n - 1) == items[n - 1]);
+    // Iterate over the chunks forwards and backwards
+    size_t total = 0;
+    void* const* chunk;
+    size_t length;
+    Vector::ChunkIterator it(fv2);
+    while (it.next(chunk, length)) {
+      assert(it.offset() == total);
+      assert(length > 0 && length <= 32);
+      for (i = 0; i < length; ++i) assert(chunk[i] == fv2->itemAt(total + i));
+      total += length;
+    }
+    assert(total == fv2->count());
+    Vector::ChunkIterator rit(fv2, true);
+    while (rit.prev(chunk, length)) {
+      total -= length;
+      assert(rit.offset() == total);
+      assert(chunk[0] == fv2->itemAt(total));
+    }
+    assert(total == 0);
+    fv->release();
+    fv2->release();
+  }
+  free(items);
+  
+  // Gather random items, from the trie and the tail, in groups of every size
+  {
+    std::vector<size_t> indices;
+    uint64_t r = 88172645463325252ull;
+    for (i = 0; i < 1000; ++i) {
+      r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+      indices.push_back(r % N);
+    }
+    indices.push_back(N - 1);
+    std::vector<void*> gathered(indices.size());
+    for (size_t n = 0; n <= indices.size(); n += 1 + n / 2) {
+      v->itemsAt(&indices[0], n, &gathered[0]);
+      for (size_t k = 0; k < n; ++k) assert(gathered[k] == v->itemAt(indices[k]));
+    }
+    indices.push_back(N);
+    bool thrown = false;
+    try {
+      v->itemsAt(&indices[0], indices.size(), &gathered[0]);
+    } catch (std::out_of_range&) {
+      thrown = true;
+    }
+    assert(thrown);
+  }
+
+  // Replace every 1000th item and make sure the original is unaffected
+  v2 = v;
+  for (i = 0; i < N; i += 1000) {
+    Vector* oldV2 = v2;
+    v2 = v2->assoc(i, (void*)1);
+    if (oldV2 != v) oldV2->release();
+  }
+  v3 = v2->assoc(N - 1, (void*)2); // in tail
+  assert(v2->count() == N && v3->count() == N);
+  for (i = 0; i < N; ++i) {
+    assert((uint64_t)v->itemAt(i) == (uint64_t)(i * 10));
+    uint64_t expected = (i % 1000 == 0) ? 1 : i * 10;
+    assert((uint64_t)v2->itemAt(i) == expected);
+    if (i == N - 1) expected = 2;
+    assert((uint64_t)v3->itemAt(i) == expected);
+  }
+  v2->release();
+  v3->release();
+  
+  // Pop items until the vector is empty, growing it again now and then to
+  // make sure the trie is still sound after root collapses
+  v2 = v->retain();
+  for (i = N; i > 0; --i) {
+    assert(v2->count() == i);
+    assert((uint64_t)v2->itemAt(i - 1) == (uint64_t)((i - 1) * 10));
+    if (i % 32769 == 0) {
+      v3 = v2->append((void*)3);
+      assert(v3->count() == i + 1);
+      assert((uint64_t)v3->itemAt(i) == 3);
+      assert((uint64_t)v3->itemAt(i - 1) == (uint64_t)((i - 1) * 10));
+      v3->release();
+    }
+    Vector* oldV2 = v2;
+    v2 = v2->pop();
+    oldV2->release();
+  }
+  assert(v2->count() == 0);
+  v2->release();
+  
+  // Concatenate vectors of sizes around leaf and level boundaries
+  size_t catSizes[] = { 0, 1, 5, 31, 32, 33, 100, 1024, 1057, 40000 };
+  const size_t catSizesCount = sizeof(catSizes) / sizeof(catSizes[0]);
+  for (size_t ai = 0; ai < catSizesCount; ++ai) {
+    for (size_t bi = 0; bi < catSizesCount; ++bi) {
+      RefVector aref, bref;
+      Vector* a = vectorOf(catSizes[ai], 0, aref);
+      Vector* b = vectorOf(catSizes[bi], 1000000, bref);
+      Vector* c = a->concat(b);
+      aref.insert(aref.end(), bref.begin(), bref.end());
+      assertSameItems(c, aref);
+      a->release();
+      b->release();
+      c->release();
+    }
+  }
+  
+  // Build a relaxed vector out of many small pieces, then slice, append, pop and
+  // replace items in it
+  srand(1234);
+  RefVector ref;
+  v2 = Vector::Empty;
+  for (i = 0; i < 500; ++i) {
+    RefVector pref;
+    Vector* piece = vectorOf(1 + rand() % 70, i * 1000, pref);
+    Vector* oldV2 = v2;
+    v2 = v2->concat(piece);
+    oldV2->release();
+    piece->release();
+    ref.insert(ref.end(), pref.begin(), pref.end());
+  }
+  assertSameItems(v2, ref);
+  
+  for (i = 0; i < 200; ++i) {
+    size_t from = rand() % (ref.size() + 1);
+    size_t to = from + rand() % (ref.size() - from + 1);
+    Vector* s = v2->slice(from, to);
+    assertSameItems(s, RefVector(ref.begin() + from, ref.begin() + to));
+    if (s->count() > 0) {
+      Vector* s2 = s->concat(s);
+      RefVector sref(ref.begin() + from, ref.begin() + to);
+      sref.insert(sref.end(), ref.begin() + from, ref.begin() + to);
+      assertSameItems(s2, sref);
+      s2->release();
+    }
+    s->release();
+  }
+  
+  for (i = 0; i < 3000; ++i) {
+    Vector* oldV2 = v2;
+    v2 = v2->append((void*)(i + 7));
+    oldV2->release();
+    ref.push_back(i + 7);
+  }
+  assertSameItems(v2, ref);
+  
+  Vector::Transient* rt = v2->asTransient();
+  for (i = 0; i < 3000; ++i) {
+    rt->append((void*)i);
+    ref.push_back(i);
+  }
+  Vector* oldV2 = v2;
+  v2 = rt->persistent();
+  oldV2->release();
+  rt->release();
+  assertSameItems(v2, ref);
+  
+  for (i = 0; i < ref.size(); i += 7) {
+    Vector* oldV2 = v2;
+    v2 = v2->assoc(i, (void*)3);
+    oldV2->release();
+    ref[i] = 3;
+  }
+  assertSameItems(v2, ref);
+  
+  while (ref.size() > 10000) {
+    Vector* oldV2 = v2;
+    v2 = v2->pop();
+    oldV2->release();
+    ref.pop_back();
+    if (ref.size() % 1000 == 0) assertSameItems(v2, ref);
+  }
+  
+  v3 = v2->drop(4321);
+  v4 = v3->take(1234);
+  assertSameItems(v3, RefVector(ref.begin() + 4321, ref.end()));
+  assertSameItems(v4, RefVector(ref.begin() + 4321, ref.begin() + 4321 + 1234));
+  v2->release();
+  v3->release();
+  v4->release();
+
+  // Appending to a vector which is only referenced once writes into its tail in
+  // place. The receiver must not see the item, and neither may any vector
+  // derived from the receiver later on.
+  RefVector uref;
+  Vector* u = Vector::Empty;
+  for (i = 0; i < 1000; ++i) {
+    Vector* oldU = u;
+    u = u->append((void*)i);
+    oldU->release();
+    uref.push_back(i);
+  }
+  Vector* u2 = u->append((void*)5000); // shares u's tail
+  Vector* u3 = u2->append((void*)5001);
+  assertSameItems(u, uref);
+  u3->release();
+  u2->release();
+  u2 = u->append((void*)6000); // reuses the slot u2 and u3 wrote to
+  u3 = u->append((void*)7000); // u's tail is now shared, so this copies it
+  uref.push_back(6000);
+  assertSameItems(u2, uref);
+  uref.back() = 7000;
+  assertSameItems(u3, uref);
+  uref.pop_back();
+  assertSameItems(u, uref);
+  u3->release();
+
+  // u's tail node now holds one item more than u, which everything reading u
+  // must ignore
+  RefVector tref;
+  Vector* tv = vectorOf(10, 100000, tref);
+  v3 = u->concat(tv);
+  RefVector cref(uref);
+  cref.insert(cref.end(), tref.begin(), tref.end());
+  assertSameItems(v3, cref);
+  v3->release();
+  v3 = tv->concat(u);
+  cref = tref;
+  cref.insert(cref.end(), uref.begin(), uref.end());
+  assertSameItems(v3, cref);
+  v3->release();
+  tv->release();
+  v3 = u->assoc(uref.size() - 1, (void*)1);
+  v4 = v3->pop();
+  assertSameItems(v4, RefVector(uref.begin(), uref.end() - 1));
+  v3->release();
+  v4->release();
+  v3 = u->drop(uref.size() - 3);
+  assertSameItems(v3, RefVector(uref.end() - 3, uref.end()));
+  v3->release();
+  Vector::Transient* ut = u->asTransient();
+  ut->append((void*)8000);
+  v3 = ut->persistent();
+  ut->release();
+  cref = uref;
+  cref.push_back(8000);
+  assertSameItems(v3, cref);
+  cref.back() = 6000;
+  assertSameItems(u2, cref);
+  v3->release();
+  v3 = u->mapChunks([](void* const* items, void** result, size_t length) {
+    memcpy(result, items, sizeof(void*) * length);
+  });
+  assertSameItems(v3, uref);
+  v3->release();
+  u2->release();
+  u->release();
+
+  // appendAndRelease modifies a vector which is only referenced by the caller
+  u = Vector::Empty;
+  uref.clear();
+  for (i = 0; i < 3000; ++i) {
+    u = u->appendAndRelease((void*)i);
+    uref.push_back(i);
+    if (i == 1500) {
+      u2 = u->retain(); // shared, so the next append makes a new vector
+    }
+  }
+  assertSameItems(u, uref);
+  assertSameItems(u2, RefVector(uref.begin(), uref.begin() + 1501));
+  u->release();
+  u2->release();
+
+  // Memory usage. v holds N items in full leaves, the last of which is its tail.
+  Vector::MemoryUsage mu = v->memoryUsage();
+  assert(mu.depth == 4);
+  assert(mu.leafCount == N / 32);
+  assert(mu.fill[32] >= mu.leafCount);
+  assert(mu.relaxedCount == 0);
+  assert(mu.bytes > N * sizeof(void*));
+  assert(mu.sharedBytes == 0 && mu.sharedCount == 0);
+  Vector::MemoryUsage cheapmu = v->memoryUsage(0, true);
+  assert(memcmp(&cheapmu, &mu, sizeof(mu)) == 0);
+
+  // Replacing an item copies one path, and everything else is shared
+  v2 = v->assoc(12345, (void*)1);
+  Vector::MemoryUsage mu2 = v2->memoryUsage(v);
+  assert(mu2.bytes == mu.bytes);
+  assert(mu2.sharedCount == mu2.leafCount + mu2.branchCount - 4);
+  assert(mu2.bytes - mu2.sharedBytes < 1200);
+  cheapmu = v2->memoryUsage(v, true);
+  assert(cheapmu.sharedCount == mu2.sharedCount && cheapmu.sharedBytes == mu2.sharedBytes);
+  mu2 = v->memoryUsage(v);
+  assert(mu2.sharedBytes == mu2.bytes);
+  v2->release();
+
+  // Relaxed tries. The first vector's tail ends up in the trie with spare room,
+  // which cheap mode doesn't see.
+  RefVector aref;
+  Vector* a = vectorOf(1057, 0, aref);
+  Vector* b = vectorOf(40000, 0, aref);
+  v2 = a->concat(b);
+  mu = v2->memoryUsage(b);
+  cheapmu = v2->memoryUsage(b, true);
+  assert(mu.relaxedCount > 0);
+  assert(mu.leafCount == cheapmu.leafCount && mu.branchCount == cheapmu.branchCount);
+  assert(memcmp(mu.fill, cheapmu.fill, sizeof(mu.fill)) == 0);
+  assert(cheapmu.bytes < mu.bytes);
+  assert(mu.sharedCount == cheapmu.sharedCount);
+  assert(mu.sharedCount >= 40000 / 32 - 2);
+  a->release();
+  b->release();
+  v2->release();
+
+  // Write vectors to a file and map them back in: v, a relaxed vector which
+  // holds the same subtrees twice, a vector whose tail node has grown past its
+  // own items, a vector with only a tail and the empty vector
+  char path[] = "/tmp/test_vector.XXXXXX";
+  int fd = mkstemp(path);
+  assert(fd != -1);
+  close(fd);
+  a = vectorOf(40000, 0, aref);
+  RefVector aaref(aref);
+  aaref.insert(aaref.end(), aref.begin(), aref.end());
+  Vector* aa = a->concat(a);
+  u = aa->append((void*)1);
+  u2 = u->append((void*)2);
+  RefVector uref2(aaref);
+  uref2.push_back(1);
+  b = vectorOf(5, 0, tref);
+  RefVector vref;
+  for (i = 0; i < N; ++i) vref.push_back(i * 10);
+  const Vector* written[] = { v, aa, u, b, Vector::Empty };
+  const RefVector* writtenRefs[] = { &vref, &aaref, &uref2, &tref, &cref };
+  cref.clear();
+  for (size_t wi = 0; wi < sizeof(written) / sizeof(written[0]); ++wi) {
+    assert(written[wi]->writeFile(path));
+    Vector::Mapping* m = Vector::Mapping::open(path);
+    assert(m != 0);
+    Vector* mv = m->vector();
+    const RefVector& mref = *writtenRefs[wi];
+    assertSameItems(mv, mref);
+    // The mapped nodes are copied when modified
+    RefVector mref2(mref);
+    v2 = mv->append((void*)3);
+    mref2.push_back(3);
+    if (mref.size() > 100) {
+      v3 = v2->assoc(100, (void*)4);
+      mref2[100] = 4;
+      v4 = v3->pop();
+      mref2.pop_back();
+      assertSameItems(v4, mref2);
+      v3->release();
+      v4->release();
+    }
+    v2->release();
+    v2 = mv->appendAndRelease((void*)5);
+    assert(v2 != mv);
+    v2->release();
+    Vector::Transient* mt = mv->asTransient();
+    for (i = 0; i < 100; ++i) mt->append((void*)i);
+    v2 = mt->persistent();
+    mt->release();
+    assert(v2->count() == mref.size() + 100);
+    v2->release();
+    assertSameItems(mv, mref);
+    m->release();
+  }
+  unlink(path);
+  assert(Vector::Mapping::open(path) == 0 && errno == ENOENT);
+  fd = open(path, O_WRONLY | O_CREAT, 0600);
+  assert(fd != -1 && write(fd, "not a vector, just some text", 28) == 28);
+  close(fd);
+  assert(Vector::Mapping::open(path) == 0 && errno == EINVAL);
+
+  // Files which are corrupt are refused rather than crashing readers later.
+  // w holds 2000 items: a root at level 10 over two branches of 32 and 30
+  // leaves, and a tail of 16 items. The nodes start with a 16 byte header of
+  // the refcount, length, capacity, relaxed and branch, and the vector with
+  // its refcount, count, shift, tail length, root and tail.
+  Vector* w = vectorOf(2000, 0, tref);
+  assert(w->writeFile(path));
+  std::vector<char> file;
+  {
+    FILE* f = fopen(path, "rb");
+    char buf[4096];
+    for (size_t n; (n = fread(buf, 1, sizeof(buf), f)) != 0; ) file.insert(file.end(), buf, buf + n);
+    fclose(f);
+  }
+  uint64_t branchesOffset = *(uint64_t*)&file[32];
+  uint64_t vectorOffset = *(uint64_t*)&file[40];
+  uint64_t leafOffset = 48, rootOffset = vectorOffset - 32;
+  uint64_t tailOffset = branchesOffset - (16 + 16 * sizeof(void*));
+  uint8_t byte = 0;
+  uint64_t word = 0;
+  Vector::Mapping* m = openPatched(path, file, 0, &byte, 0);
+  assert(m != 0);
+  assertSameItems(m->vector(), tref);
+  m->release();
+  byte = 1; // a leaf marked as a branch
+  assert(openPatched(path, file, leafOffset + 11, &byte, 1) == 0 && errno == EINVAL);
+  byte = 33; // a leaf which is too long
+  assert(openPatched(path, file, leafOffset + 8, &byte, 1) == 0 && errno == EINVAL);
+  word = 1; // a reference counted leaf, which append would retain
+  assert(openPatched(path, file, leafOffset, &word, 8) == 0 && errno == EINVAL);
+  word = leafOffset + 16; // a child in the middle of a node
+  assert(openPatched(path, file, rootOffset + 16, &word, 8) == 0 && errno == EINVAL);
+  word = leafOffset; // a child at the wrong level
+  assert(openPatched(path, file, rootOffset + 16, &word, 8) == 0 && errno == EINVAL);
+  word = tailOffset; // a child of a regular node which isn't full
+  assert(openPatched(path, file, branchesOffset + 16, &word, 8) == 0 && errno == EINVAL);
+  word = 2001; // a count which doesn't match the trie
+  assert(openPatched(path, file, vectorOffset + 8, &word, 8) == 0 && errno == EINVAL);
+  uint32_t shift = 5; // a shift which doesn't match the root
+  assert(openPatched(path, file, vectorOffset + 16, &shift, 4) == 0 && errno == EINVAL);
+  file[vectorOffset + 8] = (char)(2001 & 0xff); // a tail length past the tail
+  byte = 17;
+  assert(openPatched(path, file, vectorOffset + 20, &byte, 1) == 0 && errno == EINVAL);
+  w->release();
+  unlink(path);
+  a->release();
+  aa->release();
+  u->release();
+  u2->release();
+  b->release();
+
+  // Equality and hashing. Vectors with the same items are equal and have the
+  // same hash however they were built.
+  assert(Vector::Empty->equals(Vector::Empty));
+  a = vectorOf(40000, 0, aref);
+  b = Vector::fromArray((void* const*)&aref[0], aref.size());
+  assert(a->equals(b) && b->equals(a));
+  assert(a->hash() == b->hash());
+  assert(a->hash() == a->hash()); // cached
+  assert(!a->equals(Vector::Empty) && !Vector::Empty->equals(a));
+  assert(a->hash() != Vector::Empty->hash());
+  v2 = vectorOf(1057, 0, tref);
+  v3 = vectorOf(40000 - 1057, 1057, cref);
+  v4 = v2->concat(v3); // relaxed
+  assert(v4->equals(a) && a->equals(v4));
+  {
+    std::vector<size_t> indices;
+    for (i = 0; i < 40000; i += 7) indices.push_back((i * 7919) % 40000);
+    std::vector<void*> gathered(indices.size());
+    v4->itemsAt(&indices[0], indices.size(), &gathered[0]);
+    for (size_t k = 0; k < indices.size(); ++k) assert((uint64_t)gathered[k] == indices[k]);
+  }
+  assert(v4->hash() == a->hash());
+  v2->release();
+  v3->release();
+  v4->release();
+
+  // Versions which share most of their trie
+  v2 = a->assoc(12345, (void*)7);
+  assert(!v2->equals(a) && !a->equals(v2));
+  assert(v2->hash() != a->hash());
+  v3 = v2->assoc(12345, (void*)12345);
+  assert(v3->equals(a) && v3->hash() == a->hash());
+  v4 = a->pop();
+  assert(!v4->equals(a));
+  assert(v4->hash() != a->hash());
+  u = v4->append((void*)39999);
+  assert(u->equals(a) && u->hash() == a->hash());
+  v2->release();
+  v3->release();
+  v4->release();
+  u->release();
+
+  // Hashes cached in nodes which are later modified in place are recomputed
+  u = Vector::Empty;
+  for (i = 0; i < 5000; ++i) u = u->appendAndRelease((void*)i);
+  size_t uhash = u->hash();
+  for (i = 5000; i < 40000; ++i) u = u->appendAndRelease((void*)i);
+  assert(uhash != u->hash());
+  assert(u->equals(a) && u->hash() == a->hash());
+  Vector::Transient* ht = u->asTransient();
+  u->release(); // the transient now owns the trie
+  for (i = 0; i < 1000; ++i) ht->append((void*)i);
+  u = ht->persistent();
+  ht->release();
+  aref.insert(aref.end(), aref.begin(), aref.begin() + 1000);
+  v2 = Vector::fromArray((void* const*)&aref[0], aref.size());
+  assert(u->equals(v2) && u->hash() == v2->hash());
+  u->release();
+  v2->release();
+  a->release();
+  b->release();
+
+  // Vectors held by value
+  VectorRef r;
+  RefVector rref;
+  for (i = 0; i < 3000; ++i) {
+    r = r.appendAndRelease((void*)i);
+    rref.push_back(i);
+  }
+  VectorRef r2 = r.append((void*)12345); // writes into r's tail in place
+  VectorRef r3 = r.retain().appendAndRelease((void*)54321); // r is shared, so this copies
+  assert(r.count() == 3000 && r2.count() == 3001 && r3.count() == 3001);
+  assert((uint64_t)r2.itemAt(3000) == 12345 && (uint64_t)r3.itemAt(3000) == 54321);
+  Vector* boxed = r.box();
+  assertSameItems(boxed, rref);
+  VectorRef r4(boxed);
+  boxed->release();
+  for (i = 0; i < 3000; ++i) assert((uint64_t)r4.itemAt(i) == i);
+  for (i = 0; i < r4.count(); ) {
+    void* const* items;
+    size_t n = r4.chunkAt(i, items);
+    for (size_t j = 0; j < n; ++j) assert((uint64_t)items[j] == i + j);
+    i += n;
+  }
+  assert(i == 3000);
+  r.release();
+  r2.release();
+  r3.release();
+  r4.release();
+  VectorRef emptyRef;
+  assert(emptyRef.count() == 0 && emptyRef.box() == Vector::Empty);
+  emptyRef.release();
+
+  // Deferred release. Nothing is freed until the queue is drained, which
+  // happens a few objects at a time.
+  {
+    size_t liveNodes = DEBUG_LIVECOUNT_Node;
+    Vector* big = Vector::Empty;
+    for (size_t i = 0; i < 100000; ++i) big = big->appendAndRelease((void*)i);
+    size_t bigNodes = DEBUG_LIVECOUNT_Node - liveNodes;
+    setDeferredRelease(true);
+    big->release();
+    assert(DEBUG_LIVECOUNT_Node - liveNodes == bigNodes);
+    assert(pendingReleases() == 1);
+    size_t drains = 0;
+    while (!drainReleases(1)) {
+      ++drains;
+      assert(pendingReleases() <= 32 * 4); // siblings along one path
+    }
+    assert(drains > 1);
+    assert(DEBUG_LIVECOUNT_Node == liveNodes);
+
+    // Turning it off destroys whatever is queued
+    big = Vector::Empty;
+    for (size_t i = 0; i < 5000; ++i) big = big->appendAndRelease((void*)i);
+    big->release();
+    assert(pendingReleases() != 0);
+    setDeferredRelease(false);
+    assert(pendingReleases() == 0);
+    assert(DEBUG_LIVECOUNT_Node == liveNodes);
+  }
+
   // Release the vector
   ((Vector*)v)->release();
   v = 0;
@@ -0,0 +1,174 @@
+#include "../src/runtime/Vector.h"
+#include "../src/runtime/runtime.h"
+
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using namespace hue;
+
+// Reads a field of a vector or node the way generated code does
+template <typename T> static T fieldAt(const void* p, size_t offset) {
+  return *(const T*)((const uint8_t*)p + offset);
+}
+
+// Looks up item i like the code which the compiler emits inline, returning
+// false if i isn't in the tail
+static bool inlineItemAt(const Vector* v, int64_t i, void*& item) {
+  int64_t count = fieldAt<int64_t>(v, HUE_VECTOR_COUNT_OFFSET);
+  uint64_t tailLength = fieldAt<uint8_t>(v, HUE_VECTOR_TAIL_LENGTH_OFFSET);
+  uint64_t index = (uint64_t)(i - (count - (int64_t)tailLength));
+  if (index >= tailLength) return false;
+  const void* tail = fieldAt<const void*>(v, HUE_VECTOR_TAIL_OFFSET);
+  item = fieldAt<void*>(tail, HUE_VECTOR_NODE_ITEMS_OFFSET + sizeof(void*) * index);
+  return true;
+}
+
+// A vector laid out statically, as a compiler would lay out a list of
+// constants: one full leaf in the trie and 8 items in the tail, all
+// Unretainable and read-only
+struct StaticNode {
+  uint64_t refcount; uint8_t length, capacity, relaxed, branch; uint32_t hash;
+  const void* items[32];
+};
+struct StaticVector {
+  uint64_t refcount; int64_t count; uint32_t shift; uint8_t tailLength;
+  const StaticNode* root; const StaticNode* tail;
+};
+#define ITEMS4(n) (const void*)(n), (const void*)(n + 1), (const void*)(n + 2), (const void*)(n + 3)
+#define ITEMS8(n) ITEMS4(n), ITEMS4(n + 4)
+static const StaticNode staticLeaf = { Unretainable, 32, 32, 0, 0, 0,
+  { ITEMS8(100), ITEMS8(108), ITEMS8(116), ITEMS8(124) } };
+static const StaticNode staticTail = { Unretainable, 8, 8, 0, 0, 0, { ITEMS8(132) } };
+static const StaticNode staticRoot = { Unretainable, 1, 1, 0, 1, 0, { &staticLeaf } };
+static const StaticVector staticVector = { Unretainable, 40, 5, 8, &staticRoot, &staticTail };
+
+int main() {
+  std::vector<void*> items;
+  for (uint64_t i = 0; i < 1000; ++i) items.push_back((void*)(i * 3));
+
+  Vector* v = hue_vector_create(&items[0], items.size());
+  assert(hue_vector_count(v) == 1000);
+  for (int64_t i = 0; i < 1000; ++i) assert(hue_vector_item_at(v, i) == items[i]);
+
+  // Chunks cover all items in order
+  int64_t offset = 0;
+  while (offset < hue_vector_count(v)) {
+    void* const* chunk;
+    int64_t n = hue_vector_chunk_at(v, offset, &chunk);
+    assert(n > 0 && n <= 32);
+    for (int64_t i = 0; i < n; ++i) assert(chunk[i] == items[offset + i]);
+    offset += n;
+  }
+  assert(offset == 1000);
+  void* const* chunk;
+  assert(hue_vector_chunk_at(v, 1000, &chunk) == 0);
+  assert(hue_vector_chunk_at(v, -1, &chunk) == 0);
+
+  // Appending leaves the receiver untouched, also when the new item goes into
+  // the receiver's tail node
+  Vector* v2 = hue_vector_append(v, (void*)7);
+  Vector* v3 = hue_vector_append(v2, (void*)8);
+  assert(hue_vector_count(v) == 1000 && hue_vector_count(v2) == 1001);
+  assert(hue_vector_item_at(v3, 1000) == (void*)7 && hue_vector_item_at(v3, 1001) == (void*)8);
+  assert(hue_vector_chunk_at(v2, 992, &chunk) == 9);
+
+  // The layout which generated code relies on
+  const Vector* vectors[] = { v, v2, v3, Vector::Empty };
+  for (size_t vi = 0; vi < sizeof(vectors) / sizeof(vectors[0]); ++vi) {
+    const Vector* vv = vectors[vi];
+    int64_t count = hue_vector_count(vv);
+    assert(fieldAt<int64_t>(vv, HUE_VECTOR_COUNT_OFFSET) == count);
+    for (int64_t i = 0; i < count; ++i) {
+      void* item;
+      bool inTail = inlineItemAt(vv, i, item);
+      if (inTail) assert(item == hue_vector_item_at(vv, i));
+      if (i == count - 1) assert(inTail);
+    }
+    void* item;
+    assert(!inlineItemAt(vv, count, item));
+    assert(!inlineItemAt(vv, -1, item));
+  }
+
+  // A static vector can be read, appended to and released like any other
+  Vector* sv = (Vector*)&staticVector;
+  assert(hue_vector_count(sv) == 40);
+  for (int64_t i = 0; i < 40; ++i) assert(hue_vector_item_at(sv, i) == (void*)(100 + i));
+  assert(hue_vector_chunk_at(sv, 0, &chunk) == 32 && chunk[31] == (void*)131);
+  assert(hue_vector_chunk_at(sv, 35, &chunk) == 5 && chunk[0] == (void*)135);
+  assert(hue_vector_retain(sv) == sv);
+  hue_vector_release(sv);
+  Vector* sv2 = sv;
+  for (uint64_t i = 140; i < 1200; ++i) {
+    Vector* prev = sv2;
+    sv2 = hue_vector_append(sv2, (void*)i);
+    hue_vector_release(prev);
+  }
+  assert(hue_vector_count(sv) == 40 && hue_vector_count(sv2) == 1100);
+  for (int64_t i = 0; i < 1100; ++i) assert(hue_vector_item_at(sv2, i) == (void*)(100 + i));
+  hue_vector_release(sv2);
+
+  // ...and held by value
+  VectorRef sr, sr2;
+  hue_vector_ref_unbox(sv, &sr);
+  assert(sr.count() == 40 && hue_vector_ref_item_at(&sr, 39) == (void*)139);
+  hue_vector_ref_append(&sr, (void*)140, &sr2);
+  assert(sr.count() == 40 && sr2.count() == 41);
+  for (uint64_t i = 141; i < 1200; ++i) sr2 = sr2.appendAndRelease((void*)i);
+  for (int64_t i = 0; i < 1100; ++i) assert(hue_vector_ref_item_at(&sr2, i) == (void*)(100 + i));
+  for (int64_t i = 0; i < 40; ++i) assert(hue_vector_item_at(sv, i) == (void*)(100 + i));
+  hue_vector_ref_release(&sr2);
+  hue_vector_ref_release(&sr);
+  hue_vector_release(sv);
+
+  // Vectors held by value
+  assert(sizeof(VectorRef) == HUE_VECTOR_REF_SIZE);
+  VectorRef r, r2;
+  hue_vector_ref_create(&items[0], items.size(), &r);
+  hue_vector_ref_append(&r, (void*)7, &r2);
+  assert(r.count() == 1000 && r2.count() == 1001);
+  assert(fieldAt<int64_t>(&r2, HUE_VECTOR_REF_COUNT_OFFSET) == 1001);
+  assert(fieldAt<uint8_t>(&r2, HUE_VECTOR_REF_TAIL_LENGTH_OFFSET) == 9);
+  const void* tail = fieldAt<const void*>(&r2, HUE_VECTOR_REF_TAIL_OFFSET);
+  assert(fieldAt<void*>(tail, HUE_VECTOR_NODE_ITEMS_OFFSET + sizeof(void*) * 8) == (void*)7);
+  for (int64_t i = 0; i < 1000; ++i) assert(hue_vector_ref_item_at(&r2, i) == items[i]);
+  assert(hue_vector_ref_item_at(&r2, 1000) == (void*)7);
+  Vector* boxed = hue_vector_ref_box(&r2);
+  assert(hue_vector_count(boxed) == 1001 && hue_vector_item_at(boxed, 1000) == (void*)7);
+  VectorRef r3;
+  hue_vector_ref_unbox(boxed, &r3);
+  hue_vector_release(boxed);
+  assert(r3.count() == 1001 && hue_vector_ref_item_at(&r3, 1000) == (void*)7);
+  hue_vector_ref_retain(&r3);
+  hue_vector_ref_release(&r3);
+  hue_vector_ref_release(&r3);
+
+  // Building a vector by value without leaking the versions it replaces
+  size_t liveNodes = Pool::stats().allocCount - Pool::stats().deallocCount;
+  VectorRef built;
+  for (uint64_t i = 0; i < 1000; ++i) hue_vector_ref_append_and_release(&built, (void*)i);
+  assert(built.count() == 1000);
+  for (int64_t i = 0; i < 1000; ++i) assert(hue_vector_ref_item_at(&built, i) == (void*)i);
+  VectorRef shared = built;
+  hue_vector_ref_retain(&shared);
+  hue_vector_ref_append_and_release(&built, (void*)1000);
+  assert(shared.count() == 1000 && built.count() == 1001);
+  hue_vector_ref_release(&shared);
+  hue_vector_ref_release(&built);
+  assert(Pool::stats().allocCount - Pool::stats().deallocCount == liveNodes);
+  hue_vector_ref_release(&r2);
+  hue_vector_ref_release(&r);
+
+  // Empty
+  Vector* e = hue_vector_create(0, 0);
+  assert(e == Vector::Empty && hue_vector_count(e) == 0);
+  hue_vector_release(e);
+
+  assert(hue_vector_retain(v) == v);
+  hue_vector_release(v);
+  hue_vector_release(v);
+  hue_vector_release(v2);
+  hue_vector_release(v3);
+
+  return 0;
+}
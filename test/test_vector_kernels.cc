@@ -0,0 +1,146 @@
+#define DEBUG_TypedNode_refcount
+#define DEBUG_TypedVector_refcount
+#include "../src/runtime/VectorKernels.h"
+
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using namespace hue;
+
+struct IsOdd {
+  template <typename T> bool operator()(T x) const { return ((int64_t)x & 1) != 0; }
+};
+
+template <typename V>
+static void assertItems(const V* v, const std::vector<typename V::Item>& ref) {
+  assert(v->count() == ref.size());
+  for (size_t i = 0; i < ref.size(); ++i) assert(v->itemAt(i) == ref[i]);
+}
+
+template <typename V>
+static void testKernels(size_t N) {
+  typedef typename V::Item T;
+  std::vector<T> ref;
+  for (size_t i = 0; i < N; ++i) {
+    // Goes up and down so min and max aren't at the ends
+    ref.push_back((T)((i * 37) % 101 + (i % 7 == 3 ? 50 : 0)));
+  }
+  V* v = V::fromArray(ref.data(), ref.size());
+
+  // Reductions
+  typename kernels::SumType<T>::type s = 0;
+  size_t odd = 0;
+  for (size_t i = 0; i < N; ++i) {
+    s += ref[i];
+    if ((int64_t)ref[i] & 1) ++odd;
+  }
+  assert(kernels::sum(v) == s);
+  assert(kernels::countIf(v, IsOdd()) == odd);
+  if (N == 0) {
+    bool thrown = false;
+    try { kernels::min(v); } catch (std::out_of_range&) { thrown = true; }
+    assert(thrown);
+  } else {
+    T lo = ref[0], hi = ref[0];
+    for (size_t i = 0; i < N; ++i) {
+      if (ref[i] < lo) lo = ref[i];
+      if (ref[i] > hi) hi = ref[i];
+    }
+    assert(kernels::min(v) == lo);
+    assert(kernels::max(v) == hi);
+  }
+
+  // Maps
+  std::vector<T> ref2(ref);
+  for (size_t i = 0; i < N; ++i) ref2[i] = (T)(ref2[i] + 3);
+  V* v2 = kernels::add(v, (T)3);
+  assertItems(v2, ref2);
+  assertItems(v, ref);
+
+  for (size_t i = 0; i < N; ++i) ref2[i] = (T)(ref2[i] * 2);
+  V* v3 = kernels::mul(v2, (T)2);
+  assertItems(v3, ref2);
+
+  for (size_t i = 0; i < N; ++i) ref2[i] = (T)(ref2[i] + ref[i]);
+  V* v4 = kernels::add(v3, v);
+  assertItems(v4, ref2);
+
+  // Maps which don't change anything return the input. For floating point,
+  // that's adding -0.0 (which is 0 for integers).
+  V* same = kernels::add(v, (T)-0.0);
+  assert(same == v);
+  same->release();
+
+  // Equality
+  assert(kernels::equals(v, v));
+  V* copy = V::fromArray(ref.data(), ref.size());
+  assert(kernels::equals(v, copy));
+  assert(N == 0 || !kernels::equals(v, v2));
+  if (N > 1) {
+    V* popped = v->pop();
+    assert(!kernels::equals(v, popped));
+    V* changed = v->assoc(N / 2, (T)(ref[N / 2] + 1));
+    assert(!kernels::equals(v, changed));
+    V* restored = changed->assoc(N / 2, ref[N / 2]);
+    assert(kernels::equals(v, restored));
+    popped->release();
+    changed->release();
+    restored->release();
+  }
+
+  copy->release();
+  v4->release();
+  v3->release();
+  v2->release();
+  v->release();
+}
+
+int main() {
+  size_t sizes[] = { 0, 1, 2, 7, 31, 32, 33, 257, 1000, 40000 };
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+    testKernels<IntVector>(sizes[i]);
+    testKernels<FloatVector>(sizes[i]);
+    testKernels<ByteVector>(sizes[i]);
+    testKernels<CharVector>(sizes[i]);
+  }
+
+  // Adding +0.0 isn't skipped, since it turns -0.0 into +0.0
+  double zeros[] = { -0.0, 0.0, 1.5 };
+  FloatVector* z = FloatVector::fromArray(zeros, 3);
+  FloatVector* z2 = kernels::add(z, 0.0);
+  assert(z2 != z && !kernels::equals(z, z2));
+  assert(!signbit(z2->itemAt(0)) && z2->itemAt(2) == 1.5);
+  z->release();
+  z2->release();
+
+  // Adding vectors of different counts is an error
+  IntVector* a = IntVector::Empty->append(1);
+  bool thrown = false;
+  try { kernels::add(a, IntVector::Empty); } catch (std::invalid_argument&) { thrown = true; }
+  assert(thrown);
+  a->release();
+
+  // Boxed vectors are summed as integers
+  Vector* v = Vector::Empty;
+  uint64_t s = 0;
+  for (uint64_t i = 0; i < 10000; ++i) {
+    Vector* oldV = v;
+    v = v->append((void*)i);
+    oldV->release();
+    s += i;
+  }
+  assert(kernels::sum(v) == s);
+  v->release();
+
+  // Verify that there are no leaks
+  #ifdef DEBUG_LIVECOUNT_TypedNode
+  assert(DEBUG_LIVECOUNT_TypedNode == 0);
+  #endif
+
+  #ifdef DEBUG_LIVECOUNT_TypedVector
+  assert(DEBUG_LIVECOUNT_TypedVector == 0);
+  #endif
+
+  return 0;
+}
@@ -0,0 +1,142 @@
+#define DEBUG_Node_refcount
+#define DEBUG_Vector_refcount
+#define DEBUG_TypedNode_refcount
+#define DEBUG_TypedVector_refcount
+#include "../src/runtime/VectorParallel.h"
+#include "../src/runtime/VectorKernels.h"
+
+#include <thread>
+#include <vector>
+
+using std::cerr;
+using std::endl;
+using namespace hue;
+
+int main() {
+  // More threads than cores, so that tasks really are interleaved
+  WorkPool* workers = new WorkPool(7);
+  WorkPool& pool = *workers;
+
+  // Nested groups. Each task spawns tasks of its own and waits for them.
+  std::atomic<size_t> leaves(0);
+  {
+    WorkPool::Group group(pool);
+    for (int i = 0; i < 16; ++i) {
+      group.spawn([&pool, &leaves] {
+        WorkPool::Group inner(pool);
+        for (int j = 0; j < 16; ++j) inner.spawn([&leaves] { ++leaves; });
+        inner.wait();
+      });
+    }
+    group.wait();
+  }
+  assert(leaves == 256);
+
+  size_t sizes[] = { 0, 1, 33, 1057, 100000, 2000000 };
+  size_t grains[] = { 1, 1000, parallel::DefaultGrain };
+  for (size_t si = 0; si < sizeof(sizes) / sizeof(sizes[0]); ++si) {
+    size_t N = sizes[si];
+    std::vector<int64_t> ref(N);
+    int64_t expectedSum = 0;
+    for (size_t i = 0; i < N; ++i) {
+      ref[i] = (int64_t)(i * 3) - 1000;
+      expectedSum += ref[i];
+    }
+    IntVector* v = IntVector::fromArray(ref.data(), N);
+
+    // A boxed vector with relaxed nodes
+    Vector* bv = Vector::Empty;
+    for (size_t part = 0; part < 3; ++part) {
+      Vector::Transient* t = Vector::Empty->asTransient();
+      for (size_t i = part * N / 3; i < (part + 1) * N / 3; ++i) t->append((void*)ref[i]);
+      Vector* pv = t->persistent();
+      t->release();
+      Vector* oldBv = bv;
+      bv = bv->concat(pv);
+      oldBv->release();
+      pv->release();
+    }
+    size_t bN = bv->count();
+
+    for (size_t gi = 0; gi < sizeof(grains) / sizeof(grains[0]); ++gi) {
+      size_t grain = grains[gi];
+
+      int64_t s = parallel::reduce(v, (int64_t)0,
+        [](int64_t acc, const int64_t* items, size_t length) {
+          return acc + kernels::span::sum(items, length);
+        },
+        [](int64_t a, int64_t b) { return a + b; }, grain, pool);
+      assert(s == expectedSum);
+
+      // Every item is visited once, at the right offset
+      std::vector<int64_t> seen(N, 0);
+      parallel::forEach(v, [&seen](const int64_t* items, size_t length, size_t offset) {
+        for (size_t i = 0; i < length; ++i) seen[offset + i] = items[i];
+      }, grain, pool);
+      assert(seen == ref);
+
+      IntVector* doubled = parallel::map(v, [](const int64_t* items, int64_t* result, size_t length) {
+        for (size_t i = 0; i < length; ++i) result[i] = items[i] * 2;
+      }, grain, pool);
+      assert(doubled->count() == N);
+      for (size_t i = 0; i < N; ++i) assert(doubled->itemAt(i) == ref[i] * 2);
+      doubled->release();
+
+      // Boxed vectors
+      std::vector<int64_t> bseen(bN, 0);
+      parallel::forEach(bv, [&bseen](void* const* items, size_t length, size_t offset) {
+        for (size_t i = 0; i < length; ++i) bseen[offset + i] = (int64_t)items[i];
+      }, grain, pool);
+      for (size_t i = 0; i < bN; ++i) assert(bseen[i] == (int64_t)bv->itemAt(i));
+
+      Vector* bdoubled = parallel::map(bv, [](void* const* items, void** result, size_t length) {
+        for (size_t i = 0; i < length; ++i) result[i] = (void*)((int64_t)items[i] * 2);
+      }, grain, pool);
+      assert(bdoubled->count() == bN);
+      for (size_t i = 0; i < bN; ++i) assert((int64_t)bdoubled->itemAt(i) == (int64_t)bv->itemAt(i) * 2);
+      bdoubled->release();
+    }
+
+    v->release();
+    bv->release();
+  }
+
+  // Two threads hash the same vector at once, each caching the hashes of the
+  // nodes they share
+  {
+    std::vector<void*> items(100000);
+    for (size_t i = 0; i < items.size(); ++i) items[i] = (void*)(i * 7);
+    Vector* v = Vector::fromArray(&items[0], items.size());
+    Vector* u = Vector::fromArray(&items[0], items.size());
+    size_t expected = u->hash();
+    size_t hashes[2] = { 0, 0 };
+    std::thread a([v, &hashes] { hashes[0] = v->hash(); });
+    std::thread b([v, u, &hashes] { hashes[1] = v->hash(); assert(v->equals(u)); });
+    a.join();
+    b.join();
+    assert(hashes[0] == expected && hashes[1] == expected);
+    assert(v->hash() == expected);
+    v->release();
+    u->release();
+  }
+
+  // Verify that there are no leaks. Objects released by a thread other than
+  // the one which created them are freed once their creator merges them,
+  // which the workers do as they exit.
+  delete workers;
+  mergeQueuedReleases();
+  #ifdef DEBUG_LIVECOUNT_Node
+  assert(DEBUG_LIVECOUNT_Node == 0);
+  #endif
+  #ifdef DEBUG_LIVECOUNT_Vector
+  assert(DEBUG_LIVECOUNT_Vector == 0);
+  #endif
+  #ifdef DEBUG_LIVECOUNT_TypedNode
+  assert(DEBUG_LIVECOUNT_TypedNode == 0);
+  #endif
+  #ifdef DEBUG_LIVECOUNT_TypedVector
+  assert(DEBUG_LIVECOUNT_TypedVector == 0);
+  #endif
+
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include "../src/runtime/Vector.h"
+#include "../src/runtime/VectorKernels.h"
 #include <stdlib.h>
 #include <time.h>
 
@@ -30,14 +31,185 @@ int main(int argc, char **argv) {
   
   clock_t start2 = clock();
 
+  uint64_t sum = 0;
   for (i = 0; i < N; ++i) {
-    uint64_t _ = (uint64_t)v->itemAt(i);
-    _ += 1; // avoid stripping
+    sum += (uint64_t)v->itemAt(i);
   }
   
   double ms2 = ((double)(clock() - start2)) / CLOCKS_PER_SEC * 1000.0;
   cerr << "Accessing all " << N << " values: " << ms2 << " ms (avg " << ((ms2 / N) * 1000000.0) << " ns/access)" << endl;
   
+  clock_t start5 = clock();
+  
+  uint64_t chunksum = 0;
+  void* const* chunk;
+  size_t length;
+  Vector::ChunkIterator it(v);
+  while (it.next(chunk, length)) {
+    for (size_t ci = 0; ci < length; ++ci) chunksum += (uint64_t)chunk[ci];
+  }
+  
+  double ms5 = ((double)(clock() - start5)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Iterating over all " << N << " values in chunks: " << ms5 << " ms (avg " << ((ms5 / N) * 1000000.0) << " ns/access)" << endl;
+  if (sum != chunksum) cerr << "sums differ: " << sum << " != " << chunksum << endl; // also avoids stripping
+  
+  clock_t start11 = clock();
+  uint64_t kernelsum = kernels::sum(v);
+  double ms11 = ((double)(clock() - start11)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Summing all " << N << " values using kernels::sum: " << ms11 << " ms (avg " << ((ms11 / N) * 1000000.0) << " ns/value)" << endl;
+  if (sum != kernelsum) cerr << "sums differ: " << sum << " != " << kernelsum << endl;
+  
+  // Random indices, as in a join which looks up items by key
+  size_t* indices = (size_t*)malloc(sizeof(size_t) * N);
+  void** gathered = (void**)malloc(sizeof(void*) * N);
+  uint64_t r = 88172645463325252ull;
+  for (i = 0; i < N; ++i) {
+    r ^= r << 13; r ^= r >> 7; r ^= r << 17;
+    indices[i] = r % N;
+  }
+  
+  clock_t start15 = clock();
+  
+  uint64_t randomsum = 0;
+  for (i = 0; i < N; ++i) {
+    randomsum += (uint64_t)v->itemAt(indices[i]);
+  }
+  
+  double ms15 = ((double)(clock() - start15)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Accessing " << N << " random values: " << ms15 << " ms (avg " << ((ms15 / N) * 1000000.0) << " ns/access)" << endl;
+  
+  clock_t start16 = clock();
+  
+  v->itemsAt(indices, N, gathered);
+  uint64_t gathersum = 0;
+  for (i = 0; i < N; ++i) gathersum += (uint64_t)gathered[i];
+  
+  double ms16 = ((double)(clock() - start16)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Accessing " << N << " random values using itemsAt: " << ms16 << " ms (avg " << ((ms16 / N) * 1000000.0) << " ns/access)" << endl;
+  if (randomsum != gathersum) cerr << "sums differ: " << randomsum << " != " << gathersum << endl;
+  free(indices);
+  free(gathered);
+  
+  clock_t start12 = clock();
+  
+  Vector* va = Vector::Empty;
+  for (i = 0; i < N; ++i) {
+    va = va->appendAndRelease((void*)(i * 2));
+  }
+  
+  double ms12 = ((double)(clock() - start12)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Inserting " << N << " values using appendAndRelease: " << ms12 << " ms (avg " << ((ms12 / N) * 1000000.0) << " ns/insert)" << endl;
+  
+  assert(va->count() == N);
+  va->release();
+  
+  clock_t start3 = clock();
+  
+  Vector::Transient* t = Vector::Empty->asTransient();
+  for (i = 0; i < N; ++i) {
+    t->append((void*)(i * 2));
+  }
+  Vector* v2 = t->persistent();
+  t->release();
+  
+  double ms3 = ((double)(clock() - start3)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Inserting " << N << " values using a transient: " << ms3 << " ms (avg " << ((ms3 / N) * 1000000.0) << " ns/insert)" << endl;
+  
+  assert(v2->count() == N);
+  v2->release();
+  
+  void** items = (void**)malloc(sizeof(void*) * N);
+  for (i = 0; i < N; ++i) items[i] = (void*)(i * 2);
+  
+  clock_t start4 = clock();
+  Vector* v3 = Vector::fromArray(items, N);
+  double ms4 = ((double)(clock() - start4)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Building from an array of " << N << " values: " << ms4 << " ms (avg " << ((ms4 / N) * 1000000.0) << " ns/value)" << endl;
+  
+  assert(v3->count() == N);
+  v3->release();
+  free(items);
+  
+  clock_t start6 = clock();
+  
+  Vector* v4 = v->retain();
+  for (i = 0; i < N; ++i) {
+    Vector* oldV4 = v4;
+    v4 = v4->assoc(i, (void*)i);
+    oldV4->release();
+  }
+  
+  double ms6 = ((double)(clock() - start6)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Replacing all " << N << " values: " << ms6 << " ms (avg " << ((ms6 / N) * 1000000.0) << " ns/assoc)" << endl;
+  
+  clock_t start7 = clock();
+  
+  for (i = 0; i < N; ++i) {
+    Vector* oldV4 = v4;
+    v4 = v4->pop();
+    oldV4->release();
+  }
+  
+  double ms7 = ((double)(clock() - start7)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Popping all " << N << " values: " << ms7 << " ms (avg " << ((ms7 / N) * 1000000.0) << " ns/pop)" << endl;
+  
+  assert(v4->count() == 0);
+  v4->release();
+  
+  const size_t R = 1000;
+  clock_t start8 = clock();
+  
+  for (i = 0; i < R; ++i) {
+    Vector* c = v->concat(v);
+    c->release();
+  }
+  
+  double ms8 = ((double)(clock() - start8)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Concatenating two vectors of " << N << " values " << R << " times: " << ms8 << " ms (avg " << ((ms8 / R) * 1000000.0) << " ns/concat)" << endl;
+  
+  clock_t start9 = clock();
+  
+  for (i = 0; i < R; ++i) {
+    Vector* sv = v->slice((i % N) / 2, N - (i % N) / 2);
+    sv->release();
+  }
+  
+  double ms9 = ((double)(clock() - start9)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Slicing a vector of " << N << " values " << R << " times: " << ms9 << " ms (avg " << ((ms9 / R) * 1000000.0) << " ns/slice)" << endl;
+  
+  Vector* dropped = v->drop(1);
+  Vector* relaxed = dropped->concat(v);
+  dropped->release();
+  uint64_t relaxedsum = 0;
+  clock_t start10 = clock();
+  
+  for (i = 0; i < relaxed->count(); ++i) {
+    relaxedsum += (uint64_t)relaxed->itemAt(i);
+  }
+  
+  double ms10 = ((double)(clock() - start10)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Accessing all " << relaxed->count() << " values of a relaxed vector: " << ms10 << " ms (avg " << ((ms10 / relaxed->count()) * 1000000.0) << " ns/access)" << endl;
+  if (relaxedsum != sum * 2) cerr << "unexpected sum " << relaxedsum << endl;
+  relaxed->release();
+  
+  clock_t start13 = clock();
+  size_t vhash = v->hash();
+  double ms13 = ((double)(clock() - start13)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Hashing all " << N << " values: " << ms13 << " ms (avg " << ((ms13 / N) * 1000000.0) << " ns/value)" << endl;
+  
+  clock_t start14 = clock();
+  
+  size_t hashsum = 0;
+  for (i = 0; i < R; ++i) {
+    Vector* hv = v->assoc((i * 7919) % N, (void*)i);
+    hashsum += hv->hash() + hv->equals(v);
+    hv->release();
+  }
+  
+  double ms14 = ((double)(clock() - start14)) / CLOCKS_PER_SEC * 1000.0;
+  cerr << "Hashing and comparing " << R << " versions of a vector of " << N << " values which differ by one item: " << ms14 << " ms (avg " << ((ms14 / R) * 1000000.0) << " ns/version)" << endl;
+  if (hashsum == vhash) cerr << "unexpected hash " << hashsum << endl; // also avoids stripping
+  
   // Release the vector
   ((Vector*)v)->release();
   v = 0;